@@ -17,6 +17,10 @@ elseif(${CMAKE_SYSTEM_PROCESSOR} MATCHES "x86*" OR
         message(STATUS "Building for architecture: x86")
         set(ARCH_X86 1)
     endif()
+elseif(${CMAKE_SYSTEM_PROCESSOR} MATCHES "aarch64" OR
+       ${CMAKE_SYSTEM_PROCESSOR} MATCHES "arm64")
+    message(STATUS "Building for architecture: arm64")
+    set(ARCH_ARM64 1)
 elseif(${CMAKE_SYSTEM_PROCESSOR} MATCHES "arm*")
     message(STATUS "Building for architecture: arm")
     set(ARCH_OPTIMIZATIONS "-mcpu=cortex-a8 -mtune=cortex-a8 -mfpu=neon")
@@ -0,0 +1,26 @@
+# ------------------------------------------------------------------------------
+# Author:  Garrett Smith
+# File:    cmake/Toolchains/aarch64-linux-gnu.cmake
+# Created: 10/17/2026
+# ------------------------------------------------------------------------------
+#
+# Cross compile for 64-bit ARM Linux with the GNU toolchain, running the tests
+# under qemu user emulation:
+#
+#   cmake -S . -B build-arm64 -DBUILD_SDL=OFF -DHAVE_ARM64_RECOMPILER=ON \
+#       -DCMAKE_TOOLCHAIN_FILE=cmake/Toolchains/aarch64-linux-gnu.cmake
+#   cmake --build build-arm64 && ctest --test-dir build-arm64
+
+set(CMAKE_SYSTEM_NAME Linux)
+set(CMAKE_SYSTEM_PROCESSOR aarch64)
+
+set(CMAKE_C_COMPILER aarch64-linux-gnu-gcc)
+set(CMAKE_CXX_COMPILER aarch64-linux-gnu-g++)
+
+set(GCHIP_SYSROOT /usr/aarch64-linux-gnu CACHE PATH "Target libraries for qemu")
+set(CMAKE_FIND_ROOT_PATH ${GCHIP_SYSROOT})
+set(CMAKE_FIND_ROOT_PATH_MODE_PROGRAM NEVER)
+set(CMAKE_FIND_ROOT_PATH_MODE_LIBRARY ONLY)
+set(CMAKE_FIND_ROOT_PATH_MODE_INCLUDE ONLY)
+
+set(CMAKE_CROSSCOMPILING_EMULATOR qemu-aarch64 -L ${GCHIP_SYSROOT})
@@ -27,6 +27,7 @@ extern long c8_execute_cycles_ptr(c8_context_t *ctx, long cycles);
 extern long c8_execute_cycles_case(c8_context_t *ctx, long cycles);
 extern long c8_execute_cycles_cache(c8_context_t *ctx, long cycles);
 extern long c8_execute_cycles_dbt(c8_context_t *ctx, long cycles);
+extern long c8_execute_cycles_tiered(c8_context_t *ctx, long cycles);
 extern void init_dispatch_tables(void);
 
 // font table taken from Cowgod's Chip-8 Technical Reference v1.0
@@ -66,7 +67,7 @@ static const uint8_t hfont_rom[160] = {
 // -----------------------------------------------------------------------------
 void c8_create_context(c8_context_t **pctx, int mode)
 {
-    c8_context_t *ctx = (c8_context_t *)low_calloc(sizeof(c8_context_t));
+    c8_context_t *ctx = (c8_context_t *)calloc(1, sizeof(c8_context_t));
 
     // initialize program counter and stack pointer
     ctx->pc = 0x200;
@@ -81,11 +82,11 @@ void c8_create_context(c8_context_t **pctx, int mode)
 
     // start with a standard ROM size, but we may need to increase for MCHIP
     ctx->rom_size = ROM_SIZE;
-    ctx->rom = (uint8_t *)low_calloc(ctx->rom_size);
+    ctx->rom = (uint8_t *)calloc(1, ctx->rom_size);
 
     // start with a standard FB size, but we may need to increase for MCHIP
     ctx->gfx_size = SCHIP_XRES * SCHIP_YRES;
-    ctx->gfx = (uint8_t *)low_calloc(ctx->gfx_size);
+    ctx->gfx = (uint8_t *)calloc(1, ctx->gfx_size);
 
     // copy the font rom into th]is context's memory
     memcpy((void *)ctx->rom, lfont_rom, LFONT_SIZE);
@@ -107,9 +108,13 @@ void c8_create_context(c8_context_t **pctx, int mode)
 // -----------------------------------------------------------------------------
 void c8_destroy_context(c8_context_t *ctx)
 {
-    low_free(ctx->gfx);
-    low_free(ctx->rom);
-    low_free(ctx);
+#ifdef HAVE_RECOMPILER
+    xlat_destroy_cache(ctx);
+    free(ctx->jit_cache);
+#endif
+    free(ctx->gfx);
+    free(ctx->rom);
+    free(ctx);
 }
 
 // -----------------------------------------------------------------------------
@@ -131,12 +136,28 @@ int c8_load_file(c8_context_t *ctx, const char *path)
     fseek(fp, 0, SEEK_SET);
 
     log_info("Loading %ld byte rom \"%s\"...\n", length, path);
-    if (length > ctx->rom_size) {
+
+#ifdef HAVE_RECOMPILER
+    // existing translations and their profile refer to the previous program.
+    // drop them first, so no background compile reads memory being replaced
+    if (NULL != ctx->xc)
+        xlat_reset_cache(ctx);
+#endif // HAVE_RECOMPILER
+
+    if (length + 0x200 > (size_t)ctx->rom_size) {
 #ifdef HAVE_MCHIP_SUPPORT
-        // MegaChip programs can use 24-bit addressing with I
+        // MegaChip programs can use 24-bit addressing with I. the address
+        // space stays a power of 2, so that addresses wrap with ROM_MASK
+        int old_size = ctx->rom_size;
         log_info("Exceeded standard ROM size, assuming MegaChip.\n");
-        ctx->rom_size = length + 0x200;
-        ctx->rom = (uint8_t *)low_realloc(ctx->rom, ctx->rom_size);
+        while ((size_t)ctx->rom_size < length + 0x200)
+            ctx->rom_size <<= 1;
+        ctx->rom = (uint8_t *)realloc(ctx->rom, ctx->rom_size);
+        memset(ctx->rom + old_size, 0, ctx->rom_size - old_size);
+#ifdef HAVE_RECOMPILER
+        // the block map is laid out for the old address space
+        xlat_destroy_cache(ctx);
+#endif // HAVE_RECOMPILER
 #else
         // if not MegaChip, there should be no reason for a ROM of this size
         log_err("ROM size exceeds size of program address space.\n");
@@ -147,8 +168,19 @@ int c8_load_file(c8_context_t *ctx, const char *path)
 
     bytes_read = fread((char *)(ctx->rom + 0x200), 1, length, fp);
     fclose(fp);
+    if (length != bytes_read)
+        return -1;
 
-    return (length == bytes_read) ? 0 : -1;
+#ifdef HAVE_RECOMPILER
+    // start from the translations an earlier run of the program saved
+    if (NULL != ctx->jit_cache &&
+            (MODE_DBT == ctx->mode || MODE_TIERED == ctx->mode)) {
+        if (NULL != ctx->xc || 0 == xlat_create_cache(ctx))
+            xlat_load_cache(ctx, ctx->jit_cache, (int)length);
+    }
+#endif // HAVE_RECOMPILER
+
+    return 0;
 }
 
 // -----------------------------------------------------------------------------
@@ -185,7 +217,8 @@ void c8_set_system(c8_context_t *ctx, int system)
         if (ctx->gfx_size < MCHIP_XRES * MCHIP_YRES * 4) {
             log_dbg("Allocating new framebuffer for MegaChip mode.\n");
             ctx->gfx_size = MCHIP_XRES * MCHIP_YRES * 4;
-            ctx->gfx = (uint8_t *)low_realloc(ctx->gfx, ctx->gfx_size);
+            ctx->gfx = (uint8_t *)realloc(ctx->gfx, ctx->gfx_size);
+            memset(ctx->gfx, 0, ctx->gfx_size);
         }
         ctx->fn.set_mode(ctx, SYSTEM_MCHIP, MCHIP_XRES, MCHIP_YRES);
         break;
@@ -214,6 +247,45 @@ void c8_set_debugger_enabled(c8_context_t *ctx, int enable)
         ctx->exec_flags &= ~EXEC_DEBUG;
 }
 
+#ifdef HAVE_RECOMPILER
+// -----------------------------------------------------------------------------
+// Select JIT_* aids for the recompiler. They take effect when the translation
+// cache is created, on the first call to c8_execute_cycles or c8_load_file.
+void c8_set_jit_flags(c8_context_t *ctx, int flags)
+{
+    assert(NULL != ctx);
+    ctx->jit_flags = flags;
+}
+
+// -----------------------------------------------------------------------------
+// Fill stats with figures on the recompiler's work so far. Returns -1 if
+// nothing has been translated for the context.
+int c8_get_jit_stats(const c8_context_t *ctx, c8_jit_stats_t *stats)
+{
+    assert(NULL != ctx && NULL != stats);
+    if (NULL == ctx->xc)
+        return -1;
+#ifdef HAVE_TIERED_COMPILER
+    xlat_lock_tier(ctx->xc);
+#endif // HAVE_TIERED_COMPILER
+    xlat_get_stats(ctx->xc, stats);
+#ifdef HAVE_TIERED_COMPILER
+    xlat_unlock_tier(ctx->xc);
+#endif // HAVE_TIERED_COMPILER
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Save translations under dir when the program is unloaded, and start from
+// them when it is next loaded. Must be set before c8_load_file.
+void c8_set_jit_cache(c8_context_t *ctx, const char *dir)
+{
+    assert(NULL != ctx);
+    free(ctx->jit_cache);
+    ctx->jit_cache = (NULL != dir) ? strdup(dir) : NULL;
+}
+#endif // HAVE_RECOMPILER
+
 // -----------------------------------------------------------------------------
 void c8_set_key_state(c8_context_t *ctx, unsigned int index, int state)
 {
@@ -248,6 +320,10 @@ long c8_execute_cycles(c8_context_t *ctx, long cycles)
 #ifdef HAVE_RECOMPILER
     case MODE_DBT:
         return c8_execute_cycles_dbt(ctx, cycles);
+#endif
+#ifdef HAVE_TIERED_COMPILER
+    case MODE_TIERED:
+        return c8_execute_cycles_tiered(ctx, cycles);
 #endif
     }
     return -1;
@@ -282,6 +358,75 @@ void c8_update_counters(c8_context_t *ctx, int delta)
     }
 }
 
+// -----------------------------------------------------------------------------
+// Return the number of instructions in the idle loop made of op0, op1 and op2
+// in turn from pc, or zero if they do not form one. An idle loop is either a
+// jump to itself, or Fx07 followed by 3xkk or 4xkk on the same register and a
+// jump back to the Fx07, which polls the delay timer. Its only effect is to
+// copy DT into Vx.
+int c8_idle_ops(int pc, int op0, int op1, int op2)
+{
+    // only the first 4KB can be the target of a jump
+    if (pc > 0xFFF)
+        return 0;
+
+    if (op0 == (0x1000 | pc))
+        return 1;
+    if (0xF007 != (op0 & 0xF0FF))
+        return 0;
+
+    if (op2 != (0x1000 | pc) || (op1 & 0x0F00) != (op0 & 0x0F00))
+        return 0;
+    if (0x3000 != (op1 & 0xF000) && 0x4000 != (op1 & 0xF000))
+        return 0;
+    return 3;
+}
+
+// -----------------------------------------------------------------------------
+// Return the number of instructions in the idle loop starting at pc, or zero
+// if there is none there.
+int c8_idle_loop(const c8_context_t *ctx, int pc)
+{
+    int pc1 = (pc + 2) & ROM_MASK(ctx), pc2 = (pc + 4) & ROM_MASK(ctx);
+
+    return c8_idle_ops(pc,
+            (ctx->rom[pc] << 8) | ctx->rom[(pc + 1) & ROM_MASK(ctx)],
+            (ctx->rom[pc1] << 8) | ctx->rom[(pc1 + 1) & ROM_MASK(ctx)],
+            (ctx->rom[pc2] << 8) | ctx->rom[(pc2 + 1) & ROM_MASK(ctx)]);
+}
+
+// -----------------------------------------------------------------------------
+// Fast-forward through the idle loop at the current PC, if there is one and it
+// cannot leave before the delay timer next changes. Only whole iterations that
+// fit into cycles are skipped, so the context ends up exactly as if they had
+// been executed. Returns the number of cycles skipped.
+long c8_skip_idle(c8_context_t *ctx, long cycles)
+{
+    int length = c8_idle_loop(ctx, ctx->pc), pc1, op, spin;
+    long skipped;
+
+    if (0 == length || cycles < length)
+        return 0;
+
+    if (3 == length) {
+        // the loop spins while the skip in its second instruction is not taken
+        pc1 = (ctx->pc + 2) & ROM_MASK(ctx);
+        op = (ctx->rom[pc1] << 8) | ctx->rom[(pc1 + 1) & ROM_MASK(ctx)];
+        if (0x3000 == (op & 0xF000))
+            spin = (op & 0xFF) != ctx->dt;
+        else
+            spin = (op & 0xFF) == ctx->dt;
+        if (!spin)
+            return 0;
+        ctx->v[(op >> 8) & 0xF] = ctx->dt;
+        ctx->opcode = 0x1000 | ctx->pc;
+    }
+
+    skipped = cycles - cycles % length;
+    ctx->cycles += skipped;
+    return skipped;
+}
+
 // -----------------------------------------------------------------------------
 // Draw an 8xN or 8x16 sprite in CHIP8 mode.
 int gfx_draw_chip8_sprite(c8_context_t *ctx, int x, int y, int n)
@@ -292,7 +437,7 @@ int gfx_draw_chip8_sprite(c8_context_t *ctx, int x, int y, int n)
     if (!n) n = 16;
 
     for (j = 0; j < n; ++j) {
-        uint8_t data = ctx->rom[i++];
+        uint8_t data = ctx->rom[i++ & ROM_MASK(ctx)];
         int y_pos = ((y + j) & 0x1F) << 8;
         for (b = 0; b < 8; ++b) {
             int offset = y_pos + (((x + b) & 0x3F) << 1);
@@ -321,7 +466,7 @@ int gfx_draw_hchip_sprite(c8_context_t *ctx, int x, int y, int n)
     if (!n) n = 16;
 
     for (j = 0; j < n; ++j) {
-        uint8_t data = ctx->rom[i++];
+        uint8_t data = ctx->rom[i++ & ROM_MASK(ctx)];
         int y_pos = ((y + j) & 0x3F) << 7;
         for (b = 0; b < 8; ++b) {
             int offset = y_pos + (((x + b) & 0x3F) << 1);
@@ -348,7 +493,7 @@ int gfx_draw_schip_sprite(c8_context_t *ctx, int x, int y, int n)
     if (n > 0) {
         for (j = 0; j < n; ++j) {
             int y_pos = ((y + j) & 0x3F) << 7;
-            uint8_t data = ctx->rom[i++];
+            uint8_t data = ctx->rom[i++ & ROM_MASK(ctx)];
             for (b = 0; b < 8; ++b) {
                 int offset = y_pos + ((x + b) & 0x7F);
                 assert(offset < ctx->gfx_size);
@@ -363,7 +508,8 @@ int gfx_draw_schip_sprite(c8_context_t *ctx, int x, int y, int n)
     else {
         for (j = 0; j < 16; ++j) {
             int y_pos = ((y + j) & 0x3F) << 7;
-            uint16_t data = (ctx->rom[i] << 8) | ctx->rom[i + 1];
+            uint16_t data = (ctx->rom[i & ROM_MASK(ctx)] << 8)
+                          | ctx->rom[(i + 1) & ROM_MASK(ctx)];
             i += 2;
             for (b = 0; b < 16; ++b) {
                 int offset = y_pos + ((x + b) & 0x7F);
@@ -435,7 +581,7 @@ int gfx_draw_mchip_sprite(c8_context_t *ctx, int x, int y, int n)
     for (j = 0; j < ctx->spr_height; ++j) {
         int y_pos = ((y + j) % MCHIP_YRES) * MCHIP_XRES;
         for (b = 0; b < ctx->spr_width; ++b) {
-            int cindex = ctx->rom[i++];
+            int cindex = ctx->rom[i++ & ROM_MASK(ctx)];
             if (cindex) {
                 int offset = y_pos + ((x + b) % MCHIP_XRES);
                 if (gfx[offset] > 0) collision = 1;
@@ -47,11 +47,27 @@
 #define MODE_CACHE  2
 #define MODE_DBT    3
 #define MODE_TEST   4
+#define MODE_TIERED 5
 
 #define EXEC_BREAK  (1 << 0)
 #define EXEC_DEBUG  (1 << 1)
 #define EXEC_SUBSET (1 << 2)
 
+#define JIT_PERF_MAP (1 << 0)   // write symbols for translated code for perf
+#define JIT_GDB      (1 << 1)   // register translated code with gdb
+#define JIT_STATS    (1 << 2)   // count block entries and print statistics
+
+// reasons translated code returns to the dispatcher
+#define JIT_EXIT_CHAIN   0      // static exit not yet linked to its successor
+#define JIT_EXIT_DYNAMIC 1      // indirect branch, return or store into code
+#define JIT_EXIT_BUDGET  2      // cycle budget used up
+#define JIT_EXIT_HOT     3      // block hot enough to be made a trace
+#define JIT_EXIT_IDLE    4      // idle loop skipped the rest of the budget
+#define JIT_EXITS        5
+
+#define JIT_LENGTHS 8           // block lengths 1, 2-3, 4-7, ..., 128 and up
+#define JIT_TOP     8           // blocks listed in each ranking
+
 #define OP_X    ((ctx->opcode >> 8) & 0xF)
 #define OP_Y    ((ctx->opcode >> 4) & 0xF)
 #define OP_N    (ctx->opcode & 0xF)
@@ -59,6 +75,9 @@
 #define OP_T    (ctx->opcode & 0xFFF)
 #define OP_24   ((OP_B << 16) | (ctx->rom[ctx->pc] << 8) | ctx->rom[ctx->pc+1])
 
+// guest addresses wrap at the end of the program address space
+#define ROM_MASK(ctx)   ((ctx)->rom_size - 1)
+
 typedef int (*key_wait_fn)(void *data);
 typedef int (*snd_ctrl_fn)(void *data, int enable);
 typedef int (*set_mode_fn)(void *data, int system, int width, int height);
@@ -71,6 +90,30 @@ typedef struct c8_handlers {
     vid_sync_fn vid_sync;       // synchronize display (for MegaChip)
 } c8_handlers_t;
 
+typedef struct c8_jit_block {
+    int pc;                     // guest address of the block
+    int length;                 // guest instructions translated
+    long visits;                // times entered
+    long cycles;                // guest instructions run, as visits * length
+} c8_jit_block_t;
+
+typedef struct c8_jit_stats {
+    long blocks;                // blocks translated, including traces
+    long traces;                // traces formed from hot blocks
+    double translate_ms;        // time spent translating
+    long guest_ops;             // guest instructions translated
+    long host_bytes;            // host code emitted for them
+    long lengths[JIT_LENGTHS];  // blocks translated, by guest instructions
+    long exits[JIT_EXITS];      // returns to the dispatcher, by JIT_EXIT_*
+    long invalidations;         // stores into guest code that dropped blocks
+    long flushes;               // times the code arena was reset
+    int live;                   // blocks currently translated
+    c8_jit_block_t top_visits[JIT_TOP]; // live blocks entered most often
+    c8_jit_block_t top_cycles[JIT_TOP]; // live blocks running the most code
+} c8_jit_stats_t;
+
+struct xlat_cache;
+
 typedef struct c8_context {
     int v[16];                  // general purpose registers [V0, VF]
     int i, sp, pc, dt, st;      // special purpose registers
@@ -86,8 +129,13 @@ typedef struct c8_context {
     int stack[STACK_SIZE];      // stack space
     uint8_t *rom;               // program address space
     uint8_t *gfx;               // graphics framebuffer
-    int rom_size;               // size of program address space
+    int rom_size;               // size of program address space, a power of 2
     int gfx_size;               // size of graphics framebuffer
+#ifdef HAVE_RECOMPILER
+    struct xlat_cache *xc;      // recompiler translation cache
+    int jit_flags;              // recompiler profiling and debugging aids
+    char *jit_cache;            // directory translations are saved to
+#endif // HAVE_RECOMPILER
 #ifdef HAVE_SCHIP_SUPPORT
     int hp[8];                  // HP48/RPL registers
 #endif // HAVE_SCHIP_SUPPORT
@@ -97,20 +145,32 @@ typedef struct c8_context {
 #endif // HAVE_MCHIP_SUPPORT
 } c8_context_t;
 
+typedef void (FASTCALL *c8_opcode_fn)(c8_context_t *ctx);
+
 void c8_create_context(c8_context_t **pctx, int mode);
 void c8_destroy_context(c8_context_t *ctx);
 int  c8_load_file(c8_context_t *ctx, const char *path);
 long c8_execute_cycles(c8_context_t *ctx, long cycles);
 void c8_update_counters(c8_context_t *ctx, int delta);
+int  c8_idle_ops(int pc, int op0, int op1, int op2);
+int  c8_idle_loop(const c8_context_t *ctx, int pc);
+long c8_skip_idle(c8_context_t *ctx, long cycles);
 
 void c8_set_system(c8_context_t *ctx, int system);
 void c8_set_handlers(c8_context_t *ctx, c8_handlers_t *fn, void *data);
 void c8_set_debugger_enabled(c8_context_t *ctx, int enable);
+#ifdef HAVE_RECOMPILER
+void c8_set_jit_flags(c8_context_t *ctx, int flags);
+void c8_set_jit_cache(c8_context_t *ctx, const char *dir);
+int  c8_get_jit_stats(const c8_context_t *ctx, c8_jit_stats_t *stats);
+#endif // HAVE_RECOMPILER
 void c8_set_key_state(c8_context_t *ctx, unsigned int index, int state);
+c8_opcode_fn c8_decode_opcode(int opcode);
 
 void c8_debug_disassemble(const c8_context_t *ctx, char *o, int s);
-int  c8_debug_instruction(const c8_context_t *ctx, uint16_t pc);
-int  c8_debug_lockstep_test(const char *path);
+int  c8_debug_instruction(const c8_context_t *ctx, int pc);
+int  c8_debug_lockstep(c8_context_t *intp, c8_context_t *other, long cycles);
+int  c8_debug_lockstep_test(const char *path, int mode, long cycles);
 int  c8_debug_cmp_context(const c8_context_t *a, const c8_context_t *b);
 void c8_debug_dump_context(const c8_context_t *ctx);
 
@@ -119,6 +179,9 @@ void gfx_scroll_up(c8_context_t *ctx, int lines);
 void gfx_scroll_right(c8_context_t *ctx);
 void gfx_scroll_left(c8_context_t *ctx);
 int  gfx_draw_sprite(c8_context_t *ctx, int x, int y, int n);
+int  gfx_draw_chip8_sprite(c8_context_t *ctx, int x, int y, int n);
+int  gfx_draw_hchip_sprite(c8_context_t *ctx, int x, int y, int n);
+int  gfx_draw_schip_sprite(c8_context_t *ctx, int x, int y, int n);
 
 #endif // GCHIP_CHIP8__H
 
@@ -26,6 +26,10 @@
 #define CMDLINE_VERSION 0x1000
 #define CMDLINE_BGCOLOR 0x1001
 #define CMDLINE_FGCOLOR 0x1002
+#define CMDLINE_PERFMAP 0x1003
+#define CMDLINE_GDBJIT  0x1004
+#define CMDLINE_JITCACHE 0x1005
+#define CMDLINE_JITSTATS 0x1006
 
 const char *gchip_desc  = "gchip - a portable chip8 emulator";
 const char *gchip_usage = "usage: gchip [options] [file]";
@@ -50,6 +54,9 @@ void cmdline_display_usage(void)
 #endif
 #ifdef HAVE_RECOMPILER
             "dbt "
+#endif
+#ifdef HAVE_TIERED_COMPILER
+            "tiered "
 #endif
             "test\n"
         "  -r, --rom=PATH      path to rom file\n"
@@ -62,6 +69,12 @@ void cmdline_display_usage(void)
         "  -h, --help          display this usage message\n"
         "      --autonomous    fake keypress for benchmarking\n"
         "      --headless      disable graphical display\n"
+#ifdef HAVE_RECOMPILER
+        "      --perf-map      write /tmp/perf-PID.map for translated code\n"
+        "      --gdb-jit       register translated code with gdb\n"
+        "      --jit-cache=DIR save and reuse translated code in DIR\n"
+        "      --jit-stats     print translation statistics at exit\n"
+#endif
         "      --version       display program version\n");
     exit(EXIT_FAILURE);
 }
@@ -84,6 +97,9 @@ void cmdline_display_version(void)
 #ifdef HAVE_RECOMPILER
              "dbt "
 #endif
+#ifdef HAVE_TIERED_COMPILER
+             "tiered "
+#endif
 #ifdef HAVE_HCHIP_SUPPORT
              "hchip "
 #endif
@@ -116,6 +132,10 @@ int cmdline_parse(int argc, char *argv[], cmdargs_t *args)
         { "speed",      required_argument,  NULL, 'S' },
         { "help",       no_argument,        NULL, 'h' },
         { "version",    no_argument,        NULL, CMDLINE_VERSION },
+        { "perf-map",   no_argument,        NULL, CMDLINE_PERFMAP },
+        { "gdb-jit",    no_argument,        NULL, CMDLINE_GDBJIT },
+        { "jit-cache",  required_argument,  NULL, CMDLINE_JITCACHE },
+        { "jit-stats",  no_argument,        NULL, CMDLINE_JITSTATS },
         { NULL,         no_argument,        NULL, 0 }
     };
     int opt, index = 0;
@@ -131,6 +151,8 @@ int cmdline_parse(int argc, char *argv[], cmdargs_t *args)
     args->speed = 1200;
     args->rompath = NULL;
     args->mode = MODE_CASE;
+    args->jit_flags = 0;
+    args->jit_cache = NULL;
 
     while (-1 != (opt = getopt_long(argc, argv, s_opts, l_opts, &index))) {
         switch (opt) {
@@ -149,6 +171,8 @@ int cmdline_parse(int argc, char *argv[], cmdargs_t *args)
                 args->mode = MODE_CACHE;
             else if (!strcmp(optarg, "dbt"))
                 args->mode = MODE_DBT;
+            else if (!strcmp(optarg, "tiered"))
+                args->mode = MODE_TIERED;
             else if (!strcmp(optarg, "test"))
                 args->mode = MODE_TEST;
             else {
@@ -180,6 +204,20 @@ int cmdline_parse(int argc, char *argv[], cmdargs_t *args)
         case CMDLINE_VERSION:
             cmdline_display_version();
             break;
+#ifdef HAVE_RECOMPILER
+        case CMDLINE_PERFMAP:
+            args->jit_flags |= JIT_PERF_MAP;
+            break;
+        case CMDLINE_GDBJIT:
+            args->jit_flags |= JIT_GDB;
+            break;
+        case CMDLINE_JITSTATS:
+            args->jit_flags |= JIT_STATS;
+            break;
+        case CMDLINE_JITCACHE:
+            args->jit_cache = strdup(optarg);
+            break;
+#endif
         case 'h':
         case '?':
             cmdline_display_usage();
@@ -226,5 +264,6 @@ void cmdline_destroy(cmdargs_t *args)
 {
     assert(NULL != args);
     SAFE_FREE(args->rompath);
+    SAFE_FREE(args->jit_cache);
 }
 
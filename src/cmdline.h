@@ -32,6 +32,8 @@ typedef struct cmdargs {
     int vsync;          // enable vertical sync
     int speed;          // control emulator speed (instructions / second)
     int mode;           // TODO: refactor me
+    int jit_flags;      // recompiler profiling and debugging aids
+    char *jit_cache;    // directory to save translated code in, or NULL
     char *rompath;      // path to rom image
 } cmdargs_t;
 
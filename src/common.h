@@ -65,16 +65,15 @@ typedef unsigned long long uint64_t;
 
 #endif // _MSC_VER
 
-#ifdef HAVE_RECOMPILER
-void *low_malloc(size_t length);
-void *low_calloc(size_t length);
-void *low_realloc(void *p, size_t length);
-void  low_free(void *p);
-#else
-#define low_malloc(length) malloc(length)
-#define low_calloc(length) calloc(1, length)
-#define low_realloc(p, length) realloc(p, length)
-#define low_free(p) free(p)
+// ends a case that runs on into the next one. unlike a comment, this also
+// tells the compiler so from within a macro
+#if defined(__has_attribute)
+#if __has_attribute(fallthrough)
+#define FALLTHROUGH __attribute__((fallthrough))
+#endif
+#endif
+#ifndef FALLTHROUGH
+#define FALLTHROUGH do { } while (0)
 #endif
 
 #include <stdarg.h>
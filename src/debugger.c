@@ -17,7 +17,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
 #include <assert.h>
 #include "chip8.h"
 
@@ -79,6 +79,9 @@
 #define dasm_meg_sndoff snprintf(o, s, "stopsnd")
 #define dasm_meg_bmode  snprintf(o, s, "bmode %1X", OP_N)
 
+// instructions a lockstep test runs unless told otherwise
+#define LOCKSTEP_CYCLES 1000000
+
 // -----------------------------------------------------------------------------
 void c8_debug_disassemble(const c8_context_t *ctx, char *o, int s)
 {
@@ -88,7 +91,7 @@ void c8_debug_disassemble(const c8_context_t *ctx, char *o, int s)
 }
 
 // -----------------------------------------------------------------------------
-int c8_debug_instruction(const c8_context_t *ctx, uint16_t pc)
+int c8_debug_instruction(const c8_context_t *ctx, int pc)
 {
     char buffer[64];
     int i;
@@ -116,50 +119,104 @@ int c8_debug_instruction(const c8_context_t *ctx, uint16_t pc)
 }
 
 // -----------------------------------------------------------------------------
-int c8_debug_lockstep_test(const char *path)
+static int lockstep_key_wait(void *data)
 {
-    c8_context_t *intp, *xlat;
-    c8_create_context(&intp, MODE_CASE);
-    c8_create_context(&xlat, MODE_DBT);
+    return 0;
+}
 
-    if ((0 > c8_load_file(intp, path)) || (0 > c8_load_file(xlat, path))) {
-        log_err("error: failed to load rom\n");
-        return 1;
-    }
+// -----------------------------------------------------------------------------
+static int lockstep_snd_ctrl(void *data, int enable)
+{
+    return 0;
+}
 
-    c8_set_debugger_enabled(intp, 1);
+// -----------------------------------------------------------------------------
+static int lockstep_set_mode(void *data, int system, int width, int height)
+{
+    return 0;
+}
 
-    for (;;) {
-        // need to guarantee identical execution of RND instruction
-        unsigned int random_seed = (unsigned int)time(NULL);
-        long num_cycles;
+// -----------------------------------------------------------------------------
+static int lockstep_vid_sync(void *data)
+{
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Run intp, which must use the case interpreter, and other side by side for
+// at most cycles instructions (LOCKSTEP_CYCLES if not positive), comparing the
+// two after every slice. Both must have the same program loaded. Slices vary
+// from one instruction to a full tick so that blocks are entered and left at
+// every offset. Returns 0 if both agree until the bound or until the program
+// exits, 1 otherwise.
+int c8_debug_lockstep(c8_context_t *intp, c8_context_t *other, long cycles)
+{
+    c8_handlers_t fn = {
+        lockstep_key_wait, lockstep_snd_ctrl,
+        lockstep_set_mode, lockstep_vid_sync
+    };
+    long done, slice, num_cycles;
+
+    c8_set_handlers(intp, &fn, intp);
+    c8_set_handlers(other, &fn, other);
+
+    if (cycles <= 0)
+        cycles = LOCKSTEP_CYCLES;
 
-        // execute binary translator, check number of effective cycles executed
-        xlat->cycles = 0;
-        srand(random_seed);
-        num_cycles = c8_execute_cycles(xlat, 1);
+    for (done = slice = 0; done < cycles; done += num_cycles, ++slice) {
+        // 337 is coprime to 997, so every slice length up to a tick is used
+        num_cycles = 1 + (slice * 337) % 997;
+        if (num_cycles > cycles - done)
+            num_cycles = cycles - done;
 
-        // execute same number of cycles in interpreter
-        intp->cycles = 0;
-        srand(random_seed);
+        // need to guarantee identical execution of RND instruction
+        srand((unsigned int)slice);
+        c8_execute_cycles(other, num_cycles);
+        srand((unsigned int)slice);
         c8_execute_cycles(intp, num_cycles);
 
+        c8_update_counters(intp, 1);
+        c8_update_counters(other, 1);
+
         // compare state of registers and memory
-        if (c8_debug_cmp_context(intp, xlat)) {
-            log_dbg("error at PC A=%02X B=%02X\n", intp->pc, xlat->pc);
+        if (c8_debug_cmp_context(intp, other)) {
+            log_dbg("error after %ld cycles at PC A=%03X B=%03X\n",
+                    done + num_cycles, intp->pc, other->pc);
 
             log_dbg("===== Dumping Interpreter Registers =====\n");
             c8_debug_dump_context(intp);
 
             log_dbg("===== Dumping Translator Registers =====\n");
-            c8_debug_dump_context(xlat);
+            c8_debug_dump_context(other);
             return 1;
         }
+
+        // the program has exited (00FD)
+        if (intp->exec_flags & EXEC_BREAK)
+            break;
     }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Load the rom at path into the case interpreter and into the given mode, and
+// run the two in lockstep as c8_debug_lockstep does.
+int c8_debug_lockstep_test(const char *path, int mode, long cycles)
+{
+    c8_context_t *intp, *other;
+    int result = 1;
+
+    c8_create_context(&intp, MODE_CASE);
+    c8_create_context(&other, mode);
+
+    if ((0 > c8_load_file(intp, path)) || (0 > c8_load_file(other, path)))
+        log_err("error: failed to load rom\n");
+    else
+        result = c8_debug_lockstep(intp, other, cycles);
 
     c8_destroy_context(intp);
-    c8_destroy_context(xlat);
-    return 0;
+    c8_destroy_context(other);
+    return result;
 }
 
 // -----------------------------------------------------------------------------
@@ -206,6 +263,30 @@ int c8_debug_cmp_context(const c8_context_t *a, const c8_context_t *b)
         mismatch = 1;
     }
 
+    // only one of the two may have exited
+    if ((a->exec_flags ^ b->exec_flags) & EXEC_BREAK) {
+        log_dbg("EXIT mismatch (A=%X B=%X)\n", a->exec_flags, b->exec_flags);
+        mismatch = 1;
+    }
+
+    // compare memory and display, reporting the first difference
+    if (a->rom_size != b->rom_size) {
+        log_dbg("ROM size mismatch (A=%X B=%X)\n", a->rom_size, b->rom_size);
+        mismatch = 1;
+    }
+    for (i = 0; i < a->rom_size && i < b->rom_size; ++i) {
+        if (a->rom[i] == b->rom[i])
+            continue;
+        log_dbg("ROM[%04X] mismatch (A=%02X B=%02X)\n", i, a->rom[i], b->rom[i]);
+        mismatch = 1;
+        break;
+    }
+    if (a->system != b->system || a->gfx_size != b->gfx_size ||
+            memcmp(a->gfx, b->gfx, a->gfx_size)) {
+        log_dbg("GFX mismatch\n");
+        mismatch = 1;
+    }
+
     return mismatch;
 }
 
@@ -473,6 +473,10 @@ int main(int argc, char *argv[])
 
     // create the emulator context and load the specified rom file
     c8_create_context(&ctx, args.mode);
+#ifdef HAVE_RECOMPILER
+    c8_set_jit_flags(ctx, args.jit_flags);
+    c8_set_jit_cache(ctx, args.jit_cache);
+#endif
     if (0 > c8_load_file(ctx, args.rompath)) {
         log_err("failed to load rom\n");
         return 1;
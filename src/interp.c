@@ -20,6 +20,7 @@
 #include <string.h>
 #include <assert.h>
 #include "chip8.h"
+#include "xlat.h"
 
 // -----------------------------------------------------------------------------
 void check_for_hires(c8_context_t *ctx)
@@ -193,13 +194,13 @@ static void FASTCALL op_drw(c8_context_t *ctx)
 // -----------------------------------------------------------------------------
 static void FASTCALL op_key_seq(c8_context_t *ctx)
 {
-    if (ctx->keypad[ctx->v[OP_X]]) ctx->pc += 2;
+    if (ctx->keypad[ctx->v[OP_X] & 0xF]) ctx->pc += 2;
 }
 
 // -----------------------------------------------------------------------------
 static void FASTCALL op_key_sne(c8_context_t *ctx)
 {
-    if (!ctx->keypad[ctx->v[OP_X]]) ctx->pc += 2;
+    if (!ctx->keypad[ctx->v[OP_X] & 0xF]) ctx->pc += 2;
 }
 
 // -----------------------------------------------------------------------------
@@ -245,9 +246,12 @@ static void FASTCALL op_mem_font(c8_context_t *ctx)
 static void FASTCALL op_mem_bcd(c8_context_t *ctx)
 {
     int value = ctx->v[OP_X];
-    ctx->rom[ctx->i + 0] = value / 100;
-    ctx->rom[ctx->i + 1] = (value % 100) / 10;
-    ctx->rom[ctx->i + 2] = (value % 10);
+    ctx->rom[(ctx->i + 0) & ROM_MASK(ctx)] = value / 100;
+    ctx->rom[(ctx->i + 1) & ROM_MASK(ctx)] = (value % 100) / 10;
+    ctx->rom[(ctx->i + 2) & ROM_MASK(ctx)] = (value % 10);
+#ifdef HAVE_RECOMPILER
+    xlat_invalidate_range(ctx, ctx->i, 3);
+#endif // HAVE_RECOMPILER
 }
 
 // -----------------------------------------------------------------------------
@@ -255,7 +259,10 @@ static void FASTCALL op_mem_wr(c8_context_t *ctx)
 {
     int offset, end = OP_X;
     for (offset = 0; offset <= end; ++offset)
-        ctx->rom[ctx->i + offset] = ctx->v[offset];
+        ctx->rom[(ctx->i + offset) & ROM_MASK(ctx)] = ctx->v[offset];
+#ifdef HAVE_RECOMPILER
+    xlat_invalidate_range(ctx, ctx->i, end + 1);
+#endif // HAVE_RECOMPILER
 }
 
 // -----------------------------------------------------------------------------
@@ -263,7 +270,7 @@ static void FASTCALL op_mem_rd(c8_context_t *ctx)
 {
     int offset, end = OP_X;
     for (offset = 0; offset <= end; ++offset)
-        ctx->v[offset] = ctx->rom[ctx->i + offset];
+        ctx->v[offset] = ctx->rom[(ctx->i + offset) & ROM_MASK(ctx)];
 }
 
 // -----------------------------------------------------------------------------
@@ -375,11 +382,10 @@ static void FASTCALL op_meg_ldpal(c8_context_t *ctx)
     if (ctx->system == SYSTEM_MCHIP) {
         int i, palette_size = OP_B, addr = ctx->i;
         for (i = 1; i <= palette_size; ++i) {
-            uint32_t c = *(uint32_t *)&ctx->rom[addr];
-            int b = (c >> 24) & 0xFF;
-            int g = (c >> 16) & 0xFF;
-            int r = (c >> 8) & 0xFF;
-            int a = c & 0xFF;
+            uint32_t a = ctx->rom[(addr + 0) & ROM_MASK(ctx)];
+            uint32_t r = ctx->rom[(addr + 1) & ROM_MASK(ctx)];
+            uint32_t g = ctx->rom[(addr + 2) & ROM_MASK(ctx)];
+            uint32_t b = ctx->rom[(addr + 3) & ROM_MASK(ctx)];
             ctx->palette[i] = (a << 24) | (b << 16) | (g << 8) | r;
             addr += 4;
         }
@@ -529,16 +535,21 @@ opcode_fn mem_tab[0x100];
 // -----------------------------------------------------------------------------
 long c8_execute_cycles_ptr(c8_context_t *ctx, long cycles)
 {
-    uint16_t pc;
+    int pc;
     check_for_hires(ctx);
     while (0 != cycles--) {
         pc = ctx->pc;
-        ctx->opcode = (ctx->rom[pc] << 8) | ctx->rom[pc + 1];
-        ctx->pc = (pc + 2) & (ROM_SIZE - 1);
+        ctx->opcode = (ctx->rom[pc] << 8) | ctx->rom[(pc + 1) & ROM_MASK(ctx)];
+        ctx->pc = (pc + 2) & ROM_MASK(ctx);
 
-        if (ctx->exec_flags && c8_debug_instruction(ctx, pc)) break;
+        if (ctx->exec_flags && c8_debug_instruction(ctx, pc)) {
+            ctx->pc = pc;
+            break;
+        }
         opc_tab[ctx->opcode >> 12](ctx);
         ++ctx->cycles;
+        if (0x1000 == (ctx->opcode & 0xF000) && !ctx->exec_flags)
+            cycles -= c8_skip_idle(ctx, cycles);
     }
 
     return 0;
@@ -549,18 +560,23 @@ long c8_execute_cycles_ptr(c8_context_t *ctx, long cycles)
 // -----------------------------------------------------------------------------
 long c8_execute_cycles_case(c8_context_t *ctx, long cycles)
 {
-    uint16_t pc;
+    int pc;
     check_for_hires(ctx);
     while (0 != cycles--) {
         pc = ctx->pc;
-        ctx->opcode = (ctx->rom[pc] << 8) | ctx->rom[pc + 1];
-        ctx->pc = (pc + 2) & (ROM_SIZE - 1);
+        ctx->opcode = (ctx->rom[pc] << 8) | ctx->rom[(pc + 1) & ROM_MASK(ctx)];
+        ctx->pc = (pc + 2) & ROM_MASK(ctx);
 
-        if (ctx->exec_flags && c8_debug_instruction(ctx, pc)) break;
+        if (ctx->exec_flags && c8_debug_instruction(ctx, pc)) {
+            ctx->pc = pc;
+            break;
+        }
 #       define OPCODE ctx->opcode
 #       define OP(x) op_##x(ctx)
 #       include "decode.inc"
         ++ctx->cycles;
+        if (0x1000 == (ctx->opcode & 0xF000) && !ctx->exec_flags)
+            cycles -= c8_skip_idle(ctx, cycles);
     }
 
     return 0;
@@ -571,13 +587,22 @@ long c8_execute_cycles_case(c8_context_t *ctx, long cycles)
 // -----------------------------------------------------------------------------
 long c8_execute_cycles_cache(c8_context_t *ctx, long cycles)
 {
-    opcode_fn cache[ROM_SIZE];
-    uint16_t opcodes[ROM_SIZE], pc;
-    int i;
+    opcode_fn *cache;
+    uint16_t *opcodes;
+    int i, pc;
+
+    // one entry for each address, as the program may run from any of them
+    cache = (opcode_fn *)malloc(ctx->rom_size * sizeof(opcode_fn));
+    opcodes = (uint16_t *)malloc(ctx->rom_size * sizeof(uint16_t));
+    if (NULL == cache || NULL == opcodes) {
+        free(cache);
+        free(opcodes);
+        return 0;
+    }
 
     check_for_hires(ctx);
-    for (i = 0; i < ROM_SIZE; ++i) {
-        opcodes[i] = (ctx->rom[i] << 8) | ctx->rom[i + 1];
+    for (i = 0; i < ctx->rom_size; ++i) {
+        opcodes[i] = (ctx->rom[i] << 8) | ctx->rom[(i + 1) & ROM_MASK(ctx)];
         switch (opcodes[i] >> 12) {
         case 0x0: cache[i] = sys_tab[opcodes[i] & 0xFF]; break;
         case 0x8: cache[i] = reg_tab[opcodes[i] & 0x0F]; break;
@@ -590,14 +615,34 @@ long c8_execute_cycles_cache(c8_context_t *ctx, long cycles)
     while (0 != cycles--) {
         pc = ctx->pc;
         ctx->opcode = opcodes[pc];
-        ctx->pc = (pc + 2) & (ROM_SIZE - 1);
+        ctx->pc = (pc + 2) & ROM_MASK(ctx);
 
-        if (ctx->exec_flags && c8_debug_instruction(ctx, pc)) break;
+        if (ctx->exec_flags && c8_debug_instruction(ctx, pc)) {
+            ctx->pc = pc;
+            break;
+        }
         cache[pc](ctx);
         ++ctx->cycles;
+        if (0x1000 == (ctx->opcode & 0xF000) && !ctx->exec_flags)
+            cycles -= c8_skip_idle(ctx, cycles);
     }
 
+    free(cache);
+    free(opcodes);
     return 0;
 }
 #endif // HAVE_CACHE_INTERPRETER
 
+// -----------------------------------------------------------------------------
+// Look up the interpreter handler for an opcode. The recompiler uses this to
+// fall back to the interpreter for instructions it does not translate.
+c8_opcode_fn c8_decode_opcode(int opcode)
+{
+    c8_opcode_fn fn = op_bad;
+#   undef OPCODE
+#   undef OP
+#   define OPCODE opcode
+#   define OP(x) fn = op_##x
+#   include "decode.inc"
+    return fn;
+}
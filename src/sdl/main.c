@@ -424,11 +424,15 @@ int main(int argc, char *argv[])
     // special case: perform lockstep execution test (CASE & DBT)
     if (ca.mode == MODE_TEST) {
         log_info("comparing interpreter and binary translator...\n");
-        return c8_debug_lockstep_test(ca.rompath);
+        return c8_debug_lockstep_test(ca.rompath, MODE_DBT, ca.max_cycles);
     }
 
     // create the emulator context and load the specified rom file
     c8_create_context(&ctx, ca.mode);
+#ifdef HAVE_RECOMPILER
+    c8_set_jit_flags(ctx, ca.jit_flags);
+    c8_set_jit_cache(ctx, ca.jit_cache);
+#endif
     if (0 > c8_load_file(ctx, ca.rompath)) {
         log_err("failed to load rom \"%s\"\n", ca.rompath);
         return 1;
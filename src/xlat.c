@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <assert.h>
 #include "chip8.h"
 #include "xlat.h"
 
@@ -33,143 +34,1318 @@
 #define O_B (xs->opcode & 0xFF)
 #define O_T (xs->opcode & 0xFFF)
 
-#define R_SP 16
-#define R_PC 17
-#define R_I  18
-#define R_DT 19
-#define R_ST 20
+#define XLAT_CACHE_SIZE  (1 << 20) // size of the executable code arena
+#define XLAT_CODE_ALIGN  16         // alignment of blocks within the arena
+#define XLAT_BLOCK_SIZE  4096       // space reserved to translate a block
+#define XLAT_BLOCK_LIMIT 3072       // stop translating once a block hits this
+#define XLAT_LOOKAHEAD   64         // instructions scanned to choose a spill
+#define XLAT_PIN_SAMPLE  1024       // dispatches profiled before pinning
+#define XLAT_TRACE_HEAT  128        // block entries before forming a trace
 
-void temp_clear_screen(c8_context_t *ctx)
+// -----------------------------------------------------------------------------
+// Map a region of memory that may be both written and executed.
+static uint8_t *xlat_map_code(long length)
 {
-    log_spew("temp_clear_screen(%p)\n", ctx);
-    memset(ctx->gfx, 0, ctx->gfx_size);
-    ctx->dirty = 1;
+#ifdef PLATFORM_WIN32
+    void *p = VirtualAlloc(NULL, length, MEM_COMMIT, PAGE_EXECUTE_READWRITE);
+#else
+    void *p = mmap(NULL, length, PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (MAP_FAILED == p)
+        p = NULL;
+#endif // PLATFORM_WIN32
+
+    return (uint8_t *)p;
 }
 
 // -----------------------------------------------------------------------------
-void *low_malloc(size_t length)
+// Release a region previously returned by xlat_map_code.
+static void xlat_unmap_code(uint8_t *p, long length)
 {
-#ifdef ARCH_X86_64
-    return mmap(NULL, length, PROT_READ | PROT_WRITE,
-                MAP_ANONYMOUS | MAP_PRIVATE | MAP_32BIT, 0, 0);
+#ifdef PLATFORM_WIN32
+    VirtualFree(p, 0, MEM_RELEASE);
 #else
-    return malloc(length);
-#endif // ARCH_X86_64
+    munmap(p, length);
+#endif // PLATFORM_WIN32
 }
 
 // -----------------------------------------------------------------------------
-void *low_calloc(size_t length)
+// Forget the targets remembered by a block's indirect jump.
+static void xlat_clear_ic(xlat_block_t *xb)
 {
-#ifdef ARCH_X86_64
-    void *p = mmap(NULL, length, PROT_READ | PROT_WRITE,
-                   MAP_ANONYMOUS | MAP_PRIVATE | MAP_32BIT, 0, 0);
-    memset(p, 0, length);
-    return p;
-#else
-    return calloc(1, length);
-#endif // ARCH_X86_64
+    int i;
+    for (i = 0; i < XLAT_IC_SIZE; ++i) {
+        xb->ic[i].code = NULL;
+        xb->ic[i].pc = -1;
+    }
 }
 
 // -----------------------------------------------------------------------------
-void *low_realloc(void *p, size_t length)
+// Reserve space at the top of the code arena for a block of up to length
+// bytes. The arena is flushed if the request cannot otherwise be satisfied.
+// The record is left unpublished, with no code, until it is committed.
+int xlat_alloc_block(xlat_cache_t *xc, xlat_block_t *xb, long length)
 {
-#ifdef ARCH_X86_64
-    low_free(p);
-    return low_calloc(length);
-#else
-    return realloc(p, length);
-#endif
+    if (length > xc->code_size - xc->code_base) {
+        log_err("xlat block of %ld bytes exceeds code cache\n", length);
+        return -1;
+    }
+
+    if (xc->code_used + length > xc->code_size)
+        xlat_flush_cache(xc);
+
+    xb->ptr = xc->code + xc->code_used;
+    xb->length = length;
+    xb->num_cycles = 0;
+    xb->visits = 0;
+    xb->num_exits = 0;
+    xb->idle = 0;
+    xb->trace = 0;
+    xb->countdown = 0;
+    xb->num_segs = 0;
+    xb->incoming = NULL;
+    xlat_clear_ic(xb);
+    return 0;
 }
 
 // -----------------------------------------------------------------------------
-void low_free(void *p)
+// Adjust the block count of every guest memory region in [pc, pc + size).
+static void xlat_count_run(xlat_cache_t *xc, int pc, int size, int delta)
 {
-#ifdef ARCH_X86_64
-#else
-    free(p);
-#endif // ARCH_X86_64
+    int first = pc >> XLAT_REGION_SHIFT;
+    int last = ((pc + size - 1) & xc->addr_mask) >> XLAT_REGION_SHIFT;
+    int r;
+
+    for (r = first; ; r = (r + 1) % XLAT_REGIONS(xc)) {
+        xc->regions[r] += delta;
+        if (r == last)
+            break;
+    }
 }
 
 // -----------------------------------------------------------------------------
-// Allocate an executable translation block of the specified length.
-int xlat_alloc_block(xlat_block_t *xb, long length)
+// Adjust the block count of every guest memory region covered by xb.
+static void xlat_count_regions(xlat_cache_t *xc, xlat_block_t *xb, int delta)
 {
-#ifdef PLATFORM_WIN32
-    void *p = VirtualAlloc(NULL, length, MEM_COMMIT, PAGE_EXECUTE_READWRITE);
-#else
-    void *p = mmap(NULL, length, PROT_READ | PROT_WRITE | PROT_EXEC,
-                   MAP_ANONYMOUS | MAP_PRIVATE | MAP_32BIT, 0, 0);
-#endif // PLATFORM_WIN32
+    int i;
+
+    xlat_count_run(xc, xb->pc, xb->size, delta);
+    for (i = 0; i < xb->num_segs; ++i)
+        xlat_count_run(xc, xb->segs[i].pc, xb->segs[i].size, delta);
+}
+
+// -----------------------------------------------------------------------------
+// Return nonzero if any guest code translated into xb lies in [addr, end).
+static int xlat_block_overlaps(const xlat_block_t *xb, int addr, int end)
+{
+    int i;
+
+    if (xb->pc < end && xb->pc + xb->size > addr)
+        return 1;
+    for (i = 0; i < xb->num_segs; ++i)
+        if (xb->segs[i].pc < end && xb->segs[i].pc + xb->segs[i].size > addr)
+            return 1;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Shrink the block to the code actually emitted, bump the arena past it and
+// publish it. From then on the block may be run, with a compiler thread even
+// before this returns, so nothing it refers to may change afterwards.
+void xlat_commit_block(xlat_cache_t *xc, xlat_block_t *xb)
+{
+    uint8_t *start = xc->code + xc->code_used;
+    long used = (long)(xb->ptr - start);
+    assert(used <= xb->length);
+
+    xb->length = used;
+    xc->code_used += (used + XLAT_CODE_ALIGN - 1) & ~(XLAT_CODE_ALIGN - 1);
+    xc->unsaved = 1;
+
+    // the code lies past anything run since the arena was last flushed, and
+    // is only reached through this pointer or ones taken from it
+    xlat_flush_icache(start, used);
+    XLAT_STORE_RELEASE(&xb->block, start);
+    xlat_register_block(xc, xb);
+}
+
+// -----------------------------------------------------------------------------
+// Record a block whose code is in place, so that stores into the guest code it
+// covers find it, and make it known to any profiler or debugger.
+void xlat_register_block(xlat_cache_t *xc, xlat_block_t *xb)
+{
+    xlat_count_regions(xc, xb, 1);
+    xc->max_size = MAX(xc->max_size, xb->size);
+    if (xb->num_segs)
+        xc->traces[xc->num_traces++] = xb->pc;
+    xlat_perf_add_block(xc, xb);
+    if (xc->jit_flags & JIT_GDB)
+        xlat_gdb_add_block(xb);
+}
+
+// -----------------------------------------------------------------------------
+// Name a block after the guest code it translates, for profilers and
+// debuggers.
+void xlat_name_block(const xlat_block_t *xb, char *name, int size)
+{
+    snprintf(name, size, "%s_0x%X_len%d",
+             xb->trace ? "c8_trace" : "c8_block", xb->pc, xb->size);
+}
+
+// -----------------------------------------------------------------------------
+// Discard a single block. Its code stays in the arena until the next flush.
+static void xlat_drop_block(xlat_cache_t *xc, xlat_block_t *xb)
+{
+    int i;
+
+    log_spew("dropping xlat block @PC=%04X\n", xb->pc);
+    xlat_unlink_block(xb);
+    xlat_count_regions(xc, xb, -1);
+    xlat_gdb_remove_block(xb);
+    if (xb->num_segs) {
+        for (i = 0; xc->traces[i] != xb->pc; ++i)
+            ;
+        xc->traces[i] = xc->traces[--xc->num_traces];
+    }
+    memset(xb, 0, sizeof(xlat_block_t));
+    xc->perf_stale = 1;
+}
+
+// -----------------------------------------------------------------------------
+// Forget every prediction of translated code, after blocks have been dropped.
+static void xlat_forget_predictions(xlat_cache_t *xc)
+{
+    int i;
+
+    memset(xc->ras, 0, sizeof(xc->ras));
+    xc->pending = NULL;
+    if (xc->ic_used) {
+        for (i = 0; i < XLAT_RECORDS(xc); ++i)
+            xlat_clear_ic(&xc->pool[i]);
+        xc->ic_used = 0;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Discard every translated block and reset the code arena.
+void xlat_flush_cache(xlat_cache_t *xc)
+{
+    log_spew("flushing xlat cache (%ld bytes used)\n", xc->code_used);
+    if (xc->jit_flags & JIT_GDB)
+        xlat_gdb_remove_all(xc);
+    memset(xc->pool, 0, XLAT_RECORDS(xc) * sizeof(xlat_block_t));
+    memset(xc->regions, 0, XLAT_REGIONS(xc) * sizeof(uint16_t));
+    memset(xc->ras, 0, sizeof(xc->ras));
+    xc->ic_used = 0;
+    xc->pending = NULL;
+    xc->num_traces = 0;
+    xc->code_used = xc->code_base;
+    ++xc->flushes;
+    xc->perf_stale = 1;
+    xlat_perf_sync(xc);
+}
+
+// -----------------------------------------------------------------------------
+// Return the block record for guest address pc, or NULL if nothing has been
+// recorded in its range of guest memory.
+xlat_block_t *xlat_lookup_block(const xlat_cache_t *xc, int pc)
+{
+    xlat_block_t *leaf = XLAT_LOAD_ACQUIRE(&xc->map[pc >> XLAT_MAP_SHIFT]);
+    return (NULL == leaf) ? NULL : &leaf[pc & (XLAT_MAP_LEAF - 1)];
+}
+
+// -----------------------------------------------------------------------------
+// Return the block record for guest address pc, taking a leaf from the pool
+// for its range if necessary. Returns NULL if the pool is exhausted.
+xlat_block_t *xlat_map_block(xlat_cache_t *xc, int pc)
+{
+    xlat_block_t **leaf = &xc->map[pc >> XLAT_MAP_SHIFT];
+
+    if (NULL == *leaf) {
+        xlat_block_t *records = &xc->pool[xc->num_leaves << XLAT_MAP_SHIFT];
+        if (xc->max_leaves == xc->num_leaves)
+            return NULL;
+        ++xc->num_leaves;
+        XLAT_STORE_RELEASE(leaf, records);
+    }
+    return &(*leaf)[pc & (XLAT_MAP_LEAF - 1)];
+}
+
+// -----------------------------------------------------------------------------
+// Return every leaf to the pool. The records must already be empty.
+static void xlat_clear_map(xlat_cache_t *xc)
+{
+    memset(xc->map, 0, xc->num_dirs * sizeof(xlat_block_t *));
+    xc->num_leaves = 0;
+}
+
+// -----------------------------------------------------------------------------
+// Return nonzero if the arena may not have room for another block.
+int xlat_cache_full(const xlat_cache_t *xc)
+{
+    return xc->code_used + XLAT_BLOCK_SIZE > xc->code_size;
+}
+
+// -----------------------------------------------------------------------------
+// Discard every translation and return every leaf to the pool. This must only
+// be called where no block is being translated or run.
+void xlat_empty_cache(xlat_cache_t *xc)
+{
+    xlat_flush_cache(xc);
+    xlat_clear_map(xc);
+}
+
+// -----------------------------------------------------------------------------
+// Return the block record for guest address pc, emptying the cache if the
+// pool is exhausted. This must only be called where no block is being
+// translated or run.
+xlat_block_t *xlat_get_block(xlat_cache_t *xc, int pc)
+{
+    xlat_block_t *xb = xlat_map_block(xc, pc);
+
+    if (NULL == xb) {
+        log_spew("xlat block map is full, flushing\n");
+        xlat_empty_cache(xc);
+        xb = xlat_map_block(xc, pc);
+    }
+    return xb;
+}
+
+// -----------------------------------------------------------------------------
+// Patch an exit to jump straight into the translated successor block.
+void xlat_link_exit(xlat_exit_t *xe, xlat_block_t *target)
+{
+    assert(NULL == xe->target && target->pc == xe->target_pc);
+    xe->target = target;
+    xe->next = target->incoming;
+    target->incoming = xe;
+    xlat_patch_jump(xe->site, target->block);
+}
+
+// -----------------------------------------------------------------------------
+// Detach a block from the chain graph so that it can be discarded. Exits that
+// jump into the block are reverted to return to the dispatcher, and exits
+// leaving the block are removed from their successors.
+void xlat_unlink_block(xlat_block_t *xb)
+{
+    xlat_exit_t *xe, **pxe;
+    int i;
+
+    for (xe = xb->incoming; NULL != xe; xe = xe->next) {
+        xlat_patch_jump(xe->site, xe->stub);
+        xe->target = NULL;
+    }
+    xb->incoming = NULL;
+
+    for (i = 0; i < xb->num_exits; ++i) {
+        xlat_block_t *target = xb->exits[i].target;
+        if (NULL == target)
+            continue;
+        for (pxe = &target->incoming; NULL != *pxe; pxe = &(*pxe)->next) {
+            if (*pxe == &xb->exits[i]) {
+                *pxe = xb->exits[i].next;
+                break;
+            }
+        }
+        xlat_patch_jump(xb->exits[i].site, xb->exits[i].stub);
+        xb->exits[i].target = NULL;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Drop every block that translated guest memory in [addr, addr + length) and
+// return how many were dropped. Like the store itself, the range wraps around
+// the top of guest memory. This must be called whenever the guest stores into
+// its own address space.
+int xlat_invalidate_range(c8_context_t *ctx, int addr, int length)
+{
+    xlat_cache_t *xc = ctx->xc;
+    int pc, end, r, hit = 0, dropped = 0;
+
+    if (NULL == xc || length <= 0)
+        return 0;
+
+    addr &= xc->addr_mask;
+    if (addr + length > ctx->rom_size) {
+        int wrapped = addr + length - ctx->rom_size;
+        return xlat_invalidate_range(ctx, addr, length - wrapped) +
+               xlat_invalidate_range(ctx, 0, wrapped);
+    }
+
+#ifdef HAVE_TIERED_COMPILER
+    // the tiered interpreter keeps its own copy of decoded instructions
+    if (NULL != xc->tier)
+        xlat_forget_opcodes(xc, addr, length);
+#endif // HAVE_TIERED_COMPILER
+
+    // most stores land in data, so only scan when a region holds code
+    end = addr + length;
+    for (r = addr >> XLAT_REGION_SHIFT; r <= (end - 1) >> XLAT_REGION_SHIFT; ++r)
+        hit |= xc->regions[r];
+    if (!hit)
+        return 0;
+
+    // a block overlapping the store must start within max_size bytes of it,
+    // possibly at the top of memory if it wraps around
+    for (pc = addr - xc->max_size + 1; pc < end; ++pc) {
+        xlat_block_t *xb = xlat_lookup_block(xc, pc & xc->addr_mask);
+        if (NULL != xb && NULL != xb->block && pc + xb->size > addr) {
+            xlat_drop_block(xc, xb);
+            ++dropped;
+        }
+    }
+
+    // traces may also cover runs of code far from where they start
+    for (r = 0; r < xc->num_traces; ) {
+        xlat_block_t *xb = xlat_lookup_block(xc, xc->traces[r]);
+        if (xlat_block_overlaps(xb, addr, end)) {
+            xlat_drop_block(xc, xb);
+            ++dropped;
+        }
+        else {
+            ++r;
+        }
+    }
+
+    // predicted targets may refer to the dropped code
+    if (dropped) {
+        xlat_forget_predictions(xc);
+        xlat_perf_sync(xc);
+        ++xc->invalidations;
+    }
+    return dropped;
+}
+
+// -----------------------------------------------------------------------------
+// Emit the enter and exit stubs at the start of the arena. They survive
+// flushes, since every block refers to them, but depend on the pinned
+// registers and so are emitted again whenever those change.
+void xlat_emit_stubs(xlat_cache_t *xc)
+{
+    xlat_block_t stubs;
+
+    stubs.block = stubs.ptr = xc->code;
+    xc->enter = (xlat_enter_fn)stubs.ptr;
+    xlat_emit_enter_stub(xc, &stubs);
+    xc->exit = stubs.ptr;
+    xlat_emit_exit_stub(xc, &stubs);
+
+    xc->code_base = (stubs.ptr - xc->code + XLAT_CODE_ALIGN - 1)
+                  & ~(XLAT_CODE_ALIGN - 1);
+    xlat_flush_icache(xc->code, (long)(stubs.ptr - xc->code));
+}
+
+// -----------------------------------------------------------------------------
+// Discard every translation along with the register profile, for instance
+// because a different program is about to be loaded. The translations are
+// saved first if a cache directory is in use.
+void xlat_reset_cache(c8_context_t *ctx)
+{
+    xlat_cache_t *xc = ctx->xc;
+
+#ifdef HAVE_TIERED_COMPILER
+    xlat_pause_tier(xc);
+#endif // HAVE_TIERED_COMPILER
+    xlat_save_cache(ctx);
+    free(xc->save_path);
+    xc->save_path = NULL;
+    xc->num_pins = 0;
+    xc->pins_chosen = 0;
+    xc->dispatches = 0;
+    xc->num_helpers = 0;
+    xlat_emit_stubs(xc);
+    xlat_empty_cache(xc);
+#ifdef HAVE_TIERED_COMPILER
+    xlat_resume_tier(xc);
+#endif // HAVE_TIERED_COMPILER
+}
 
-    if (!p) {
-        log_err("failed to allocate executable xlat block\n");
+// -----------------------------------------------------------------------------
+// Allocate the translation cache for ctx, laid out for its address space. It
+// persists until the context is destroyed or the address space grows.
+int xlat_create_cache(c8_context_t *ctx)
+{
+    int dirs = ctx->rom_size >> XLAT_MAP_SHIFT;
+    int leaves = MIN(dirs, XLAT_MAX_LEAVES);
+    xlat_cache_t *xc;
+    uint8_t *p;
+
+    assert(sizeof(xlat_ras_t) == (1 << XLAT_RAS_SHIFT));
+
+    // only the code arena is executable. block records, helper pointers and
+    // the rest are kept apart and reached through the context. translated
+    // code addresses records by offset from the cache, so the pool follows it
+    xc = (xlat_cache_t *)calloc(1, sizeof(xlat_cache_t) +
+            ((size_t)leaves << XLAT_MAP_SHIFT) * sizeof(xlat_block_t));
+    if (NULL == xc) {
+        log_err("failed to allocate xlat block records\n");
         return -1;
     }
 
-    xb->block = (uint8_t *)p;
-    xb->ptr = (uint8_t *)p;
-    xb->length = length;
-    xb->num_cycles = 0;
-    xb->visits = 0;
+    xc->addr_mask = ctx->rom_size - 1;
+    xc->num_dirs = dirs;
+    xc->max_leaves = leaves;
+    xc->pool = (xlat_block_t *)(xc + 1);
+    xc->map = (xlat_block_t **)calloc(dirs, sizeof(xlat_block_t *));
+    xc->regions = (uint16_t *)calloc(XLAT_REGIONS(xc), sizeof(uint16_t));
+    p = xlat_map_code(XLAT_CACHE_SIZE);
+    if (NULL == xc->map || NULL == xc->regions || NULL == p) {
+        log_err("failed to allocate executable xlat code cache\n");
+        if (NULL != p)
+            xlat_unmap_code(p, XLAT_CACHE_SIZE);
+        free(xc->regions);
+        free(xc->map);
+        free(xc);
+        return -1;
+    }
+
+    xc->code = p;
+    xc->code_size = XLAT_CACHE_SIZE;
+
+    xlat_emit_stubs(xc);
+    xc->code_used = xc->code_base;
+    xc->jit_flags = ctx->jit_flags;
+    if (ctx->jit_flags & JIT_PERF_MAP)
+        xlat_perf_open(xc);
+
+    ctx->xc = xc;
     return 0;
 }
 
 // -----------------------------------------------------------------------------
-// Free and clear the allocated translation block.
-void xlat_free_block(xlat_block_t *xb)
+// Release the cache along with its code arena.
+void xlat_destroy_cache(c8_context_t *ctx)
 {
-#ifdef PLATFORM_WIN32
-    VirtualFree(xb->block, 0, MEM_RELEASE);
-#else
-    munmap(xb->block, xb->length);
-#endif // PLATFORM_WIN32
+    if (NULL == ctx->xc)
+        return;
 
-    memset(xb, 0, sizeof(xlat_block_t));
+#ifdef HAVE_TIERED_COMPILER
+    xlat_destroy_tier(ctx->xc);
+#endif // HAVE_TIERED_COMPILER
+    if (ctx->xc->jit_flags & JIT_STATS)
+        xlat_print_stats(ctx->xc);
+    xlat_save_cache(ctx);
+    free(ctx->xc->save_path);
+    xlat_perf_close(ctx->xc);
+    if (ctx->xc->jit_flags & JIT_GDB)
+        xlat_gdb_remove_all(ctx->xc);
+    xlat_unmap_code(ctx->xc->code, ctx->xc->code_size);
+    free(ctx->xc->regions);
+    free(ctx->xc->map);
+    free(ctx->xc);
+    ctx->xc = NULL;
 }
 
 // -----------------------------------------------------------------------------
-static int xlat_sys_cls(xlat_state_t *xs)
+// Return the set of guest registers the instruction reads or writes while it
+// keeps them mapped. Instructions that end the block or hand every register
+// back to the context set *barrier, since no mapping survives past them.
+static uint32_t xlat_guest_uses(int opcode, int *barrier)
+{
+    uint32_t reads, writes;
+    int flags = xlat_guest_regs(opcode, &reads, &writes);
+
+    *barrier = (flags & XLAT_GUEST_BARRIER) != 0;
+    return reads | writes;
+}
+
+// -----------------------------------------------------------------------------
+// Count the instructions from the one being translated until guest register
+// reg is next used. Registers that are not used again before the end of the
+// lookahead window, or before every mapping is released anyway, are reported
+// as XLAT_LOOKAHEAD.
+int xlat_next_use(const xlat_state_t *xs, int reg)
+{
+    int n, i, barrier = 0;
+
+    for (n = 0; n < XLAT_LOOKAHEAD && xs->ir_pos + n < xs->ir_len; ++n) {
+        const xlat_ir_t *ir = &xs->ir[xs->ir_pos + n];
+        uint32_t uses = 0;
+        int b;
+
+        // a followed branch keeps every mapping
+        for (i = 0; i < ir->num_ops; ++i) {
+            uses |= xlat_guest_uses(ir->op[i], &b);
+            barrier |= b && !(ir->flags & XLAT_IR_FOLLOW);
+        }
+        if (uses & (1u << reg))
+            return n;
+        if (barrier)
+            break;
+    }
+
+    return XLAT_LOOKAHEAD;
+}
+
+#ifdef HAVE_REGISTER_PINNING
+// -----------------------------------------------------------------------------
+// Pin the guest registers used most by the blocks run so far, weighting each
+// block by the number of times the dispatcher entered it. The arena is
+// flushed, since existing blocks assume the previous set.
+static void xlat_choose_pins(c8_context_t *ctx)
+{
+    static const int candidates[] = {
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, R_I, R_SP
+    };
+    xlat_cache_t *xc = ctx->xc;
+    long uses[GUEST_REGS] = { 0 };
+    int r, s, i, j, barrier, count = 0;
+
+    for (r = 0; r < XLAT_RECORDS(xc); ++r) {
+        xlat_block_t *xb = &xc->pool[r];
+        if (NULL == xb->block)
+            continue;
+        for (s = -1; s < xb->num_segs; ++s) {
+            int start = (s < 0) ? xb->pc : xb->segs[s].pc;
+            int size = (s < 0) ? xb->size : xb->segs[s].size;
+            for (i = 0; i < size; i += 2) {
+                int addr = (start + i) & ROM_MASK(ctx);
+                int opcode = (ctx->rom[addr] << 8)
+                           | ctx->rom[(addr + 1) & ROM_MASK(ctx)];
+                uint32_t mask = xlat_guest_uses(opcode, &barrier);
+                for (j = 0; j < GUEST_REGS; ++j)
+                    if (mask & (1u << j))
+                        uses[j] += xb->visits + 1;
+            }
+        }
+    }
+
+    // take the most used candidates, ignoring registers that are never used
+    while (count < XLAT_MAX_PINS) {
+        int best = -1;
+        for (i = 0; i < (int)(sizeof(candidates) / sizeof(candidates[0])); ++i) {
+            int reg = candidates[i];
+            if (uses[reg] > 0 && (best < 0 || uses[reg] > uses[best]))
+                best = reg;
+        }
+        if (best < 0)
+            break;
+        xc->pins[count++].reg = best;
+        uses[best] = 0;
+    }
+
+    for (i = 0; i < count; ++i) {
+        int reg = xc->pins[i].reg;
+        if (R_I == reg) {
+            xc->pins[i].bits = 32;
+            xc->pins[i].offset = XLAT_CTX(i);
+        }
+        else if (R_SP == reg) {
+            xc->pins[i].bits = 16;
+            xc->pins[i].offset = XLAT_CTX(sp);
+        }
+        else {
+            xc->pins[i].bits = 8;
+            xc->pins[i].offset = XLAT_CTX(v) + reg * (int)sizeof(int);
+        }
+    }
+
+    xc->num_pins = xlat_assign_pins(xc->pins, count);
+    xc->pins_chosen = 1;
+    for (i = 0; i < xc->num_pins; ++i)
+        log_dbg("pinning guest register %d to host register %d\n",
+                xc->pins[i].reg, xc->pins[i].host_reg);
+
+    xlat_emit_stubs(xc);
+    xlat_flush_cache(xc);
+}
+
+// -----------------------------------------------------------------------------
+// Count a dispatch towards the register profile. Once enough have run, the
+// cache is rebuilt around the hottest registers.
+void xlat_sample_pins(c8_context_t *ctx)
+{
+    xlat_cache_t *xc = ctx->xc;
+    if (!xc->pins_chosen && ++xc->dispatches >= XLAT_PIN_SAMPLE)
+        xlat_choose_pins(ctx);
+}
+#endif // HAVE_REGISTER_PINNING
+
+// -----------------------------------------------------------------------------
+// Emit the block head. Unless the cycle budget covers every instruction the
+// block may run, control returns to the dispatcher with the PC at the start of
+// this block, reporting XLAT_EXIT_SHORT, and the rest of the budget is
+// interpreted. A profiled block also returns there, reporting XLAT_EXIT_HOT,
+// on the entry that uses up its countdown. With JIT_STATS every entry is
+// counted, chained ones included.
+void xlat_emit_prologue(xlat_state_t *xs)
+{
+    xlat_cache_t *xc = xs->ctx->xc;
+    xlat_block_t *xb = xs->xb;
+    uint8_t *site;
+
+    // every decoded instruction is charged at most one cycle per entry
+    if (xs->ir_len <= 0x80)
+        xlat_emit_cmp_i8m32(xb, (int8_t)(xs->ir_len - 1),
+                            XLAT_CACHE(budget));
+    else
+        xlat_emit_cmp_i32m32(xb, xs->ir_len - 1, XLAT_CACHE(budget));
+    site = xlat_emit_jcc_i32(xb, XLAT_CC_G, NULL);
+    xlat_emit_mov_i32rm_offset(xb, xb->pc, XLAT_CTX_REG, XLAT_CTX(pc));
+    xlat_emit_mov_i32m32(xb, XLAT_EXIT_SHORT, XLAT_CACHE(exit_id));
+    xlat_emit_jmp_i32(xb, xc->exit);
+    xlat_patch_jump(site, xb->ptr);
+
+    if (xc->jit_flags & JIT_STATS)
+        xlat_emit_add_i32m32(xb, 1, XLAT_CACHE_OFFSET(xc, &xb->visits));
+
+    if (xs->profile) {
+        xlat_emit_sub_i32m32(xb, 1, XLAT_CACHE_OFFSET(xc, &xb->countdown));
+        xlat_emit_cmp_i8m32(xb, 0, XLAT_CACHE_OFFSET(xc, &xb->countdown));
+        site = xlat_emit_jcc_i32(xb, XLAT_CC_NE, NULL);
+        xlat_emit_mov_i32rm_offset(xb, xb->pc, XLAT_CTX_REG, XLAT_CTX(pc));
+        xlat_emit_mov_i32m32(xb, XLAT_EXIT_HOT, XLAT_CACHE(exit_id));
+        xlat_emit_jmp_i32(xb, xc->exit);
+        xlat_patch_jump(site, xb->ptr);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Emit a chainable exit to a statically known guest address. The leading jump
+// falls through to a stub that reports the exit to the dispatcher until it is
+// linked directly to the translated successor.
+void xlat_emit_exit(xlat_state_t *xs, int pc)
+{
+    xlat_cache_t *xc = xs->ctx->xc;
+    xlat_block_t *xb = xs->xb;
+    xlat_exit_t *xe = &xb->exits[xb->num_exits];
+
+    assert(xb->num_exits < XLAT_MAX_EXITS);
+    xe->target_pc = pc;
+    xe->taken = 0;
+    xe->target = NULL;
+    xe->next = NULL;
+
+    if (xs->profile)
+        xlat_emit_add_i32m32(xb, 1, XLAT_CACHE_OFFSET(xc, &xe->taken));
+    xlat_emit_sub_i32m32(xb, xb->num_cycles, XLAT_CACHE(budget));
+    xe->site = xlat_emit_jmp_i32(xb, NULL);
+    xe->stub = xb->ptr;
+    xlat_emit_mov_i32rm_offset(xb, pc, XLAT_CTX_REG, XLAT_CTX(pc));
+    xlat_emit_mov_i32m32(xb, XLAT_EXIT_ID(xb->pc, xb->num_exits),
+                         XLAT_CACHE(exit_id));
+    xlat_emit_jmp_i32(xb, xc->exit);
+    ++xb->num_exits;
+}
+
+// -----------------------------------------------------------------------------
+// Emit an exit whose successor is only known at runtime. The guest PC must
+// already have been committed to the emulator context.
+void xlat_emit_exit_dynamic(xlat_state_t *xs)
+{
+    xlat_cache_t *xc = xs->ctx->xc;
+    xlat_emit_sub_i32m32(xs->xb, xs->xb->num_cycles, XLAT_CACHE(budget));
+    xlat_emit_jmp_i32(xs->xb, xc->exit);
+}
+
+// -----------------------------------------------------------------------------
+// Record the translation of a 2nnn return address on the return address
+// stack. The entry is empty if the continuation is not yet translated, and
+// nothing is pushed if the block map has no room to record it.
+void xlat_emit_ras_push(xlat_state_t *xs, int pc)
+{
+    xlat_cache_t *xc = xs->ctx->xc;
+    xlat_block_t *xb = xs->xb;
+    xlat_block_t *next = xlat_map_block(xc, pc);
+    int rax, rcx;
+
+    // a missing entry only makes the matching 00EE return to the dispatcher
+    if (NULL == next)
+        return;
+
+    rax = xlat_reserve_register_index(xs, 32, 0);
+    rcx = xlat_reserve_register_index(xs, 32, 1);
+
+    xlat_emit_mov_m32r32(xb, XLAT_CACHE(ras_top), rax);
+    xlat_emit_add_i32r64(xb, 1, rax);
+    xlat_emit_and_i32r32(xb, XLAT_RAS_SIZE - 1, rax);
+    xlat_emit_mov_r32m32(xb, rax, XLAT_CACHE(ras_top));
+    xlat_emit_shl_i8r64(xb, XLAT_RAS_SHIFT, rax);
+    xlat_emit_lea_m64r64(xb, XLAT_CACHE(ras), rcx);
+    xlat_emit_add_r64r64(xb, rcx, rax);
+    xlat_emit_mov_m64r64(xb, XLAT_CACHE_OFFSET(xc, &next->block), rcx);
+    xlat_emit_mov_r64rm_offset(xb, rcx, rax, 0);
+    xlat_emit_mov_i32rm_offset(xb, pc, rax, 8);
+}
+
+// -----------------------------------------------------------------------------
+// Emit the exit for 00EE given the host register holding the guest return
+// address. Control passes straight to the translation predicted by the return
+// address stack, or back to the dispatcher if the prediction is wrong.
+void xlat_emit_exit_return(xlat_state_t *xs, int rpc)
+{
+    xlat_cache_t *xc = xs->ctx->xc;
+    xlat_block_t *xb = xs->xb;
+    int rax = xlat_reserve_register_index(xs, 32, 0);
+    int rcx = xlat_reserve_register_index(xs, 32, 1);
+
+    // pop the newest entry
+    xlat_emit_mov_m32r32(xb, XLAT_CACHE(ras_top), rax);
+    xlat_emit_mov_m32r32(xb, XLAT_CACHE(ras_top), rcx);
+    xlat_emit_add_i32r64(xb, -1, rcx);
+    xlat_emit_and_i32r32(xb, XLAT_RAS_SIZE - 1, rcx);
+    xlat_emit_mov_r32m32(xb, rcx, XLAT_CACHE(ras_top));
+    xlat_emit_shl_i8r64(xb, XLAT_RAS_SHIFT, rax);
+    xlat_emit_lea_m64r64(xb, XLAT_CACHE(ras), rcx);
+    xlat_emit_add_r64r64(xb, rcx, rax);
+
+    // the register write back only moves data, leaving the comparison intact
+    xlat_emit_sub_i32m32(xb, xb->num_cycles, XLAT_CACHE(budget));
+    xlat_emit_cmp_r32rm_offset(xb, rpc, rax, 8);
+    xlat_emit_epilogue(xs);
+    xlat_emit_jcc_i32(xb, XLAT_CC_NE, xc->exit);
+
+    xlat_emit_mov_rmr64_offset(xb, rax, rax, 0);
+    xlat_emit_test_r64r64(xb, rax, rax);
+    xlat_emit_jcc_i32(xb, XLAT_CC_E, xc->exit);
+    xlat_emit_jmp_r64(xb, rax);
+}
+
+// -----------------------------------------------------------------------------
+// Emit the exit for Bnnn given the host register holding the computed guest
+// target. Recent targets are checked first, then the block map is searched
+// inline; only untranslated targets return to the dispatcher.
+void xlat_emit_exit_indirect(xlat_state_t *xs, int rpc)
+{
+    xlat_cache_t *xc = xs->ctx->xc;
+    xlat_block_t *xb = xs->xb;
+    xlat_ic_t *ic = xb->ic;
+    int rax = xlat_reserve_register_index(xs, 32, 0);
+    int rcx = xlat_reserve_register_index(xs, 32, 1);
+    uint8_t *site;
+    int i;
+
+    // rpc keeps its value after write back, it is just no longer mapped
+    xlat_emit_epilogue(xs);
+    xlat_emit_sub_i32m32(xb, xb->num_cycles, XLAT_CACHE(budget));
+
+    for (i = 0; i < XLAT_IC_SIZE; ++i) {
+        xlat_emit_cmp_r32m32(xb, rpc, XLAT_CACHE_OFFSET(xc, &ic[i].pc));
+        site = xlat_emit_jcc_i32(xb, XLAT_CC_NE, NULL);
+        xlat_emit_mov_m64r64(xb, XLAT_CACHE_OFFSET(xc, &ic[i].code), rax);
+        xlat_emit_jmp_r64(xb, rax);
+        xlat_patch_jump(site, xb->ptr);
+    }
+
+    // rax = xc->map[pc >> XLAT_MAP_SHIFT]
+    xlat_emit_mov_r32r32(xb, rpc, rax);
+    xlat_emit_shr_i8r32(xb, XLAT_MAP_SHIFT, rax);
+    xlat_emit_shl_i8r64(xb, 3, rax);
+    xlat_emit_mov_m64r64(xb, XLAT_CACHE(map), rcx);
+    xlat_emit_add_r64r64(xb, rcx, rax);
+    xlat_emit_mov_rmr64_offset(xb, rax, rax, 0);
+    xlat_emit_test_r64r64(xb, rax, rax);
+    xlat_emit_jcc_i32(xb, XLAT_CC_E, xc->exit);
+
+    // rax = leaf[pc & (XLAT_MAP_LEAF - 1)].block
+    xlat_emit_mov_r32r32(xb, rpc, rcx);
+    xlat_emit_and_i32r32(xb, XLAT_MAP_LEAF - 1, rcx);
+    xlat_emit_imul_i32r32(xb, sizeof(xlat_block_t), rcx, rcx);
+    xlat_emit_add_r64r64(xb, rcx, rax);
+    xlat_emit_mov_rmr64_offset(xb, rax, rax, offsetof(xlat_block_t, block));
+    xlat_emit_test_r64r64(xb, rax, rax);
+    xlat_emit_jcc_i32(xb, XLAT_CC_E, xc->exit);
+
+    // age the inline cache and remember this target
+    for (i = XLAT_IC_SIZE - 1; i > 0; --i) {
+        xlat_emit_mov_m64r64(xb, XLAT_CACHE_OFFSET(xc, &ic[i - 1].code), rcx);
+        xlat_emit_mov_r64m64(xb, rcx, XLAT_CACHE_OFFSET(xc, &ic[i].code));
+        xlat_emit_mov_m32r32(xb, XLAT_CACHE_OFFSET(xc, &ic[i - 1].pc), rcx);
+        xlat_emit_mov_r32m32(xb, rcx, XLAT_CACHE_OFFSET(xc, &ic[i].pc));
+    }
+    xlat_emit_mov_r64m64(xb, rax, XLAT_CACHE_OFFSET(xc, &ic[0].code));
+    xlat_emit_mov_r32m32(xb, rpc, XLAT_CACHE_OFFSET(xc, &ic[0].pc));
+    xlat_emit_mov_i32m32(xb, 1, XLAT_CACHE(ic_used));
+    xlat_emit_jmp_r64(xb, rax);
+}
+
+// -----------------------------------------------------------------------------
+// Return the V registers and I that the instruction reads and set *writes to
+// those it always overwrites. Instructions that may skip, leave the block or
+// run C code that looks at the context are reported as reading everything.
+static uint32_t xlat_guest_access(int opcode, uint32_t *writes)
+{
+    uint32_t reads, vi = 0xFFFF | (1u << R_I);
+    int flags = xlat_guest_regs(opcode, &reads, writes);
+
+    if (flags & (XLAT_GUEST_SKIP | XLAT_GUEST_CALL | XLAT_GUEST_BARRIER)) {
+        *writes = 0;
+        return ~0u;
+    }
+
+    *writes &= vi;
+    return reads & vi;
+}
+
+// -----------------------------------------------------------------------------
+// Set VF from host condition cc, which must already be in the flags.
+static void xlat_emit_flag_cc(xlat_state_t *xs, int cc)
+{
+    int tmp = xlat_reserve_register_index(xs, 32, 0), rvf;
+    xlat_emit_setcc_r8(xs->xb, cc, tmp);
+    rvf = xlat_reserve_register_wo(xs, 8, 0xF, &xs->ctx->v[0xF]);
+    xlat_emit_mov_r8r8(xs->xb, tmp, rvf);
+}
+
+// -----------------------------------------------------------------------------
+// Record that VF is to be computed by op from the operands of the current
+// instruction, once something needs it. The old value of VF is dead from here
+// on, so it is released without being written back.
+static void xlat_defer_flag(xlat_state_t *xs, int op)
+{
+    xs->flag_op = op;
+    xs->flag_x = O_X;
+    xs->flag_y = O_Y;
+
+    if (xs->reg_map[0xF] >= 0 && !(xs->pinned & (1u << 0xF))) {
+        xs->dirty &= ~(1u << 0xF);
+        xlat_free_register(xs, 0xF);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Record that VF is to be computed by op from VF itself, or from I for Fx1E,
+// rather than from the operands of the current instruction.
+static void xlat_defer_flag_self(xlat_state_t *xs, int op)
+{
+    xs->flag_op = op;
+    xs->flag_x = 0xF;
+    xs->flag_y = 0xF;
+}
+
+// -----------------------------------------------------------------------------
+// Wrap the sum Fx1E left in I to 16 bits.
+static void xlat_emit_wrap_i(xlat_state_t *xs)
+{
+    int ri = xlat_reserve_register_rw(xs, 32, R_I, &xs->ctx->i);
+    xlat_emit_and_i32r32(xs->xb, 0xFFFF, ri);
+}
+
+// -----------------------------------------------------------------------------
+// Emit the deferred VF computation, if there is one. This may only be called
+// between instructions.
+static void xlat_emit_flag(xlat_state_t *xs)
+{
+    int op = xs->flag_op, x = xs->flag_x, y = xs->flag_y, rx, ry, ri, tmp;
+    if (XLAT_FLAG_NONE == op)
+        return;
+
+    // nothing stays locked between instructions, and with registers pinned
+    // there may be no other host registers left for the operands
+    xs->flag_op = XLAT_FLAG_NONE;
+    xs->locked = 0;
+
+    switch (op) {
+    case XLAT_FLAG_SHR:
+        rx = xlat_reserve_register_rw(xs, 8, 0xF, &xs->ctx->v[0xF]);
+        xlat_emit_and_i8r8(xs->xb, 1, rx);
+        return;
+    case XLAT_FLAG_SHL:
+        rx = xlat_reserve_register_rw(xs, 8, 0xF, &xs->ctx->v[0xF]);
+        xlat_emit_shr_i8r8(xs->xb, 7, rx);
+        return;
+    case XLAT_FLAG_ADDI:
+        ri = xlat_reserve_register_rw(xs, 32, R_I, &xs->ctx->i);
+        xlat_emit_cmp_i32r32(xs->xb, 0xFFF, ri);
+        xlat_emit_flag_cc(xs, XLAT_CC_A);
+        xlat_emit_and_i32r32(xs->xb, 0xFFFF, ri);
+        return;
+    }
+
+    rx = xlat_reserve_register(xs, 8, x, &xs->ctx->v[x]);
+    ry = xlat_reserve_register(xs, 8, y, &xs->ctx->v[y]);
+
+    switch (op) {
+    case XLAT_FLAG_ADD:
+        xlat_emit_cmp_r8r8(xs->xb, ry, rx);
+        op = XLAT_CC_A;
+        break;
+    case XLAT_FLAG_SUB:
+        tmp = xlat_reserve_register_index(xs, 32, 0);
+        xlat_emit_mov_r8r8(xs->xb, rx, tmp);
+        xlat_emit_add_r8r8(xs->xb, ry, tmp);
+        op = XLAT_CC_NC;
+        break;
+    default:
+        assert(XLAT_FLAG_SUBN == op);
+        xlat_emit_cmp_r8r8(xs->xb, ry, rx);
+        op = XLAT_CC_AE;
+        break;
+    }
+
+    // the operands have been consumed, so VF may take either register
+    xs->locked = 0;
+    xlat_emit_flag_cc(xs, op);
+}
+
+// -----------------------------------------------------------------------------
+// Settle a deferred VF computation ahead of the current instruction. It is
+// emitted if the instruction may observe VF or is about to change one of the
+// operands, and dropped if the instruction overwrites VF. The sum Fx1E left
+// in I is wrapped before anything else uses I, whether or not VF is needed.
+static void xlat_settle_flag(xlat_state_t *xs)
+{
+    uint32_t reads, writes;
+    if (XLAT_FLAG_NONE == xs->flag_op)
+        return;
+
+    reads = xlat_guest_access(xs->opcode, &writes);
+    if (reads & (1u << 0xF))
+        xlat_emit_flag(xs);
+    else if (XLAT_FLAG_ADDI == xs->flag_op && ((reads | writes) & (1u << R_I)))
+        xlat_emit_flag(xs);
+    else if (writes & (1u << 0xF)) {
+        if (XLAT_FLAG_ADDI == xs->flag_op)
+            xlat_emit_wrap_i(xs);
+        xs->flag_op = XLAT_FLAG_NONE;
+    }
+    else if (writes & ((1u << xs->flag_x) | (1u << xs->flag_y)))
+        xlat_emit_flag(xs);
+}
+
+// -----------------------------------------------------------------------------
+// Determine whether the instruction at pc may be skipped without leaving the
+// block. It must have been decoded with its skip, and its translation must be
+// a single instruction that does not itself open a skip. The block also needs
+// room for any exits it emits. The instruction is judged as decoded, as guest
+// memory may have changed since.
+static int xlat_can_skip_inline(xlat_state_t *xs)
+{
+    const xlat_ir_t *next = &xs->ir[xs->ir_pos + 1];
+    int i;
+
+    if (xs->ir_pos + 1 >= xs->ir_len || !(next->flags & XLAT_IR_SHADOW) ||
+            xs->xb->num_exits > XLAT_MAX_EXITS - 3)
+        return 0;
+
+    for (i = 0; i < next->num_ops; ++i) {
+        switch (next->op[i] & 0xF000) {
+        case 0x3000: case 0x4000: case 0x5000: case 0x9000: case 0xE000:
+            return 0;
+        case 0x0000:
+            // MegaChip LDHI is four bytes long, but a skip only steps over two
+            if (0x0100 == (next->op[i] & 0xFF00))
+                return 0;
+            break;
+        }
+    }
+    return 1;
+}
+
+// -----------------------------------------------------------------------------
+// Emit a conditional skip. The host flags must already hold the comparison;
+// the next instruction is skipped when cc is satisfied. A trace continues
+// along the side it was formed for and leaves through a side exit otherwise.
+// When possible this is a forward jump within the block, which lower_block
+// resolves after the next instruction. Otherwise the block ends with an exit
+// for each outcome.
+static int xlat_emit_skip(xlat_state_t *xs, int cc)
+{
+    int flags = xs->ir[xs->ir_pos].flags;
+    uint32_t dirty = xs->dirty;
+    uint8_t *site;
+    int i;
+
+    if (flags & XLAT_IR_EXIT) {
+        // the registers stay mapped on the path that continues
+        int taken = flags & XLAT_IR_TAKEN;
+        site = xlat_emit_jcc_i32(xs->xb, taken ? cc : cc ^ 1, NULL);
+        for (i = 0; i < GUEST_REGS; ++i)
+            if (xs->reg_map[i] >= 0 && !(xs->pinned & (1u << i)))
+                xlat_commit_register(xs, xs->reg_bits[i], i);
+        xlat_emit_exit(xs, taken ? xs->pc : (xs->pc + 2) & ROM_MASK(xs->ctx));
+        xlat_patch_jump(site, xs->xb->ptr);
+        xs->dirty = dirty;
+        return 0;
+    }
+
+    if (xlat_can_skip_inline(xs)) {
+        xs->skip_site = xlat_emit_jcc_i32(xs->xb, cc, NULL);
+        return 0;
+    }
+
+    xlat_emit_epilogue(xs);
+    site = xlat_emit_jcc_i32(xs->xb, cc, NULL);
+    xlat_emit_exit(xs, xs->pc);
+    xlat_patch_jump(site, xs->xb->ptr);
+    xlat_emit_exit(xs, (xs->pc + 2) & ROM_MASK(xs->ctx));
+    return 1;
+}
+
+// -----------------------------------------------------------------------------
+// Called by translated code to perform Fx55. Stores go through the helpers
+// below rather than being inlined, as a compiler thread may be decoding guest
+// memory, so they are made under the tier lock.
+static int xlat_store_regs(c8_context_t *ctx, int x)
+{
+    int offset, dropped;
+
+#ifdef HAVE_TIERED_COMPILER
+    xlat_lock_tier(ctx->xc);
+#endif // HAVE_TIERED_COMPILER
+    for (offset = 0; offset <= x; ++offset)
+        ctx->rom[(ctx->i + offset) & ROM_MASK(ctx)] = ctx->v[offset];
+    dropped = xlat_invalidate_range(ctx, ctx->i, x + 1);
+#ifdef HAVE_TIERED_COMPILER
+    xlat_unlock_tier(ctx->xc);
+#endif // HAVE_TIERED_COMPILER
+    return dropped;
+}
+
+// -----------------------------------------------------------------------------
+// Called by translated code to perform Fx33.
+static int xlat_store_bcd(c8_context_t *ctx, int x)
+{
+    int value = ctx->v[x], dropped;
+
+#ifdef HAVE_TIERED_COMPILER
+    xlat_lock_tier(ctx->xc);
+#endif // HAVE_TIERED_COMPILER
+    ctx->rom[(ctx->i + 0) & ROM_MASK(ctx)] = value / 100;
+    ctx->rom[(ctx->i + 1) & ROM_MASK(ctx)] = (value % 100) / 10;
+    ctx->rom[(ctx->i + 2) & ROM_MASK(ctx)] = (value % 10);
+    dropped = xlat_invalidate_range(ctx, ctx->i, 3);
+#ifdef HAVE_TIERED_COMPILER
+    xlat_unlock_tier(ctx->xc);
+#endif // HAVE_TIERED_COMPILER
+    return dropped;
+}
+
+// C functions translated code may call other than the interpreter's handlers,
+// with the ids they are saved by. Handlers are saved by the opcode they were
+// decoded from, so these ids start above every opcode. An id must never be
+// given to a different function, as saved translations refer to it. 0x10001
+// was the check that followed an inline Fx55 store.
+static const struct xlat_helper {
+    int id;
+    void *fn;
+} xlat_helpers[] = {
+    { 0x10000, (void *)rand },
+    { 0x10002, (void *)xlat_store_bcd },
+    { 0x10003, (void *)xlat_draw_chip8 },
+#ifdef HAVE_HCHIP_SUPPORT
+    { 0x10004, (void *)xlat_draw_hchip },
+#endif // HAVE_HCHIP_SUPPORT
+#ifdef HAVE_SCHIP_SUPPORT
+    { 0x10005, (void *)xlat_draw_schip },
+#endif // HAVE_SCHIP_SUPPORT
+    { 0x10006, (void *)gfx_draw_sprite },
+#ifdef HAVE_SCHIP_SUPPORT
+    { 0x10007, (void *)gfx_scroll_down },
+    { 0x10008, (void *)gfx_scroll_right },
+    { 0x10009, (void *)gfx_scroll_left },
+#endif // HAVE_SCHIP_SUPPORT
+    { 0x1000A, (void *)xlat_store_regs },
+};
+
+#define XLAT_NUM_HELPERS (int)(sizeof(xlat_helpers) / sizeof(xlat_helpers[0]))
+
+// -----------------------------------------------------------------------------
+// Return the id helper f called by the instruction being translated is saved
+// by, or -1 if it has none.
+static int xlat_helper_id(const xlat_state_t *xs, const void *f)
+{
+    int i;
+
+    for (i = 0; i < XLAT_NUM_HELPERS; ++i)
+        if (xlat_helpers[i].fn == f)
+            return xlat_helpers[i].id;
+    if ((void *)c8_decode_opcode(xs->opcode) == f)
+        return xs->opcode;
+    return -1;
+}
+
+// -----------------------------------------------------------------------------
+// Return the slot of the helper table holding f, claiming a free one the
+// first time f is called. Translated code calls C functions through these
+// slots rather than embedding their addresses.
+void **xlat_helper_slot(xlat_state_t *xs, void *f)
 {
-    xlat_emit_call_1(xs, (void *)temp_clear_screen, (size_t)xs->ctx);
+    xlat_cache_t *xc = xs->ctx->xc;
+    int i;
+
+    for (i = 0; i < xc->num_helpers; ++i)
+        if (xc->helpers[i] == f)
+            return &xc->helpers[i];
+
+    assert(xc->num_helpers < XLAT_MAX_HELPERS);
+    xc->helpers[xc->num_helpers] = f;
+    xc->helper_ids[xc->num_helpers] = xlat_helper_id(xs, f);
+    return &xc->helpers[xc->num_helpers++];
+}
+
+// -----------------------------------------------------------------------------
+// Return a helper by the id it was saved by.
+void *xlat_helper_by_id(int id)
+{
+    int i;
+
+    if (id >= 0 && id < 0x10000)
+        return (void *)c8_decode_opcode(id);
+    for (i = 0; i < XLAT_NUM_HELPERS; ++i)
+        if (xlat_helpers[i].id == id)
+            return xlat_helpers[i].fn;
+    return NULL;
+}
+
+// -----------------------------------------------------------------------------
+// Follow a call to one of the store helpers above. If the store dropped any
+// translations the rest of this block may be stale, so leave it immediately.
+static void xlat_emit_store_check(xlat_state_t *xs)
+{
+    uint32_t dirty = xs->dirty;
+    uint8_t *site;
+    int i;
+
+    xlat_emit_test_r32r32(xs->xb, 0, 0);
+    site = xlat_emit_jcc_i32(xs->xb, XLAT_CC_E, NULL);
+    for (i = 0; i < GUEST_REGS; ++i)
+        if (xs->reg_map[i] >= 0 && !(xs->pinned & (1u << i)))
+            xlat_commit_register(xs, xs->reg_bits[i], i);
+    xlat_emit_mov_i32rm_offset(xs->xb, xs->pc, XLAT_CTX_REG, XLAT_CTX(pc));
+    xlat_emit_exit_dynamic(xs);
+    xlat_patch_jump(site, xs->xb->ptr);
+
+    // only the exit path wrote the registers back
+    xs->dirty = dirty;
+}
+
+// -----------------------------------------------------------------------------
+// Translate the current instruction as a call to its interpreter handler. The
+// guest registers are written back first and reloaded on demand afterwards,
+// apart from pinned registers which are reloaded straight away.
+// Translated code leaves the block if the handler moves the PC anywhere other
+// than next_pc or raises an execution flag.
+static int xlat_emit_interp(xlat_state_t *xs, int next_pc)
+{
+    c8_opcode_fn fn = c8_decode_opcode(xs->opcode);
+    uint8_t *leave, *stay;
+
+    xlat_emit_epilogue(xs);
+    xlat_emit_store_pins(xs);
+    xlat_emit_mov_i32rm_offset(xs->xb, xs->pc, XLAT_CTX_REG, XLAT_CTX(pc));
+    xlat_emit_mov_i32rm_offset(xs->xb, xs->opcode, XLAT_CTX_REG, XLAT_CTX(opcode));
+    xlat_emit_call_ctx_0(xs, (void *)fn);
+    xlat_emit_load_pins(xs);
+
+    xlat_emit_cmp_i32rm_offset(xs->xb, next_pc, XLAT_CTX_REG, XLAT_CTX(pc));
+    leave = xlat_emit_jcc_i32(xs->xb, XLAT_CC_NE, NULL);
+    xlat_emit_cmp_i8rm_offset(xs->xb, 0, XLAT_CTX_REG, XLAT_CTX(exec_flags));
+    stay = xlat_emit_jcc_i32(xs->xb, XLAT_CC_E, NULL);
+    xlat_patch_jump(leave, xs->xb->ptr);
+    xlat_emit_exit_dynamic(xs);
+    xlat_patch_jump(stay, xs->xb->ptr);
     return 0;
 }
 
+// -----------------------------------------------------------------------------
+static int xlat_sys_cls(xlat_state_t *xs)
+{
+    return xlat_emit_interp(xs, xs->pc);
+}
+
 // -----------------------------------------------------------------------------
 static int xlat_sys_ret(xlat_state_t *xs)
 {
-    int rsp = xlat_reserve_register(xs, 16, R_SP, &xs->ctx->sp);
-    int rpc = xlat_reserve_register(xs, 16, R_PC, &xs->ctx->pc);
-    int tmp = xlat_reserve_register_index(xs, 32, 0);
+    int rsp = xlat_reserve_register_rw(xs, 16, R_SP, &xs->ctx->sp);
+    int rpc, tmp;
     xlat_emit_add_i32r64(xs->xb, -1, rsp);
-    xlat_emit_mov_i64r64(xs->xb, (uint64_t)xs->ctx->stack, tmp);
-    xlat_emit_mov_rmr16_scale(xs->xb, rpc, tmp, rsp, 2);
+    xlat_emit_and_i32r32(xs->xb, STACK_SIZE - 1, rsp);
+
+    // a trace returns to the instruction after the call it followed
+    if (xs->ir[xs->ir_pos].flags & XLAT_IR_FOLLOW)
+        return 0;
+
+    rpc = xlat_reserve_register_wo(xs, 32, R_PC, &xs->ctx->pc);
+    tmp = xlat_reserve_register_index(xs, 32, 0);
+    xlat_emit_lea_rmr64_offset(xs->xb, XLAT_CTX_REG, tmp, XLAT_CTX(stack));
+    xlat_emit_mov_rmr32_scale(xs->xb, rpc, tmp, rsp, 2);
+    xlat_emit_exit_return(xs, rpc);
     return 1;
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_bad(xlat_state_t *xs)
 {
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
+}
+
+// -----------------------------------------------------------------------------
+// Return the number of instructions in the idle loop the block makes up if it
+// ends with this jump, or zero if it does not. The loop is judged as decoded,
+// as guest memory may have changed since.
+static int xlat_idle_length(const xlat_state_t *xs)
+{
+    int op[3] = { 0, 0, 0 }, n;
+
+    if (O_T != xs->xb->pc || xs->ir_pos >= 3)
+        return 0;
+    for (n = 0; n <= xs->ir_pos; ++n) {
+        if (1 != xs->ir[n].num_ops)
+            return 0;
+        op[n] = xs->ir[n].op[0];
+    }
+    return c8_idle_ops(O_T, op[0], op[1], op[2]);
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_jmp(xlat_state_t *xs)
 {
-    int rpc = xlat_reserve_register_wo(xs, 16, R_PC, &xs->ctx->pc);
-    xlat_emit_mov_i16r16(xs->xb, O_T, rpc);
+    int length;
+
+    // a trace carries on at the target
+    if (xs->ir[xs->ir_pos].flags & XLAT_IR_FOLLOW)
+        return 0;
+
+    length = xlat_idle_length(xs);
+
+    // the back edge of an idle loop returns to the dispatcher rather than
+    // being chained, so that it can fast-forward to the end of the tick
+    if (length && O_T == xs->xb->pc &&
+            xs->pc == ((O_T + 2 * length) & ROM_MASK(xs->ctx))) {
+        xs->xb->idle = 1;
+        xlat_emit_epilogue(xs);
+        xlat_emit_mov_i32rm_offset(xs->xb, O_T, XLAT_CTX_REG, XLAT_CTX(pc));
+        xlat_emit_exit_dynamic(xs);
+        return 1;
+    }
+
+    xlat_emit_epilogue(xs);
+    xlat_emit_exit(xs, O_T);
     return 1;
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_jsr(xlat_state_t *xs)
 {
-    int rsp = xlat_reserve_register(xs, 16, R_SP, &xs->ctx->sp);
-    int rpc = xlat_reserve_register(xs, 16, R_PC, &xs->ctx->pc);
-    int tmp = xlat_reserve_register_index(xs, 32, 0);
-    xlat_emit_mov_i64r64(xs->xb, (uint64_t)xs->ctx->stack, tmp);
-    xlat_emit_mov_r16rm_scale(xs->xb, tmp, rsp, 2, rpc);
+    int flags = xs->ir[xs->ir_pos].flags;
+    int rsp = xlat_reserve_register_rw(xs, 16, R_SP, &xs->ctx->sp);
+    int rpc, tmp;
+
+    // a trace carries on into the callee, which may also return within it
+    if (flags & XLAT_IR_FOLLOW) {
+        rpc = xlat_reserve_register_index(xs, 32, 1);
+        tmp = xlat_reserve_register_index(xs, 32, 0);
+        xlat_emit_mov_i32r32(xs->xb, xs->pc, rpc);
+        xlat_emit_lea_rmr64_offset(xs->xb, XLAT_CTX_REG, tmp, XLAT_CTX(stack));
+        xlat_emit_mov_r32rm_scale(xs->xb, tmp, rsp, 2, rpc);
+        xlat_emit_add_i32r64(xs->xb, 1, rsp);
+        xlat_emit_and_i32r32(xs->xb, STACK_SIZE - 1, rsp);
+        if (flags & XLAT_IR_RAS)
+            xlat_emit_ras_push(xs, xs->pc);
+        return 0;
+    }
+
+    rpc = xlat_reserve_register_wo(xs, 32, R_PC, &xs->ctx->pc);
+    tmp = xlat_reserve_register_index(xs, 32, 0);
+    xlat_emit_mov_i32r32(xs->xb, xs->pc, rpc);
+    xlat_emit_lea_rmr64_offset(xs->xb, XLAT_CTX_REG, tmp, XLAT_CTX(stack));
+    xlat_emit_mov_r32rm_scale(xs->xb, tmp, rsp, 2, rpc);
     xlat_emit_add_i32r64(xs->xb, 1, rsp);
-    xlat_emit_mov_i16r16(xs->xb, O_T, rpc);
+    xlat_emit_and_i32r32(xs->xb, STACK_SIZE - 1, rsp);
+    xlat_emit_ras_push(xs, xs->pc);
+    xlat_emit_epilogue(xs);
+    xlat_emit_exit(xs, O_T);
     return 1;
 }
 
@@ -177,24 +1353,16 @@ static int xlat_jsr(xlat_state_t *xs)
 static int xlat_sei(xlat_state_t *xs)
 {
     int rx = xlat_reserve_register(xs, 8, O_X, &xs->ctx->v[O_X]);
-    int rpc = xlat_reserve_register(xs, 16, R_PC, &xs->ctx->pc);
-    int tmp = xlat_reserve_register_index(xs, 16, 0);
-    xlat_emit_mov_i16r16(xs->xb, xs->ctx->pc + 2, tmp);
     xlat_emit_cmp_i8r8(xs->xb, O_B, rx);
-    xlat_emit_cmove_r16r16(xs->xb, tmp, rpc);
-    return 1; // TODO: do we have to terminate the basic block?
+    return xlat_emit_skip(xs, XLAT_CC_E);
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_sni(xlat_state_t *xs)
 {
     int rx = xlat_reserve_register(xs, 8, O_X, &xs->ctx->v[O_X]);
-    int rpc = xlat_reserve_register(xs, 16, R_PC, &xs->ctx->pc);
-    int tmp = xlat_reserve_register_index(xs, 16, 0);
-    xlat_emit_mov_i16r16(xs->xb, xs->ctx->pc + 2, tmp);
     xlat_emit_cmp_i8r8(xs->xb, O_B, rx);
-    xlat_emit_cmovne_r16r16(xs->xb, tmp, rpc);
-    return 1; // TODO: do we have to terminate the basic block?
+    return xlat_emit_skip(xs, XLAT_CC_NE);
 }
 
 // -----------------------------------------------------------------------------
@@ -202,12 +1370,8 @@ static int xlat_ser(xlat_state_t *xs)
 {
     int rx = xlat_reserve_register(xs, 8, O_X, &xs->ctx->v[O_X]);
     int ry = xlat_reserve_register(xs, 8, O_Y, &xs->ctx->v[O_Y]);
-    int rpc = xlat_reserve_register(xs, 16, R_PC, &xs->ctx->pc);
-    int tmp = xlat_reserve_register_index(xs, 16, 0);
-    xlat_emit_mov_i16r16(xs->xb, xs->ctx->pc + 2, tmp);
     xlat_emit_cmp_r8r8(xs->xb, ry, rx);
-    xlat_emit_cmove_r16r16(xs->xb, tmp, rpc);
-    return 1;
+    return xlat_emit_skip(xs, XLAT_CC_E);
 }
 
 // -----------------------------------------------------------------------------
@@ -221,7 +1385,7 @@ static int xlat_mov(xlat_state_t *xs)
 // -----------------------------------------------------------------------------
 static int xlat_add(xlat_state_t *xs)
 {
-    int rx = xlat_reserve_register(xs, 8, O_X, &xs->ctx->v[O_X]);
+    int rx = xlat_reserve_register_rw(xs, 8, O_X, &xs->ctx->v[O_X]);
     xlat_emit_add_i8r8(xs->xb, O_B, rx);
     return 0;
 }
@@ -229,8 +1393,8 @@ static int xlat_add(xlat_state_t *xs)
 // -----------------------------------------------------------------------------
 static int xlat_reg_mov(xlat_state_t *xs)
 {
-    int rx = xlat_reserve_register(xs, 8, O_X, &xs->ctx->v[O_X]);
     int ry = xlat_reserve_register(xs, 8, O_Y, &xs->ctx->v[O_Y]);
+    int rx = xlat_reserve_register_wo(xs, 8, O_X, &xs->ctx->v[O_X]);
     xlat_emit_mov_r8r8(xs->xb, ry, rx);
     return 0;
 }
@@ -238,7 +1402,7 @@ static int xlat_reg_mov(xlat_state_t *xs)
 // -----------------------------------------------------------------------------
 static int xlat_reg_orl(xlat_state_t *xs)
 {
-    int rx = xlat_reserve_register(xs, 8, O_X, &xs->ctx->v[O_X]);
+    int rx = xlat_reserve_register_rw(xs, 8, O_X, &xs->ctx->v[O_X]);
     int ry = xlat_reserve_register(xs, 8, O_Y, &xs->ctx->v[O_Y]);
     xlat_emit_or_r8r8(xs->xb, ry, rx);
     return 0;
@@ -247,7 +1411,7 @@ static int xlat_reg_orl(xlat_state_t *xs)
 // -----------------------------------------------------------------------------
 static int xlat_reg_and(xlat_state_t *xs)
 {
-    int rx = xlat_reserve_register(xs, 8, O_X, &xs->ctx->v[O_X]);
+    int rx = xlat_reserve_register_rw(xs, 8, O_X, &xs->ctx->v[O_X]);
     int ry = xlat_reserve_register(xs, 8, O_Y, &xs->ctx->v[O_Y]);
     xlat_emit_and_r8r8(xs->xb, ry, rx);
     return 0;
@@ -256,7 +1420,7 @@ static int xlat_reg_and(xlat_state_t *xs)
 // -----------------------------------------------------------------------------
 static int xlat_reg_xor(xlat_state_t *xs)
 {
-    int rx = xlat_reserve_register(xs, 8, O_X, &xs->ctx->v[O_X]);
+    int rx = xlat_reserve_register_rw(xs, 8, O_X, &xs->ctx->v[O_X]);
     int ry = xlat_reserve_register(xs, 8, O_Y, &xs->ctx->v[O_Y]);
     xlat_emit_xor_r8r8(xs->xb, ry, rx);
     return 0;
@@ -265,33 +1429,91 @@ static int xlat_reg_xor(xlat_state_t *xs)
 // -----------------------------------------------------------------------------
 static int xlat_reg_add(xlat_state_t *xs)
 {
-    int rx = xlat_reserve_register(xs, 8, O_X, &xs->ctx->v[O_X]);
     int ry = xlat_reserve_register(xs, 8, O_Y, &xs->ctx->v[O_Y]);
-    xlat_emit_mov_r8r8(xs->xb, ry, rx);
+    int rx = xlat_reserve_register_rw(xs, 8, O_X, &xs->ctx->v[O_X]);
+    xlat_emit_add_r8r8(xs->xb, ry, rx);
+
+    // the carry can be recovered later unless VF is an operand or Vx == Vy
+    if (O_X != O_Y && O_X != 0xF && O_Y != 0xF)
+        xlat_defer_flag(xs, XLAT_FLAG_ADD);
+    else
+        xlat_emit_flag_cc(xs, XLAT_CC_C);
     return 0;
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_reg_sxy(xlat_state_t *xs)
 {
+    int rx, ry;
+
+    // the interpreter sets VF before Vx, which only matters when one is VF
+    if (O_X == 0xF || O_Y == 0xF)
+        return xlat_emit_interp(xs, xs->pc);
+
+    ry = xlat_reserve_register(xs, 8, O_Y, &xs->ctx->v[O_Y]);
+    rx = xlat_reserve_register_rw(xs, 8, O_X, &xs->ctx->v[O_X]);
+    xlat_emit_sub_r8r8(xs->xb, ry, rx);
+
+    if (O_X != O_Y)
+        xlat_defer_flag(xs, XLAT_FLAG_SUB);
+    else
+        xlat_emit_flag_cc(xs, XLAT_CC_NC);
     return 0;
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_reg_shr(xlat_state_t *xs)
 {
+    int rx, rvf;
+
+    if (O_X == 0xF)
+        return xlat_emit_interp(xs, xs->pc);
+
+    // the shifted out bit cannot be recovered from the result, so VF keeps
+    // the operand until the flag is needed
+    rx = xlat_reserve_register_rw(xs, 8, O_X, &xs->ctx->v[O_X]);
+    rvf = xlat_reserve_register_wo(xs, 8, 0xF, &xs->ctx->v[0xF]);
+    xlat_emit_mov_r8r8(xs->xb, rx, rvf);
+    xlat_emit_shr_i8r8(xs->xb, 1, rx);
+    xlat_defer_flag_self(xs, XLAT_FLAG_SHR);
     return 0;
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_reg_syx(xlat_state_t *xs)
 {
+    int tmp, rx, ry;
+
+    if (O_X == 0xF || O_Y == 0xF)
+        return xlat_emit_interp(xs, xs->pc);
+
+    tmp = xlat_reserve_register_index(xs, 32, 0);
+    ry = xlat_reserve_register(xs, 8, O_Y, &xs->ctx->v[O_Y]);
+    rx = xlat_reserve_register_rw(xs, 8, O_X, &xs->ctx->v[O_X]);
+    xlat_emit_mov_r8r8(xs->xb, ry, tmp);
+    xlat_emit_sub_r8r8(xs->xb, rx, tmp);
+    xlat_emit_mov_r8r8(xs->xb, tmp, rx);
+
+    if (O_X != O_Y)
+        xlat_defer_flag(xs, XLAT_FLAG_SUBN);
+    else
+        xlat_emit_flag_cc(xs, XLAT_CC_NC);
     return 0;
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_reg_shl(xlat_state_t *xs)
 {
+    int rx, rvf;
+
+    if (O_X == 0xF)
+        return xlat_emit_interp(xs, xs->pc);
+
+    rx = xlat_reserve_register_rw(xs, 8, O_X, &xs->ctx->v[O_X]);
+    rvf = xlat_reserve_register_wo(xs, 8, 0xF, &xs->ctx->v[0xF]);
+    xlat_emit_mov_r8r8(xs->xb, rx, rvf);
+    xlat_emit_add_r8r8(xs->xb, rx, rx);
+    xlat_defer_flag_self(xs, XLAT_FLAG_SHL);
     return 0;
 }
 
@@ -300,25 +1522,27 @@ static int xlat_snr(xlat_state_t *xs)
 {
     int rx = xlat_reserve_register(xs, 8, O_X, &xs->ctx->v[O_X]);
     int ry = xlat_reserve_register(xs, 8, O_Y, &xs->ctx->v[O_Y]);
-    int rpc = xlat_reserve_register(xs, 16, R_PC, &xs->ctx->pc);
-    int tmp = xlat_reserve_register_index(xs, 16, 0);
-    xlat_emit_mov_i16r16(xs->xb, xs->ctx->pc + 2, tmp);
     xlat_emit_cmp_r8r8(xs->xb, ry, rx);
-    xlat_emit_cmovne_r16r16(xs->xb, tmp, rpc);
-    return 1;
+    return xlat_emit_skip(xs, XLAT_CC_NE);
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_ldi(xlat_state_t *xs)
 {
-    int ri = xlat_reserve_register(xs, 16, R_I, &xs->ctx->i);
-    xlat_emit_mov_i16r16(xs->xb, O_T, ri);
+    int ri = xlat_reserve_register_wo(xs, 32, R_I, &xs->ctx->i);
+    xlat_emit_mov_i32r32(xs->xb, O_T, ri);
     return 0;
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_vjp(xlat_state_t *xs)
 {
+    int rv0 = xlat_reserve_register(xs, 8, 0, &xs->ctx->v[0]);
+    int rpc = xlat_reserve_register_wo(xs, 32, R_PC, &xs->ctx->pc);
+    xlat_emit_movzx_r8r32(xs->xb, rv0, rpc);
+    xlat_emit_add_i32r64(xs->xb, O_T, rpc);
+    xlat_emit_and_i32r32(xs->xb, ROM_MASK(xs->ctx), rpc);
+    xlat_emit_exit_indirect(xs, rpc);
     return 1;
 }
 
@@ -326,7 +1550,7 @@ static int xlat_vjp(xlat_state_t *xs)
 static int xlat_rnd(xlat_state_t *xs)
 {
     int r0 = xlat_reserve_register_index(xs, 32, 0);
-    int rx = xlat_reserve_register(xs, 8, O_X, &xs->ctx->v[O_X]);
+    int rx = xlat_reserve_register_wo(xs, 8, O_X, &xs->ctx->v[O_X]);
     xlat_emit_call_0(xs, (void *)rand);
     xlat_emit_and_i8r8(xs->xb, O_B, r0);
     xlat_emit_mov_r8r8(xs->xb, r0, rx);
@@ -334,13 +1558,17 @@ static int xlat_rnd(xlat_state_t *xs)
 }
 
 // -----------------------------------------------------------------------------
+// Sprites are drawn by a routine specialized for the system active when the
+// block was asked for, which checks that it still is on every call.
 static int xlat_drw(xlat_state_t *xs)
 {
-    int rvf = xlat_reserve_register(xs, 8, 0xF, &xs->ctx->v[0xF]);
+    void *draw = xlat_draw_routine(xs->system);
+    int rvf;
     xlat_commit_register(xs, 8, O_X);
     xlat_commit_register(xs, 8, O_Y);
-    xlat_commit_register(xs, 16, R_I);
-    xlat_emit_call_4(xs, (void *)gfx_draw_sprite, (size_t)xs->ctx, O_X, O_Y, O_N);
+    xlat_commit_register(xs, 32, R_I);
+    rvf = xlat_reserve_register_wo(xs, 8, 0xF, &xs->ctx->v[0xF]);
+    xlat_emit_call_ctx_3(xs, draw, O_X, O_Y, O_N);
     xlat_emit_mov_r8r8(xs->xb, 0, rvf);
     return 0;
 }
@@ -348,26 +1576,20 @@ static int xlat_drw(xlat_state_t *xs)
 // -----------------------------------------------------------------------------
 static int xlat_key_seq(xlat_state_t *xs)
 {
-    // XXX: implement this for real
-    int rpc = xlat_reserve_register_wo(xs, 16, R_PC, &xs->ctx->pc);
-    xlat_emit_mov_i16r16(xs->xb, xs->ctx->pc, rpc);
-    return 1;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_key_sne(xlat_state_t *xs)
 {
-    // XXX: implement this for real
-    int rpc = xlat_reserve_register_wo(xs, 16, R_PC, &xs->ctx->pc);
-    xlat_emit_mov_i16r16(xs->xb, xs->ctx->pc + 2, rpc);
-    return 1;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_mem_rdd(xlat_state_t *xs)
 {
-    int rx = xlat_reserve_register(xs, 8, O_X, &xs->ctx->v[O_X]);
     int rdt = xlat_reserve_register(xs, 8, R_DT, &xs->ctx->dt);
+    int rx = xlat_reserve_register_wo(xs, 8, O_X, &xs->ctx->v[O_X]);
     xlat_emit_mov_r8r8(xs->xb, rdt, rx);
     return 0;
 }
@@ -375,14 +1597,14 @@ static int xlat_mem_rdd(xlat_state_t *xs)
 // -----------------------------------------------------------------------------
 static int xlat_mem_rdk(xlat_state_t *xs)
 {
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_mem_wrd(xlat_state_t *xs)
 {
     int rx = xlat_reserve_register(xs, 8, O_X, &xs->ctx->v[O_X]);
-    int rdt = xlat_reserve_register(xs, 8, R_DT, &xs->ctx->dt);
+    int rdt = xlat_reserve_register_wo(xs, 8, R_DT, &xs->ctx->dt);
     xlat_emit_mov_r8r8(xs->xb, rx, rdt);
     return 0;
 }
@@ -391,7 +1613,7 @@ static int xlat_mem_wrd(xlat_state_t *xs)
 static int xlat_mem_wrs(xlat_state_t *xs)
 {
     int rx = xlat_reserve_register(xs, 8, O_X, &xs->ctx->v[O_X]);
-    int rst = xlat_reserve_register(xs, 8, R_ST, &xs->ctx->st);
+    int rst = xlat_reserve_register_wo(xs, 8, R_ST, &xs->ctx->st);
     xlat_emit_mov_r8r8(xs->xb, rx, rst);
     return 0;
 }
@@ -399,259 +1621,549 @@ static int xlat_mem_wrs(xlat_state_t *xs)
 // -----------------------------------------------------------------------------
 static int xlat_mem_addi(xlat_state_t *xs)
 {
+    int rcx = xlat_reserve_register_index(xs, 32, 1);
     int rx = xlat_reserve_register(xs, 8, O_X, &xs->ctx->v[O_X]);
-    int ri = xlat_reserve_register(xs, 16, R_I, &xs->ctx->i);
-    xlat_emit_add_r16r16(xs->xb, rx, ri);
+    int ri;
+
+    // Vx is only needed in rcx, which leaves its host register free for I
+    xlat_emit_movzx_r8r32(xs->xb, rx, rcx);
+    xs->locked = 0;
+
+    // VF is set if the sum leaves the 12-bit address space, before I wraps.
+    // both are left until VF or I is next used
+    ri = xlat_reserve_register_rw(xs, 32, R_I, &xs->ctx->i);
+    xlat_emit_add_r64r64(xs->xb, rcx, ri);
+    xlat_defer_flag(xs, XLAT_FLAG_ADDI);
+    xs->flag_x = xs->flag_y = 0xF;
     return 0;
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_mem_font(xlat_state_t *xs)
 {
-    int rx = xlat_reserve_register(xs, 8, O_X, &xs->ctx->v[O_X]);
-    int ri = xlat_reserve_register(xs, 8, R_I, &xs->ctx->i);
-    int r0 = xlat_reserve_register_index(xs, 32, 0);
-    xlat_emit_mov_i8r8(xs->xb, 5, r0);
-    xlat_emit_mul_r8(xs->xb, rx);
-    xlat_emit_mov_r8r8(xs->xb, r0, ri);
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_mem_bcd(xlat_state_t *xs)
 {
+    xlat_commit_register(xs, 8, O_X);
+    xlat_commit_register(xs, 32, R_I);
+    xlat_emit_call_ctx_1(xs, (void *)xlat_store_bcd, O_X);
+    xlat_emit_store_check(xs);
     return 0;
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_mem_wr(xlat_state_t *xs)
 {
-    int x, end = O_X;
-    int r0 = xlat_reserve_register_index(xs, 32, 0);
-    int ri = xlat_reserve_register(xs, 16, R_I, &xs->ctx->i);
-    xlat_emit_mov_i64r64(xs->xb, (uint64_t)xs->ctx->rom, r0);
-    xlat_emit_add_r64r64(xs->xb, ri, r0);
+    int x;
 
-    for (x = 0; x <= end; ++x) {
-        int rx = xlat_reserve_register(xs, 8, x, &xs->ctx->v[x]); // RO?
-        xlat_emit_mov_r8rm(xs->xb, rx, r0);
-        xlat_emit_add_i32r64(xs->xb, 1, ri);
-    }
+    // the helper stores the registers from the context
+    for (x = 0; x <= O_X; ++x)
+        xlat_commit_register(xs, 8, x);
+    xlat_commit_register(xs, 32, R_I);
+    xlat_emit_call_ctx_1(xs, (void *)xlat_store_regs, O_X);
+    xlat_emit_store_check(xs);
     return 0;
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_mem_rd(xlat_state_t *xs)
 {
-    int x, end = O_X;
-    int r0 = xlat_reserve_register_index(xs, 32, 0);
-    int ri = xlat_reserve_register(xs, 16, R_I, &xs->ctx->i);
-    xlat_emit_mov_i64r64(xs->xb, (uint64_t)xs->ctx->rom, r0);
-    xlat_emit_add_r64r64(xs->xb, ri, r0);
-
-    for (x = 0; x <= end; ++x) {
-        int rx = xlat_reserve_register(xs, 8, x, &xs->ctx->v[x]); // RO?
-        xlat_emit_mov_rmr8(xs->xb, r0, rx);
-        xlat_emit_add_i32r64(xs->xb, 1, ri);
-    }
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 #ifdef HAVE_SCHIP_SUPPORT
 // -----------------------------------------------------------------------------
 static int xlat_sup_brk(xlat_state_t *xs)
 {
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_sup_scd(xlat_state_t *xs)
 {
-    xlat_emit_call_2(xs, (void *)gfx_scroll_down, (size_t)xs->ctx, O_N);
+    xlat_emit_call_ctx_1(xs, (void *)gfx_scroll_down, O_N);
     return 0;
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_sup_scr(xlat_state_t *xs)
 {
-    xlat_emit_call_1(xs, (void *)gfx_scroll_right, (size_t)xs->ctx);
+    xlat_emit_call_ctx_0(xs, (void *)gfx_scroll_right);
     return 0;
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_sup_scl(xlat_state_t *xs)
 {
-    xlat_emit_call_1(xs, (void *)gfx_scroll_left, (size_t)xs->ctx);
+    xlat_emit_call_ctx_0(xs, (void *)gfx_scroll_left);
     return 0;
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_sup_ch8(xlat_state_t *xs)
 {
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_sup_sch(xlat_state_t *xs)
 {
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_sup_xfont(xlat_state_t *xs)
 {
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_sup_wr48(xlat_state_t *xs)
 {
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 // -----------------------------------------------------------------------------
 static int xlat_sup_rd48(xlat_state_t *xs)
 {
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 #endif // HAVE_SCHIP_SUPPORT
 
 #ifdef HAVE_MCHIP_SUPPORT
 // -----------------------------------------------------------------------------
-static int xlat_meg_off(xlat_state_t *xa)
+static int xlat_meg_off(xlat_state_t *xs)
 {
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 // -----------------------------------------------------------------------------
-static int xlat_meg_on(xlat_state_t *xa)
+static int xlat_meg_on(xlat_state_t *xs)
 {
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 // -----------------------------------------------------------------------------
-static int xlat_meg_scru(xlat_state_t *xa)
+static int xlat_meg_scru(xlat_state_t *xs)
 {
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 // -----------------------------------------------------------------------------
-static int xlat_meg_ldhi(xlat_state_t *xa)
+static int xlat_meg_ldhi(xlat_state_t *xs)
 {
-    return 0;
+    // the handler consumes the second half of the instruction itself
+    int next_pc = (xs->pc + 2) & ROM_MASK(xs->ctx);
+    int block_finished = xlat_emit_interp(xs, next_pc);
+    xs->pc = next_pc;
+    return block_finished;
 }
 
 // -----------------------------------------------------------------------------
-static int xlat_meg_ldpal(xlat_state_t *xa)
+static int xlat_meg_ldpal(xlat_state_t *xs)
 {
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 // -----------------------------------------------------------------------------
-static int xlat_meg_sprw(xlat_state_t *xa)
+static int xlat_meg_sprw(xlat_state_t *xs)
 {
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 // -----------------------------------------------------------------------------
-static int xlat_meg_sprh(xlat_state_t *xa)
+static int xlat_meg_sprh(xlat_state_t *xs)
 {
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 // -----------------------------------------------------------------------------
-static int xlat_meg_alpha(xlat_state_t *xa)
+static int xlat_meg_alpha(xlat_state_t *xs)
 {
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 // -----------------------------------------------------------------------------
-static int xlat_meg_sndon(xlat_state_t *xa)
+static int xlat_meg_sndon(xlat_state_t *xs)
 {
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 // -----------------------------------------------------------------------------
-static int xlat_meg_sndoff(xlat_state_t *xa)
+static int xlat_meg_sndoff(xlat_state_t *xs)
 {
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 
 // -----------------------------------------------------------------------------
-static int xlat_meg_bmode(xlat_state_t *xa)
+static int xlat_meg_bmode(xlat_state_t *xs)
 {
-    return 0;
+    return xlat_emit_interp(xs, xs->pc);
 }
 #endif // HAVE_MCHIP_SUPPORT
 
 // -----------------------------------------------------------------------------
-static void translate_block(c8_context_t *ctx, xlat_block_t *xb)
-{
-    int block_finished = 0;
+// Record the guest code covered by the first count instructions of ir, which
+// ends at end. Instructions follow on from each other within a run, apart from
+// those stepped over by a skip; a followed branch may start another.
+static void xlat_record_runs(const c8_context_t *ctx, xlat_block_t *xb,
+                             const xlat_ir_t *ir, int count, int end)
+{
+    int start = ir[0].pc, first = 1, n;
+
+    xb->num_segs = 0;
+    for (n = 1; n <= count; ++n) {
+        int last = end, size;
+
+        if (n < count) {
+            int gap = (ir[n].pc - ir[n - 1].pc) & ROM_MASK(ctx);
+            if (2 == gap || 4 == gap)
+                continue;
+            last = ir[n - 1].pc + 2;
+        }
+
+        size = (last - start) & ROM_MASK(ctx);
+        if (first) {
+            xb->size = size;
+            first = 0;
+        }
+        else {
+            assert(xb->num_segs < XLAT_MAX_SEGS - 1);
+            xb->segs[xb->num_segs].pc = start;
+            xb->segs[xb->num_segs].size = size;
+            ++xb->num_segs;
+        }
+        if (n < count)
+            start = ir[n].pc;
+    }
+}
 
-    xlat_state_t xs;
+// -----------------------------------------------------------------------------
+// Emit the first num_ir instructions of a decoded block into xb. Blocks that
+// are not traces count their entries and the exits they take, from which a
+// trace is formed once they are hot. Returns how many instructions were
+// translated, which is fewer when a skip had to leave the block or the
+// translation grew too long, or -1 if no code could be allocated.
+static int lower_block(c8_context_t *ctx, xlat_block_t *xb,
+                       const xlat_ir_t *ir, int num_ir, int trace, int system)
+{
+    int block_finished = 0, n;
+    xlat_state_t xs, saved;
+    uint8_t *start;
+
+    if (0 > xlat_alloc_block(ctx->xc, xb, XLAT_BLOCK_SIZE)) {
+        log_err("failed to allocate xlat block @PC=%04X\n", ir[0].pc);
+        return -1;
+    }
+    start = xb->ptr;
+    xb->trace = trace;
+    xb->countdown = trace ? 0 : XLAT_TRACE_HEAT;
+
+    // translation must not depend on the context's runtime state, since the
+    // resulting block is cached and re-executed on subsequent calls
     xs.ctx = ctx;
     xs.xb = xb;
+    xs.system = system;
+    xs.pc = ir[0].pc;
+    xs.ir = ir;
+    xs.ir_len = num_ir;
+    xs.profile = !trace;
+    xb->pc = ir[0].pc;
     xlat_alloc_state(&xs);
+    xlat_copy_state(&saved, &xs);
 
-    if (0 > xlat_alloc_block(xb, 4096)) {
-        log_err("failed to allocate xlat block @PC=%04X", xs.ctx->pc);
-        return;
-    }
-
-    // block initialization code synchronizes target and host registers
+    // block head returns to the dispatcher once the cycle budget is spent
     xlat_emit_prologue(&xs);
 
-    while (!block_finished) {
-        // fetch the next instruction opcode, trap for debugger if necessary
-        int pc = xs.ctx->pc;
-        ctx->opcode = xs.opcode = (ctx->rom[pc] << 8) | ctx->rom[pc + 1];
-        xs.ctx->pc = (pc + 2) & (ROM_SIZE - 1);
+    for (n = 0; !block_finished; ++n) {
+        uint8_t *skip_site = xs.skip_site;
+        int i;
+
+        xs.ir_pos = n;
+        xs.pc = (ir[n].pc + 2) & ROM_MASK(ctx);
         xb->num_cycles++;
 
-        // translate the current instruction, terminating if branch encountered
-#       define OPCODE xs.opcode
-#       define OP(x) block_finished = xlat_##x(&xs)
-#       include "decode.inc"
+        // remember the allocation on entry to a skipped instruction
+        if (NULL != skip_site) {
+            xs.skip_site = NULL;
+            xlat_copy_state(&saved, &xs);
+        }
+
+        // translate the opcodes standing in for the instruction, terminating
+        // if branch encountered. an instruction optimized away emits nothing
+        for (i = 0; i < ir[n].num_ops && !block_finished; ++i) {
+            xs.opcode = ir[n].op[i];
+
+            // produce or drop VF left pending by an earlier instruction. a
+            // followed branch neither reads nor writes it
+            if (!(ir[n].flags & XLAT_IR_FOLLOW))
+                xlat_settle_flag(&xs);
+            xs.locked = 0;
+
+#           define OPCODE xs.opcode
+#           define OP(x) block_finished = xlat_##x(&xs)
+#           include "decode.inc"
+        }
+
+        // join the skipped path. the instruction is only charged for when it
+        // runs, so the path through it pays for its own cycle
+        if (NULL != skip_site) {
+            --xb->num_cycles;
+            if (block_finished) {
+                xlat_copy_state(&xs, &saved);
+                block_finished = 0;
+            }
+            else {
+                xlat_emit_flag(&xs);
+                xlat_merge_state(&xs, &saved);
+                xlat_emit_sub_i32m32(xb, 1, XLAT_CACHE(budget));
+            }
+            xlat_patch_jump(skip_site, xb->ptr);
+        }
+
+        // split long sequences before they can overrun the translation buffer
+        if (!block_finished && NULL == xs.skip_site &&
+                (n + 1 == num_ir ||
+                 (xb->ptr - start) > XLAT_BLOCK_LIMIT ||
+                 xb->num_exits > XLAT_MAX_EXITS - 3)) {
+            xlat_emit_flag(&xs);
+            xlat_emit_epilogue(&xs);
+            xlat_emit_exit(&xs, (n + 1 < num_ir) ? ir[n + 1].pc : xs.pc);
+            block_finished = 1;
+        }
     }
 
-    // block cleanup code commits target registers to emulator context
-    xlat_emit_epilogue(&xs);
+    // every block ends in an exit that has already committed its registers
+    assert(XLAT_FLAG_NONE == xs.flag_op);
+    xlat_free_state(&saved);
     xlat_free_state(&xs);
+    xlat_record_runs(ctx, xb, ir, n, xs.pc);
+    return n;
+}
+
+// -----------------------------------------------------------------------------
+// Optimize and translate the count instructions decoded into ir. Stores are
+// only dropped in favor of later ones, so a translation that ends before some
+// of those is redone from a shorter decode that keeps them.
+static int xlat_build_block(c8_context_t *ctx, xlat_block_t *xb,
+                            xlat_ir_t *decoded, int count, int trace,
+                            int system)
+{
+    xlat_ir_t ir[XLAT_MAX_IR];
+    uint64_t start = xlat_stats_clock();
+
+    for (;;) {
+        int used, n;
+
+        memcpy(ir, decoded, count * sizeof(xlat_ir_t));
+        xlat_optimize_block(ir, count);
+        if (0 > (used = lower_block(ctx, xb, ir, count, trace, system)))
+            return -1;
+
+        for (n = 0; n < used && ir[n].kill < used; ++n)
+            ;
+        if (n == used)
+            break;
+
+        log_spew("retranslating xlat block @PC=%04X after %d instructions\n",
+                 xb->pc, used);
+        count = xlat_trim_block(decoded, count, used);
+    }
+
+    xlat_commit_block(ctx->xc, xb);
+    xlat_stats_add_block(ctx->xc, xb, start);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Decode and translate the block at pc for the given system, which was active
+// when the block was asked for.
+int xlat_translate_block(c8_context_t *ctx, xlat_block_t *xb, int pc,
+                         int system)
+{
+    xlat_ir_t ir[XLAT_MAX_IR];
+    int num_ir = xlat_decode_block(ctx, pc, ir, XLAT_MAX_IR - 1);
+    return xlat_build_block(ctx, xb, ir, num_ir, 0, system);
+}
+
+// -----------------------------------------------------------------------------
+// Decode into ir the trace to replace the hot block xb with, along the path
+// its profile, and that of the blocks it leads to, favors, then drop xb. A
+// trace that would cover more than one run of guest code is only formed while
+// there is room to track it. Returns the number of instructions decoded.
+int xlat_prepare_trace(c8_context_t *ctx, xlat_block_t *xb, xlat_ir_t *ir)
+{
+    xlat_cache_t *xc = ctx->xc;
+    int pc = xb->pc, num_ir;
+
+    if (xc->num_traces < XLAT_MAX_TRACES)
+        num_ir = xlat_decode_trace(ctx, pc, ir, XLAT_MAX_IR - 1);
+    else
+        num_ir = xlat_decode_block(ctx, pc, ir, XLAT_MAX_IR - 1);
+
+    log_dbg("forming trace @PC=%04X from %d instructions\n", pc, num_ir);
+
+    // exits and predictions may still lead into the old translation
+    xlat_drop_block(xc, xb);
+    xlat_forget_predictions(xc);
+    return num_ir;
+}
+
+// -----------------------------------------------------------------------------
+// Translate a trace decoded by xlat_prepare_trace into the empty record xb,
+// for the system that was active when it was decoded.
+int xlat_build_trace(c8_context_t *ctx, xlat_block_t *xb,
+                     xlat_ir_t *ir, int num_ir, int system)
+{
+    return xlat_build_block(ctx, xb, ir, num_ir, 1, system);
+}
+
+// -----------------------------------------------------------------------------
+// Replace the hot block xb with a trace.
+int xlat_retranslate_block(c8_context_t *ctx, xlat_block_t *xb)
+{
+    xlat_ir_t ir[XLAT_MAX_IR];
+    int num_ir = xlat_prepare_trace(ctx, xb, ir);
+    return xlat_build_trace(ctx, xb, ir, num_ir, ctx->system);
+}
+
+// -----------------------------------------------------------------------------
+// Interpret instructions for the given number of cycles, which were too few
+// for the block at the current PC. Returns the number of cycles executed.
+static long xlat_interpret(c8_context_t *ctx, long cycles)
+{
+    long start_cycles = ctx->cycles;
+    int pc;
+
+    while (cycles > 0) {
+        pc = ctx->pc;
+        ctx->opcode = (ctx->rom[pc] << 8) | ctx->rom[(pc + 1) & ROM_MASK(ctx)];
+        ctx->pc = (pc + 2) & ROM_MASK(ctx);
+
+        // check for a break or the debugger's cycle limit, as the interpreters do
+        if (ctx->exec_flags && c8_debug_instruction(ctx, pc)) {
+            ctx->pc = pc;
+            break;
+        }
+
+#ifdef HAVE_TIERED_COMPILER
+        if (XLAT_TIER_STORE(ctx->opcode)) {
+            xlat_lock_tier(ctx->xc);
+            c8_decode_opcode(ctx->opcode)(ctx);
+            xlat_unlock_tier(ctx->xc);
+        }
+        else
+#endif // HAVE_TIERED_COMPILER
+        c8_decode_opcode(ctx->opcode)(ctx);
+        ++ctx->cycles;
+        --cycles;
+        if (0x1000 == (ctx->opcode & 0xF000) && !ctx->exec_flags)
+            cycles -= c8_skip_idle(ctx, cycles);
+    }
+    return ctx->cycles - start_cycles;
+}
+
+// -----------------------------------------------------------------------------
+// Enter translated code at xb, which must hold the block for the current PC,
+// and run it for up to the given number of cycles. Returns the number of
+// cycles actually executed, which falls short only when control returns to
+// the dispatcher early, for instance through an unlinked exit.
+long xlat_run_block(c8_context_t *ctx, xlat_block_t *xb, long cycles)
+{
+    xlat_cache_t *xc = ctx->xc;
+    long skipped = 0;
+    int32_t budget;
+
+    // chain the exit we arrived through. it is forgotten whenever the arena
+    // is flushed or the block owning it is dropped by a store
+    if (NULL != xc->pending)
+        xlat_link_exit(xc->pending, xb);
+    xc->pending = NULL;
+
+    // skip the rest of the tick if this is an idle loop that is spinning
+    if (xb->idle && !ctx->exec_flags) {
+        skipped = c8_skip_idle(ctx, cycles);
+        if (skipped == cycles) {
+            ++xc->stats.exits[JIT_EXIT_IDLE];
+            return skipped;
+        }
+    }
+
+    // run until the budget is spent or an unlinked exit is taken. while
+    // debugging only a single block may run before returning here
+    budget = ctx->exec_flags ? 1 :
+        (int32_t)MIN(cycles - skipped, XLAT_MAX_BUDGET);
+    xc->budget = budget;
+    xc->exit_id = -1;
+    xc->enter(xb->block, ctx);
+    if (!(xc->jit_flags & JIT_STATS))
+        ++xb->visits;
+
+    if (xc->exit_id >= 0) {
+        xlat_block_t *from = xlat_lookup_block(xc, xc->exit_id >> 4);
+        xc->pending = &from->exits[xc->exit_id & 0xF];
+        ++xc->stats.exits[JIT_EXIT_CHAIN];
+    }
+    else if (XLAT_EXIT_HOT == xc->exit_id) {
+        ++xc->stats.exits[JIT_EXIT_HOT];
+    }
+    else if (XLAT_EXIT_SHORT == xc->exit_id) {
+        ++xc->stats.exits[JIT_EXIT_BUDGET];
+    }
+    else {
+        ++xc->stats.exits[JIT_EXIT_DYNAMIC];
+    }
+
+    budget -= xc->budget;
+    ctx->cycles += budget;
+
+    // finish a budget too small for the next block one instruction at a time
+    if (XLAT_EXIT_SHORT == xc->exit_id && xc->budget > 0)
+        budget += xlat_interpret(ctx, xc->budget);
+    return skipped + budget;
 }
 
 // -----------------------------------------------------------------------------
 long c8_execute_cycles_dbt(c8_context_t *ctx, long cycles)
 {
     long start_cycles;
-    xlat_block_t blocks[ROM_SIZE], *pblock;
-    memset(blocks, 0, sizeof(xlat_block_t) * ROM_SIZE);
+    xlat_block_t *pblock;
+    xlat_cache_t *xc;
+
+    // translated blocks are kept in the context until it is destroyed
+    if (NULL == ctx->xc && 0 > xlat_create_cache(ctx))
+        return 0;
 
+    xc = ctx->xc;
     start_cycles = ctx->cycles;
     while (cycles > 0) {
+#ifdef HAVE_REGISTER_PINNING
+        // once enough has run, rebuild the cache around the hottest registers
+        xlat_sample_pins(ctx);
+#endif // HAVE_REGISTER_PINNING
+
         // fetch the block for this instruction, translating when necessary
-        pblock = &blocks[ctx->pc];
-        if (NULL == pblock->ptr) {
+        pblock = xlat_get_block(xc, ctx->pc);
+        if (NULL == pblock->block) {
             // new code segment. translate and cache the next block
-            translate_block(ctx, pblock);
+            if (0 > xlat_translate_block(ctx, pblock, ctx->pc, ctx->system))
+                break;
         }
 
-        // execute the translated instruction sequence
-        // long bytes = (long)((int64_t)pblock->ptr - (int64_t)pblock->block);
-        // fprintf(stderr,
-        //         ">>> exec %ld instructions @ %p (%ld bytes, pc = %02X)\n",
-        //         pblock->num_cycles, pblock->ptr, bytes, ctx->pc);
+        cycles -= xlat_run_block(ctx, pblock, cycles);
 
-        ((xlat_fn)pblock->block)();
-        ++pblock->visits;
+        // the block has been entered often enough to be made a trace
+        if (XLAT_EXIT_HOT == xc->exit_id &&
+                0 > xlat_retranslate_block(ctx,
+                    xlat_lookup_block(xc, ctx->pc)))
+            break;
 
         if (ctx->exec_flags && c8_debug_instruction(ctx, ctx->pc))
             break;
-
-        cycles -= pblock->num_cycles;
-        ctx->cycles += pblock->num_cycles;
     }
 
     return ctx->cycles - start_cycles;
 }
-
@@ -1,147 +1,544 @@
-// gchip - a simple recompiling chip-8 emulator
-// Copyright (C) 2011  Garrett Smith.
-// 
-// This program is free software; you can redistribute it and/or modify it
-// under the terms of the GNU General Public License as published by the
-// Free Software Foundation; either version 2 of the License, or (at your
-// option) any later version.
-// 
-// This program is distributed in the hope that it will be useful, but
-// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
-// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
-// for more details.
-// 
-// You should have received a copy of the GNU General Public License along
-// with this program; if not, write to the Free Software Foundation, Inc.,
-// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
-
-#ifndef GCHIP_XLAT__H
-#define GCHIP_XLAT__H
-
-#include "chip8.h"
-
-typedef struct xlat_block {
-    uint8_t *block;     // start of translation buffer
-    uint8_t *ptr;       // pointer to next instruction location
-    long length;        // size of translation buffer
-    long num_cycles;    // number of target instructions represented
-    long visits;        // number of times this block has been executed
-} xlat_block_t;
-
-#define GUEST_REGS 21
-
-typedef struct xlat_state {
-    c8_context_t *ctx;
-    xlat_block_t *xb;
-    uint16_t opcode;
-    uint16_t pc;
-    int *free_regs;
-    int num_free;
-    int reg_map[GUEST_REGS];
-    int reg_bits[GUEST_REGS];
-    void *reg_sync[GUEST_REGS];
-} xlat_state_t;
-
-typedef void (*xlat_fn)(void);
-
-int  xlat_alloc_block(xlat_block_t *xb, long length);
-void xlat_free_block(xlat_block_t *xb);
-
-int  xlat_alloc_state(xlat_state_t *xs);
-void xlat_free_state(xlat_state_t *xs);
-
-void xlat_emit_call_0(xlat_state_t *xs, void *f);
-void xlat_emit_call_1(xlat_state_t *xs, void *f, size_t d1);
-void xlat_emit_call_2(xlat_state_t *xs, void *f, size_t d1, size_t d2);
-void xlat_emit_call_3(xlat_state_t *xs, void *f, size_t d1, size_t d2, size_t d3);
-void xlat_emit_call_4(xlat_state_t *xs, void *f, size_t d1, size_t d2, size_t d3, size_t d4);
-void xlat_emit_call_5(xlat_state_t *xs, void *f, size_t d1, size_t d2, size_t d3, size_t d4, size_t d5);
-
-int  xlat_reserve_register(xlat_state_t *xs, int bits, int reg, void *sync);
-int  xlat_reserve_register_wo(xlat_state_t *xs, int bits, int reg, void *sync);
-int  xlat_reserve_register_temp(xlat_state_t *xs, int bits);
-int  xlat_reserve_register_index(xlat_state_t *xs, int bits, int index);
-void xlat_commit_register(xlat_state_t *xs, int bits, int reg);
-void xlat_free_register(xlat_state_t *xs, int reg);
-void xlat_free_register_temp(xlat_state_t *xs, int host_reg);
-
-void xlat_emit_prologue(xlat_state_t *state);
-void xlat_emit_epilogue(xlat_state_t *state);
-
-void xlat_emit_add_sp(xlat_block_t *xb, int bytes);
-void xlat_emit_sub_sp(xlat_block_t *xb, int bytes);
-
-void xlat_emit_push_i16(xlat_block_t *xb, uint16_t is);
-void xlat_emit_push_r16(xlat_block_t *xb, int rs);
-void xlat_emit_push_i32(xlat_block_t *xb, uint32_t is);
-void xlat_emit_push_r32(xlat_block_t *xb, int rs);
-
-void xlat_emit_pop_r16(xlat_block_t *xb, int rd);
-void xlat_emit_pop_r32(xlat_block_t *xb, int rd);
-
-void xlat_emit_call_i32(xlat_block_t *xb, void *is);
-void xlat_emit_call_r32(xlat_block_t *xb, int rs);
-void xlat_emit_call_r64(xlat_block_t *xb, int rs);
-
-void xlat_emit_or_r8r8(xlat_block_t *xb, int rs, int rd);
-void xlat_emit_and_r8r8(xlat_block_t *xb, int rs, int rd);
-void xlat_emit_xor_r8r8(xlat_block_t *xb, int rs, int rd);
-void xlat_emit_add_r8r8(xlat_block_t *xb, int rs, int rd);
-
-void xlat_emit_or_i8r8(xlat_block_t *xb, uint8_t imm, int rd);
-void xlat_emit_and_i8r8(xlat_block_t *xb, uint8_t imm, int rd);
-void xlat_emit_xor_i8r8(xlat_block_t *xb, uint8_t imm, int rd);
-void xlat_emit_add_i8r8(xlat_block_t *xb, uint8_t is, int rd);
-
-void xlat_emit_and_i16r16(xlat_block_t *xb, uint16_t imm, int rd);
-void xlat_emit_add_i16r16(xlat_block_t *xb, uint16_t imm, int rd);
-
-void xlat_emit_add_r16r16(xlat_block_t *xb, int rs, int rd);
-void xlat_emit_add_i32r64(xlat_block_t *xb, uint32_t is, int rd);
-void xlat_emit_add_r64r64(xlat_block_t *xb, int rs, int rd);
-
-void xlat_emit_mov_r8r8(xlat_block_t *xb, int rs, int rd);
-void xlat_emit_mov_r8m8(xlat_block_t *xb, int rs, uint8_t *md);
-void xlat_emit_mov_m8r8(xlat_block_t *xb, uint8_t *ms, int rd);
-void xlat_emit_mov_i8r8(xlat_block_t *xb, uint8_t is, int rd);
-void xlat_emit_mov_i8m8(xlat_block_t *xb, uint8_t is, uint8_t *md);
-void xlat_emit_mov_rmr8(xlat_block_t *xb, int rs, int rd);
-void xlat_emit_mov_r8rm(xlat_block_t *xb, int rs, int rd);
-
-void xlat_emit_mov_r16m16(xlat_block_t *xb, int rs, uint16_t *md);
-void xlat_emit_mov_m16r16(xlat_block_t *xb, uint16_t *ms, int rd);
-void xlat_emit_mov_i16r16(xlat_block_t *xb, uint16_t is, int rd);
-void xlat_emit_mov_i16m16(xlat_block_t *xb, uint16_t is, uint16_t *md);
-
-void xlat_emit_mov_i16rm_index(xlat_block_t *xb, uint16_t is, int rb, int ri);
-
-void xlat_emit_mov_rmr16_offset(xlat_block_t *xb, int rs, int rd, int offset);
-void xlat_emit_mov_i16rm_offset(xlat_block_t *xb, uint16_t is, int rd, int offset);
-void xlat_emit_mov_r16rm_offset(xlat_block_t *xb, int rs, int rd, int offset);
-void xlat_emit_mov_rmr64_offset(xlat_block_t *xb, int rs, int rd, int offset);
-void xlat_emit_mov_r64rm_offset(xlat_block_t *xb, int rs, int rd, int offset);
-
-void xlat_emit_mov_rmr16_scale(xlat_block_t *xb, int rs, int rb, int ri, int scale);
-void xlat_emit_mov_r16rm_scale(xlat_block_t *xb, int rb, int ri, int scale, int rd);
-
-void xlat_emit_mov_i64r64(xlat_block_t *xb, uint64_t is, int rd);
-
-void xlat_emit_movzx_m8r32(xlat_block_t *xb, uint8_t *is, int rd);
-void xlat_emit_movzx_m16r32(xlat_block_t *xb, uint16_t *is, int rd);
-
-void xlat_emit_cmp_r8r8(xlat_block_t *xb, int rs, int rd);
-void xlat_emit_cmp_i8r8(xlat_block_t *xb, uint8_t i8, int rd);
-
-void xlat_emit_cmove_r16m16(xlat_block_t *xb, int rs, uint16_t *md);
-void xlat_emit_cmovne_r16m16(xlat_block_t *xb, int rs, uint16_t *md);
-
-void xlat_emit_cmove_r16r16(xlat_block_t *xb, int rs, int rd);
-void xlat_emit_cmovne_r16r16(xlat_block_t *xb, int rs, int rd);
-
-void xlat_emit_shl_i8r64(xlat_block_t *xb, uint8_t imm, int rd);
-void xlat_emit_mul_r8(xlat_block_t *xb, int rs);
-
-void xlat_emit_ret(xlat_block_t *xb);
-
-#endif // GCHIP_XLAT__H
-
+// gchip - a simple recompiling chip-8 emulator
+// Copyright (C) 2011  Garrett Smith.
+// 
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+// 
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#ifndef GCHIP_XLAT__H
+#define GCHIP_XLAT__H
+
+#include <stddef.h>
+#include "chip8.h"
+
+#define XLAT_MAX_EXITS 8
+#define XLAT_MAX_SEGS  8     // runs of guest code a single trace may cover
+
+// host register holding the c8_context_t pointer while translated code runs.
+// guest state is addressed relative to it, so translations do not depend on
+// where a context lives
+#if defined(ARCH_X86)
+#define XLAT_CTX_REG 7
+#elif defined(ARCH_ARM64)
+#define XLAT_CTX_REG 28
+#else
+#define XLAT_CTX_REG 15
+#endif
+
+// bytes of the jump at site emitted by xlat_emit_jmp_i32 or xlat_emit_jcc_i32
+#if defined(ARCH_ARM64)
+#define XLAT_JUMP_SIZE(site) 4
+#else
+#define XLAT_JUMP_SIZE(site) ((0x0F == (site)[0]) ? 6 : 5)
+#endif
+
+// displacement of a context field, or of a pointer into the context, from
+// XLAT_CTX_REG
+#define XLAT_CTX(field)         ((int)offsetof(c8_context_t, field))
+#define XLAT_CTX_OFFSET(xs, p)  ((int)((uint8_t *)(p) - (uint8_t *)(xs)->ctx))
+
+// displacement of a cache field, or of a pointer into the cache, from the
+// cache itself. translated code finds the cache through the xc field of the
+// context, so this is how the m32 and m64 operands of the emitters are given
+#define XLAT_CACHE(field)           ((int)offsetof(xlat_cache_t, field))
+#define XLAT_CACHE_OFFSET(xc, p)    ((int)((uint8_t *)(p) - (uint8_t *)(xc)))
+
+// guest memory is tracked in regions for self-modifying code detection
+#define XLAT_REGION_SHIFT 8
+#define XLAT_REGIONS(xc)  (((xc)->addr_mask + 1) >> XLAT_REGION_SHIFT)
+
+// condition codes accepted by xlat_emit_jcc_i32 (unsigned compares). these
+// are the x86 encodings, other backends map them onto their own
+#define XLAT_CC_B   0x2     // below
+#define XLAT_CC_AE  0x3     // above or equal
+#define XLAT_CC_E   0x4     // equal
+#define XLAT_CC_NE  0x5     // not equal
+#define XLAT_CC_BE  0x6     // below or equal
+#define XLAT_CC_A   0x7     // above
+#define XLAT_CC_C   XLAT_CC_B   // carry
+#define XLAT_CC_NC  XLAT_CC_AE  // no carry
+#define XLAT_CC_LE  0xE     // less or equal (signed)
+#define XLAT_CC_G   0xF     // greater (signed)
+
+#define XLAT_IC_SIZE 2   // targets remembered by each indirect jump
+
+struct xlat_block;
+struct xlat_gdb_entry;
+
+typedef struct xlat_ic {
+    uint8_t *code;      // translation of a recent target
+    int pc;             // guest address of the target, or -1
+} xlat_ic_t;
+
+typedef struct xlat_exit {
+    uint8_t *site;              // jump patched to reach the successor
+    uint8_t *stub;              // unlinked path back to the dispatcher
+    int target_pc;              // guest address of the successor
+    int32_t taken;              // times taken, counted while profiling
+    struct xlat_block *target;  // successor block when linked
+    struct xlat_exit *next;     // next exit linked to the same successor
+} xlat_exit_t;
+
+typedef struct xlat_seg {
+    int pc;             // guest address of the first instruction in the run
+    int size;           // number of guest bytes in the run
+} xlat_seg_t;
+
+typedef struct xlat_block {
+    uint8_t *block;     // start of translation buffer
+    uint8_t *ptr;       // pointer to next instruction location
+    long length;        // size of translation buffer
+    long num_cycles;    // number of target instructions represented
+    int32_t visits;     // number of times this block has been executed
+    int pc;             // guest address of the first instruction
+    int size;           // number of guest bytes translated from pc
+    int num_exits;      // number of chainable exits in use
+    int idle;           // block is an idle loop left through the dispatcher
+    int trace;          // block was formed along the profiled hot path
+    int32_t countdown;  // entries left before the block is made a trace
+    int num_segs;       // runs of guest code in a trace besides the first
+    xlat_seg_t segs[XLAT_MAX_SEGS - 1];
+    xlat_exit_t exits[XLAT_MAX_EXITS];  // exits with a static successor
+    xlat_exit_t *incoming;              // exits currently linked to us
+    xlat_ic_t ic[XLAT_IC_SIZE];         // inline cache for Bnnn
+    struct xlat_gdb_entry *debug;       // description given to gdb, if any
+} xlat_block_t;
+
+#define XLAT_MAX_TRACES 256 // blocks that may cover more than one run
+
+// block records are found through a two-level map from guest address. each
+// leaf holds the records for XLAT_MAP_LEAF consecutive addresses and is taken
+// from a pool the first time its range is needed, so the records kept grow
+// with the code actually run rather than with the size of guest memory. the
+// map covers the whole address space, and the pool has a leaf for every entry
+// unless the address space is larger than XLAT_MAX_LEAVES leaves
+#define XLAT_MAP_SHIFT  6   // log2 of the guest addresses covered by a leaf
+#define XLAT_MAP_LEAF   (1 << XLAT_MAP_SHIFT)
+#define XLAT_MAX_LEAVES 256 // most leaves that may be in use at once
+
+// number of records handed out from the pool
+#define XLAT_RECORDS(xc) ((xc)->num_leaves << XLAT_MAP_SHIFT)
+
+// a compiler thread publishes each leaf of the block map, and each block once
+// its code is complete, by a release store of the pointer to it. the emulator
+// thread runs translated code without the tier lock, so it reads them with an
+// acquire load. MSVC orders volatile accesses this way on the x86 targets
+#ifdef _MSC_VER
+#define XLAT_LOAD_ACQUIRE(p)        (*(void *volatile *)(p))
+#define XLAT_STORE_RELEASE(p, v)    (*(void *volatile *)(p) = (v))
+#else
+#define XLAT_LOAD_ACQUIRE(p)        __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define XLAT_STORE_RELEASE(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif // _MSC_VER
+
+#define XLAT_MAX_HELPERS 128 // C functions translated code may call
+
+#define XLAT_RAS_SIZE  16  // entries in the return address stack
+#define XLAT_RAS_SHIFT 4   // log2 of sizeof(xlat_ras_t)
+
+typedef struct xlat_ras {
+    uint8_t *code;      // translation of the return address, if any
+    int pc;             // guest return address pushed by 2nnn
+} xlat_ras_t;
+
+typedef void (*xlat_enter_fn)(uint8_t *code, c8_context_t *ctx);
+
+struct xlat_tier;
+
+#define GUEST_REGS 21
+#define HOST_REG_IDS 32
+
+// guest registers tracked alongside V0-VF
+#define R_SP 16
+#define R_PC 17
+#define R_I  18
+#define R_DT 19
+#define R_ST 20
+
+#define XLAT_MAX_PINS 4    // guest registers that may be pinned at once
+
+// a guest register kept in a host register across blocks. it is loaded on
+// entry to translated code and written back whenever C code may look at it
+typedef struct xlat_pin {
+    int reg;            // guest register index
+    int host_reg;       // host register that holds it
+    int bits;           // width of the context field
+    int offset;         // displacement of the field from XLAT_CTX_REG
+} xlat_pin_t;
+
+// everything the translator keeps besides the code itself. it is allocated
+// apart from the code arena, so none of it is ever executable
+typedef struct xlat_cache {
+    uint8_t *code;                  // executable code arena
+    long code_size;                 // size of the code arena
+    long code_base;                 // arena offset of the first block
+    long code_used;                 // bytes handed out from the code arena
+    long flushes;                   // number of times the arena was reset
+    long invalidations;             // number of writes that dropped blocks
+    int max_size;                   // largest guest size of any block
+    xlat_enter_fn enter;            // stub used to call into translated code
+    uint8_t *exit;                  // stub used to return to the dispatcher
+    int num_traces;                 // blocks covering more than one run
+    int traces[XLAT_MAX_TRACES];    // guest address of each such block
+    int32_t budget;                 // cycles left before returning to C
+    int32_t exit_id;                // unlinked exit taken, or -1
+    int32_t ras_top;                // index of the newest return address
+    int32_t ic_used;                // set once any inline cache is filled
+    xlat_exit_t *pending;           // unlinked exit taken by the last block
+    int num_pins;                   // guest registers pinned by every block
+    xlat_pin_t pins[XLAT_MAX_PINS]; // pinned registers, in order of use
+    int pins_chosen;                // set once the profile has been used
+    long dispatches;                // blocks entered from the dispatcher
+    struct xlat_tier *tier;         // background compiler, if one is running
+    int jit_flags;                  // JIT_* aids chosen for the context
+    FILE *perf_map;                 // symbols for perf, if enabled
+    int perf_stale;                 // perf map still names dropped blocks
+    c8_jit_stats_t stats;           // running totals for c8_get_jit_stats
+    char *save_path;                // file translations are saved to, if any
+    uint64_t save_hash;             // hash of the program it is named after
+    int unsaved;                    // blocks were committed since the load
+    int saved_blocks;               // blocks in the file when it was loaded
+    int num_helpers;                // helper slots in use
+    void *helpers[XLAT_MAX_HELPERS]; // C functions called by translated code
+    int helper_ids[XLAT_MAX_HELPERS]; // id each helper is saved by, or -1
+    xlat_ras_t ras[XLAT_RAS_SIZE];  // predicted targets for 00EE
+    int addr_mask;                  // guest addresses wrap at this mask
+    uint16_t *regions;              // number of blocks overlapping a region
+    int num_dirs;                   // entries in the map
+    int num_leaves;                 // leaves handed out from the pool
+    int max_leaves;                 // leaves the pool holds
+    xlat_block_t **map;             // leaf for each range of guest memory
+    xlat_block_t *pool;             // records by leaf, which follow the cache
+} xlat_cache_t;
+
+// identify a chainable exit by its block address and exit index
+#define XLAT_EXIT_ID(pc, n) (((pc) << 4) | (n))
+
+// exit_id reported by a block whose profiling countdown ran out
+#define XLAT_EXIT_HOT -2
+
+// exit_id reported by a block entered with too few cycles left to run it
+#define XLAT_EXIT_SHORT -3
+
+// most cycles translated code runs before returning, as budget is 32-bit
+#define XLAT_MAX_BUDGET 0x7FFFFFFFL
+
+// a host register that holds a temporary rather than a guest register
+#define XLAT_HOST_FREE -1
+#define XLAT_HOST_TEMP -2
+
+// VF computations that translated code may defer until the flag is needed.
+// each is evaluated from the values its operands hold after the operation.
+// the shifts leave the operand from before the shift in VF, and Fx1E leaves
+// the sum in I without wrapping it to 16 bits
+#define XLAT_FLAG_NONE  0   // VF is up to date
+#define XLAT_FLAG_ADD   1   // 8xy4: VF = Vx < Vy
+#define XLAT_FLAG_SUB   2   // 8xy5: VF = Vx + Vy does not carry
+#define XLAT_FLAG_SUBN  3   // 8xy7: VF = Vx <= Vy
+#define XLAT_FLAG_SHR   4   // 8xy6: VF = VF & 1
+#define XLAT_FLAG_SHL   5   // 8xyE: VF = VF >> 7
+#define XLAT_FLAG_ADDI  6   // Fx1E: VF = I > 0xFFF, then I &= 0xFFFF
+
+#define XLAT_MAX_IR 256  // guest instructions decoded for a single block
+
+// a guest instruction in the block IR. the optimizer rewrites it into zero or
+// more guest opcodes with the same effect, which are translated in its place
+#define XLAT_IR_SHADOW 0x1  // may be skipped by the instruction before it
+#define XLAT_IR_FOLLOW 0x2  // branch followed into the next instruction
+#define XLAT_IR_EXIT   0x4  // skip leaving through a side exit when cold
+#define XLAT_IR_TAKEN  0x8  // skip expected to be taken, see XLAT_IR_EXIT
+#define XLAT_IR_RAS    0x10 // followed call whose return is not followed
+
+typedef struct xlat_ir {
+    int pc;             // guest address of the instruction
+    uint16_t op[2];     // opcodes to translate, in order
+    uint8_t num_ops;    // number of entries in op, possibly zero
+    uint8_t flags;      // XLAT_IR_* flags
+    int16_t kill;       // latest instruction an op was removed in favor of
+} xlat_ir_t;
+
+typedef struct xlat_state {
+    c8_context_t *ctx;
+    xlat_block_t *xb;
+    uint16_t opcode;
+    int pc;
+    int host_map[HOST_REG_IDS];     // guest register held by each host register
+    uint32_t locked;                // host registers used by this instruction
+    uint32_t dirty;                 // guest registers modified since loaded
+    uint32_t pinned;                // guest registers held across blocks
+    int flag_op;                    // pending VF computation, if any
+    int flag_x, flag_y;             // operands of the pending computation
+    int reg_map[GUEST_REGS];
+    int reg_bits[GUEST_REGS];
+    void *reg_sync[GUEST_REGS];
+    uint8_t *skip_site;     // pending jump over the next instruction
+    const xlat_ir_t *ir;    // instructions making up the block
+    int ir_pos, ir_len;     // instruction being translated and their count
+    int profile;            // count entries and exits taken for traces
+    int system;             // system active when the block was asked for
+} xlat_state_t;
+
+int  xlat_create_cache(c8_context_t *ctx);
+void xlat_destroy_cache(c8_context_t *ctx);
+
+int  xlat_alloc_block(xlat_cache_t *xc, xlat_block_t *xb, long length);
+void xlat_commit_block(xlat_cache_t *xc, xlat_block_t *xb);
+void xlat_register_block(xlat_cache_t *xc, xlat_block_t *xb);
+void xlat_flush_cache(xlat_cache_t *xc);
+xlat_block_t *xlat_lookup_block(const xlat_cache_t *xc, int pc);
+xlat_block_t *xlat_map_block(xlat_cache_t *xc, int pc);
+xlat_block_t *xlat_get_block(xlat_cache_t *xc, int pc);
+void xlat_reset_cache(c8_context_t *ctx);
+void xlat_emit_stubs(xlat_cache_t *xc);
+void xlat_link_exit(xlat_exit_t *xe, xlat_block_t *target);
+void xlat_unlink_block(xlat_block_t *xb);
+int xlat_invalidate_range(c8_context_t *ctx, int addr, int length);
+
+int  xlat_translate_block(c8_context_t *ctx, xlat_block_t *xb, int pc,
+                          int system);
+int  xlat_retranslate_block(c8_context_t *ctx, xlat_block_t *xb);
+int  xlat_prepare_trace(c8_context_t *ctx, xlat_block_t *xb, xlat_ir_t *ir);
+int  xlat_build_trace(c8_context_t *ctx, xlat_block_t *xb,
+                      xlat_ir_t *ir, int num_ir, int system);
+int  xlat_cache_full(const xlat_cache_t *xc);
+void xlat_empty_cache(xlat_cache_t *xc);
+long xlat_run_block(c8_context_t *ctx, xlat_block_t *xb, long cycles);
+
+#ifdef HAVE_TIERED_COMPILER
+// guest instructions that store into the address space, which the emulator
+// thread only runs under the tier lock
+#define XLAT_TIER_STORE(op) (0xF055 == ((op) & 0xF0FF) || \
+                             0xF033 == ((op) & 0xF0FF))
+
+int  xlat_create_tier(c8_context_t *ctx);
+void xlat_destroy_tier(xlat_cache_t *xc);
+void xlat_lock_tier(xlat_cache_t *xc);
+void xlat_unlock_tier(xlat_cache_t *xc);
+void xlat_pause_tier(xlat_cache_t *xc);
+void xlat_resume_tier(xlat_cache_t *xc);
+void xlat_forget_opcodes(xlat_cache_t *xc, int addr, int length);
+#endif // HAVE_TIERED_COMPILER
+
+// what an instruction does besides reading and writing guest registers
+#define XLAT_GUEST_PURE     0x01 // writing its registers is its only effect
+#define XLAT_GUEST_SKIP     0x02 // may skip the instruction after it
+#define XLAT_GUEST_CALL     0x04 // runs C code that reads the context
+#define XLAT_GUEST_BARRIER  0x08 // leaves the block or runs in the interpreter
+#define XLAT_GUEST_VF_FIRST 0x10 // sets VF before it reads its operands
+
+int  xlat_guest_regs(int opcode, uint32_t *reads, uint32_t *writes);
+int  xlat_decode_block(const c8_context_t *ctx, int pc, xlat_ir_t *ir, int max);
+int  xlat_decode_trace(const c8_context_t *ctx, int pc, xlat_ir_t *ir, int max);
+int  xlat_trim_block(xlat_ir_t *ir, int count, int max);
+void xlat_optimize_block(xlat_ir_t *ir, int count);
+
+void xlat_name_block(const xlat_block_t *xb, char *name, int size);
+
+void **xlat_helper_slot(xlat_state_t *xs, void *f);
+void  *xlat_helper_by_id(int id);
+
+int  xlat_load_cache(c8_context_t *ctx, const char *dir, int length);
+void xlat_save_cache(c8_context_t *ctx);
+
+void xlat_perf_open(xlat_cache_t *xc);
+void xlat_perf_close(xlat_cache_t *xc);
+void xlat_perf_add_block(xlat_cache_t *xc, const xlat_block_t *xb);
+void xlat_perf_sync(xlat_cache_t *xc);
+
+uint64_t xlat_stats_clock(void);
+void xlat_stats_add_block(xlat_cache_t *xc, const xlat_block_t *xb,
+                          uint64_t start);
+void xlat_get_stats(const xlat_cache_t *xc, c8_jit_stats_t *stats);
+void xlat_print_stats(const xlat_cache_t *xc);
+
+void xlat_gdb_add_block(xlat_block_t *xb);
+void xlat_gdb_remove_block(xlat_block_t *xb);
+void xlat_gdb_remove_all(xlat_cache_t *xc);
+
+void *xlat_draw_routine(int system);
+int   xlat_draw_chip8(c8_context_t *ctx, int rx, int ry, int n);
+#ifdef HAVE_HCHIP_SUPPORT
+int   xlat_draw_hchip(c8_context_t *ctx, int rx, int ry, int n);
+#endif // HAVE_HCHIP_SUPPORT
+#ifdef HAVE_SCHIP_SUPPORT
+int   xlat_draw_schip(c8_context_t *ctx, int rx, int ry, int n);
+#endif // HAVE_SCHIP_SUPPORT
+
+int  xlat_alloc_state(xlat_state_t *xs);
+void xlat_free_state(xlat_state_t *xs);
+void xlat_copy_state(xlat_state_t *dst, const xlat_state_t *src);
+void xlat_merge_state(xlat_state_t *xs, const xlat_state_t *saved);
+int  xlat_next_use(const xlat_state_t *xs, int reg);
+
+void xlat_emit_call_0(xlat_state_t *xs, void *f);
+void xlat_emit_call_1(xlat_state_t *xs, void *f, size_t d1);
+void xlat_emit_call_2(xlat_state_t *xs, void *f, size_t d1, size_t d2);
+void xlat_emit_call_3(xlat_state_t *xs, void *f, size_t d1, size_t d2, size_t d3);
+void xlat_emit_call_4(xlat_state_t *xs, void *f, size_t d1, size_t d2, size_t d3, size_t d4);
+void xlat_emit_call_5(xlat_state_t *xs, void *f, size_t d1, size_t d2, size_t d3, size_t d4, size_t d5);
+void xlat_emit_call_ctx_0(xlat_state_t *xs, void *f);
+void xlat_emit_call_ctx_1(xlat_state_t *xs, void *f, size_t d1);
+void xlat_emit_call_ctx_3(xlat_state_t *xs, void *f, size_t d1, size_t d2, size_t d3);
+
+int  xlat_reserve_register(xlat_state_t *xs, int bits, int reg, void *sync);
+int  xlat_reserve_register_wo(xlat_state_t *xs, int bits, int reg, void *sync);
+int  xlat_reserve_register_rw(xlat_state_t *xs, int bits, int reg, void *sync);
+int  xlat_reserve_register_temp(xlat_state_t *xs, int bits);
+int  xlat_reserve_register_index(xlat_state_t *xs, int bits, int index);
+void xlat_commit_register(xlat_state_t *xs, int bits, int reg);
+void xlat_free_register(xlat_state_t *xs, int reg);
+void xlat_free_register_temp(xlat_state_t *xs, int host_reg);
+
+void xlat_emit_prologue(xlat_state_t *state);
+void xlat_emit_epilogue(xlat_state_t *state);
+void xlat_emit_exit(xlat_state_t *xs, int pc);
+void xlat_emit_exit_dynamic(xlat_state_t *xs);
+void xlat_emit_exit_return(xlat_state_t *xs, int rpc);
+void xlat_emit_ras_push(xlat_state_t *xs, int pc);
+void xlat_emit_exit_indirect(xlat_state_t *xs, int rpc);
+
+// allocatable host registers, provided by the backend
+extern const int xlat_host_regs[];
+extern const int xlat_num_host_regs;
+
+void xlat_emit_load_field(xlat_block_t *xb, int bits, int host_reg, int off);
+void xlat_emit_store_field(xlat_block_t *xb, int bits, int host_reg, int off);
+
+int  xlat_assign_pins(xlat_pin_t *pins, int count);
+#ifdef HAVE_REGISTER_PINNING
+void xlat_sample_pins(c8_context_t *ctx);
+#endif // HAVE_REGISTER_PINNING
+void xlat_emit_store_pins(xlat_state_t *xs);
+void xlat_emit_load_pins(xlat_state_t *xs);
+
+void xlat_emit_enter_stub(const xlat_cache_t *xc, xlat_block_t *xb);
+void xlat_emit_exit_stub(const xlat_cache_t *xc, xlat_block_t *xb);
+
+uint8_t *xlat_emit_jmp_i32(xlat_block_t *xb, void *target);
+uint8_t *xlat_emit_jcc_i32(xlat_block_t *xb, int cc, void *target);
+void xlat_emit_jmp_r64(xlat_block_t *xb, int rs);
+void xlat_patch_jump(uint8_t *site, void *target);
+void xlat_flush_icache(void *start, long length);
+
+void xlat_emit_add_sp(xlat_block_t *xb, int bytes);
+void xlat_emit_sub_sp(xlat_block_t *xb, int bytes);
+
+void xlat_emit_push_i16(xlat_block_t *xb, uint16_t is);
+void xlat_emit_push_r16(xlat_block_t *xb, int rs);
+void xlat_emit_push_i32(xlat_block_t *xb, uint32_t is);
+void xlat_emit_push_r32(xlat_block_t *xb, int rs);
+
+void xlat_emit_pop_r16(xlat_block_t *xb, int rd);
+void xlat_emit_pop_r32(xlat_block_t *xb, int rd);
+
+void xlat_emit_call_i32(xlat_block_t *xb, void *is);
+void xlat_emit_call_r32(xlat_block_t *xb, int rs);
+void xlat_emit_call_r64(xlat_block_t *xb, int rs);
+
+void xlat_emit_or_r8r8(xlat_block_t *xb, int rs, int rd);
+void xlat_emit_and_r8r8(xlat_block_t *xb, int rs, int rd);
+void xlat_emit_xor_r8r8(xlat_block_t *xb, int rs, int rd);
+void xlat_emit_add_r8r8(xlat_block_t *xb, int rs, int rd);
+void xlat_emit_sub_r8r8(xlat_block_t *xb, int rs, int rd);
+
+void xlat_emit_or_i8r8(xlat_block_t *xb, uint8_t imm, int rd);
+void xlat_emit_and_i8r8(xlat_block_t *xb, uint8_t imm, int rd);
+void xlat_emit_xor_i8r8(xlat_block_t *xb, uint8_t imm, int rd);
+void xlat_emit_add_i8r8(xlat_block_t *xb, uint8_t is, int rd);
+
+void xlat_emit_and_i16r16(xlat_block_t *xb, uint16_t imm, int rd);
+void xlat_emit_and_i32r32(xlat_block_t *xb, uint32_t imm, int rd);
+void xlat_emit_add_i16r16(xlat_block_t *xb, uint16_t imm, int rd);
+
+void xlat_emit_add_r16r16(xlat_block_t *xb, int rs, int rd);
+void xlat_emit_add_i32r64(xlat_block_t *xb, uint32_t is, int rd);
+void xlat_emit_add_r64r64(xlat_block_t *xb, int rs, int rd);
+
+void xlat_emit_mov_r8r8(xlat_block_t *xb, int rs, int rd);
+void xlat_emit_mov_r8m8(xlat_block_t *xb, int rs, uint8_t *md);
+void xlat_emit_mov_m8r8(xlat_block_t *xb, uint8_t *ms, int rd);
+void xlat_emit_mov_i8r8(xlat_block_t *xb, uint8_t is, int rd);
+void xlat_emit_mov_i8m8(xlat_block_t *xb, uint8_t is, uint8_t *md);
+void xlat_emit_mov_rmr8(xlat_block_t *xb, int rs, int rd);
+void xlat_emit_mov_r8rm(xlat_block_t *xb, int rs, int rd);
+void xlat_emit_mov_r8rm_offset(xlat_block_t *xb, int rs, int rd, int off);
+
+void xlat_emit_mov_r16m16(xlat_block_t *xb, int rs, uint16_t *md);
+void xlat_emit_mov_m16r16(xlat_block_t *xb, uint16_t *ms, int rd);
+void xlat_emit_mov_i16r16(xlat_block_t *xb, uint16_t is, int rd);
+void xlat_emit_mov_i32r32(xlat_block_t *xb, uint32_t is, int rd);
+void xlat_emit_mov_i16m16(xlat_block_t *xb, uint16_t is, uint16_t *md);
+void xlat_emit_mov_i32m32(xlat_block_t *xb, uint32_t is, int md);
+void xlat_emit_mov_m32r32(xlat_block_t *xb, int ms, int rd);
+void xlat_emit_mov_r32m32(xlat_block_t *xb, int rs, int md);
+void xlat_emit_mov_m64r64(xlat_block_t *xb, int ms, int rd);
+void xlat_emit_mov_r64m64(xlat_block_t *xb, int rs, int md);
+void xlat_emit_mov_r32r32(xlat_block_t *xb, int rs, int rd);
+void xlat_emit_mov_i32rm_offset(xlat_block_t *xb, uint32_t is, int rd, int off);
+
+void xlat_emit_test_r32r32(xlat_block_t *xb, int rs, int rd);
+void xlat_emit_test_r64r64(xlat_block_t *xb, int rs, int rd);
+void xlat_emit_cmp_r32m32(xlat_block_t *xb, int rs, int md);
+void xlat_emit_cmp_r32rm_offset(xlat_block_t *xb, int rs, int rb, int off);
+void xlat_emit_cmp_i32m32(xlat_block_t *xb, uint32_t is, int md);
+void xlat_emit_cmp_i8m32(xlat_block_t *xb, int8_t is, int md);
+void xlat_emit_cmp_i32rm_offset(xlat_block_t *xb, uint32_t is, int rd, int offset);
+void xlat_emit_cmp_i8rm_offset(xlat_block_t *xb, int8_t is, int rd, int offset);
+void xlat_emit_sub_i32m32(xlat_block_t *xb, uint32_t is, int md);
+void xlat_emit_add_i32m32(xlat_block_t *xb, uint32_t is, int md);
+
+void xlat_emit_mov_i16rm_index(xlat_block_t *xb, uint16_t is, int rb, int ri);
+
+void xlat_emit_mov_rmr16_offset(xlat_block_t *xb, int rs, int rd, int offset);
+void xlat_emit_mov_i16rm_offset(xlat_block_t *xb, uint16_t is, int rd, int offset);
+void xlat_emit_mov_r16rm_offset(xlat_block_t *xb, int rs, int rd, int offset);
+void xlat_emit_mov_rmr32_offset(xlat_block_t *xb, int rs, int rd, int offset);
+void xlat_emit_mov_r32rm_offset(xlat_block_t *xb, int rs, int rd, int offset);
+void xlat_emit_mov_rmr64_offset(xlat_block_t *xb, int rs, int rd, int offset);
+void xlat_emit_mov_r64rm_offset(xlat_block_t *xb, int rs, int rd, int offset);
+
+void xlat_emit_mov_rmr32_scale(xlat_block_t *xb, int rs, int rb, int ri, int scale);
+void xlat_emit_mov_r32rm_scale(xlat_block_t *xb, int rb, int ri, int scale, int rd);
+
+void xlat_emit_mov_i64r64(xlat_block_t *xb, uint64_t is, int rd);
+void xlat_emit_mov_r64r64(xlat_block_t *xb, int rs, int rd);
+void xlat_emit_lea_rmr64_offset(xlat_block_t *xb, int rs, int rd, int offset);
+void xlat_emit_lea_m64r64(xlat_block_t *xb, int ms, int rd);
+
+void xlat_emit_movzx_r8r32(xlat_block_t *xb, int rs, int rd);
+void xlat_emit_movzx_rm8r32_offset(xlat_block_t *xb, int rs, int rd, int offset);
+void xlat_emit_movzx_rm16r32_offset(xlat_block_t *xb, int rs, int rd, int offset);
+void xlat_emit_movzx_m8r32(xlat_block_t *xb, uint8_t *is, int rd);
+void xlat_emit_movzx_m16r32(xlat_block_t *xb, uint16_t *is, int rd);
+
+void xlat_emit_cmp_r8r8(xlat_block_t *xb, int rs, int rd);
+void xlat_emit_cmp_i8r8(xlat_block_t *xb, uint8_t i8, int rd);
+void xlat_emit_cmp_i32r32(xlat_block_t *xb, uint32_t is, int rd);
+void xlat_emit_setcc_r8(xlat_block_t *xb, int cc, int rd);
+
+void xlat_emit_cmove_r16m16(xlat_block_t *xb, int rs, uint16_t *md);
+void xlat_emit_cmovne_r16m16(xlat_block_t *xb, int rs, uint16_t *md);
+
+void xlat_emit_cmove_r16r16(xlat_block_t *xb, int rs, int rd);
+void xlat_emit_cmovne_r16r16(xlat_block_t *xb, int rs, int rd);
+
+void xlat_emit_shl_i8r64(xlat_block_t *xb, uint8_t imm, int rd);
+void xlat_emit_shr_i8r8(xlat_block_t *xb, uint8_t imm, int rd);
+void xlat_emit_shr_i8r32(xlat_block_t *xb, uint8_t imm, int rd);
+void xlat_emit_imul_i32r32(xlat_block_t *xb, uint32_t is, int rs, int rd);
+void xlat_emit_mul_r8(xlat_block_t *xb, int rs);
+
+void xlat_emit_ret(xlat_block_t *xb);
+
+#endif // GCHIP_XLAT__H
+
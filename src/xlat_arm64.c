@@ -0,0 +1,829 @@
+// gchip - a simple recompiling chip-8 emulator
+// Copyright (C) 2011  Garrett Smith.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "xlat.h"
+
+// AArch64 backend. Host register ids are the X register numbers, so indices
+// 0 and 1 requested by the frontend are x0 and x1, the first argument and
+// return registers. 8-bit values are kept zero-extended in W registers, which
+// lets full width compares stand in for the x86 byte compares.
+
+// Host registers handed out by the allocator. Only callee-saved registers are
+// used, so guest values survive calls from translated code into the emulator.
+// XLAT_CTX_REG (x28) is callee-saved as well but never handed out.
+const int xlat_host_regs[] = { 19, 20, 21, 22, 23, 24, 25, 26, 27 };
+
+#define HOST_REGS ((int)(sizeof(xlat_host_regs) / sizeof(xlat_host_regs[0])))
+const int xlat_num_host_regs = HOST_REGS;
+
+// registers preserved by the enter and exit stubs, stored in pairs above the
+// frame record
+#define SAVED_REGS (HOST_REGS + 1)
+#define FRAME_SIZE (16 + ((SAVED_REGS + 1) & ~1) * 8)
+
+// Host registers that may hold pinned guest registers, taken from the end of
+// xlat_host_regs.
+static const int pin_regs[] = { 27, 26, 25, 24 };
+#define PIN_REGS ((int)(sizeof(pin_regs) / sizeof(pin_regs[0])))
+
+// intra-procedure-call scratch registers, used within a single emitter only.
+// TMP0 holds addresses, TMP1 holds values
+#define TMP0 16
+#define TMP1 17
+#define REG_FP 29
+#define REG_LR 30
+#define REG_ZR 31
+#define REG_SP 31
+
+// register forms of the add/sub family, W variants
+#define A64_ADD  0x0B000000
+#define A64_ADDS 0x2B000000
+#define A64_SUB  0x4B000000
+#define A64_SUBS 0x6B000000
+#define A64_X    0x80000000  // select the X variant
+#define A64_IMM  0x06000000  // register form to immediate form
+
+// logical register forms, W variants. the immediate forms are at 0x12000000
+// and up in the same order
+#define A64_AND  0x0A000000
+#define A64_ORR  0x2A000000
+#define A64_EOR  0x4A000000
+#define A64_ANDS 0x6A000000
+
+// unsigned offset loads and stores
+#define A64_STRB 0x39000000
+#define A64_LDRB 0x39400000
+#define A64_STRH 0x79000000
+#define A64_LDRH 0x79400000
+#define A64_STRW 0xB9000000
+#define A64_LDRW 0xB9400000
+#define A64_STRX 0xF9000000
+#define A64_LDRX 0xF9400000
+
+// -----------------------------------------------------------------------------
+// Write a 32-bit instruction to the translation buffer.
+INLINE void emit_32(xlat_block_t *xb, uint32_t data)
+{
+    *(uint32_t *)xb->ptr = data;
+    xb->ptr += 4;
+}
+
+// -----------------------------------------------------------------------------
+// Map one of the XLAT_CC_* condition codes onto an AArch64 condition. The
+// emitters leave the carry flag inverted with respect to x86, as the ARM
+// flags do after a subtraction, so B becomes LO and so on.
+INLINE int arm_cond(int cc)
+{
+    switch (cc) {
+    case XLAT_CC_B:  return 0x3;   // lo
+    case XLAT_CC_AE: return 0x2;   // hs
+    case XLAT_CC_E:  return 0x0;   // eq
+    case XLAT_CC_NE: return 0x1;   // ne
+    case XLAT_CC_BE: return 0x9;   // ls
+    case XLAT_CC_A:  return 0x8;   // hi
+    case XLAT_CC_LE: return 0xD;   // le
+    case XLAT_CC_G:  return 0xC;   // gt
+    default:
+        assert(!"arm_cond: invalid condition code");
+        return 0xE;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Encode imm as a logical immediate for a register of the given width. Returns
+// the N:immr:imms fields, or -1 if the value is not a rotated run of ones
+// repeated across the register.
+static int encode_bitmask(uint64_t imm, int width)
+{
+    uint64_t mask = (64 == width) ? ~0ull : ((1ull << width) - 1);
+    uint64_t elem, emask, run;
+    int size, ones, rot;
+
+    imm &= mask;
+    if (0 == imm || mask == imm)
+        return -1;
+
+    // find the smallest element the value is a repetition of
+    for (size = width; size > 2; size >>= 1) {
+        uint64_t half = (1ull << (size >> 1)) - 1;
+        if ((imm & half) != ((imm >> (size >> 1)) & half))
+            break;
+    }
+
+    emask = (64 == size) ? ~0ull : ((1ull << size) - 1);
+    elem = imm & emask;
+    for (ones = 0, run = elem; run; run &= run - 1)
+        ++ones;
+
+    run = (1ull << ones) - 1;
+    for (rot = 0; rot < size; ++rot) {
+        uint64_t r = rot ? (((run >> rot) | (run << (size - rot))) & emask) : run;
+        if (r == elem)
+            break;
+    }
+    if (rot == size)
+        return -1;
+
+    return ((64 == size) << 12) | (rot << 6)
+         | ((~(size * 2 - 1) & 0x3F) | (ones - 1));
+}
+
+// -----------------------------------------------------------------------------
+// Load an arbitrary immediate into rd using the shortest MOVZ/MOVN/MOVK
+// sequence. The X register is written when x64 is set.
+static void emit_mov_imm(xlat_block_t *xb, int x64, int rd, uint64_t imm)
+{
+    uint32_t sf = x64 ? A64_X : 0;
+    int hw, count = x64 ? 4 : 2, first = 1;
+
+    if (!x64)
+        imm &= 0xFFFFFFFF;
+
+    // a value that differs from all ones in a single halfword takes a MOVN
+    for (hw = 0; hw < count; ++hw) {
+        uint64_t rest = ~imm & ~(0xFFFFull << (hw * 16));
+        if (!x64)
+            rest &= 0xFFFFFFFF;
+        if (0 == rest) {
+            uint32_t chunk = (uint32_t)(~imm >> (hw * 16)) & 0xFFFF;
+            emit_32(xb, sf | 0x12800000 | (hw << 21) | (chunk << 5) | rd);
+            return;
+        }
+    }
+
+    for (hw = 0; hw < count; ++hw) {
+        uint32_t chunk = (uint32_t)(imm >> (hw * 16)) & 0xFFFF;
+        if (0 == chunk)
+            continue;
+        emit_32(xb, sf | (first ? 0x52800000 : 0x72800000) | (hw << 21)
+                       | (chunk << 5) | rd);
+        first = 0;
+    }
+    if (first)
+        emit_32(xb, sf | 0x52800000 | rd);
+}
+
+// -----------------------------------------------------------------------------
+// Emit op (an A64_ADD family register form) with an immediate second operand.
+// Negative values flip between add and sub. Plain adds that do not fit twelve
+// bits take two instructions, anything else goes through a scratch register.
+static void emit_addsub_imm(xlat_block_t *xb, uint32_t op, int rd, int rn,
+        int64_t imm)
+{
+    int setflags = (op & 0x20000000) != 0;
+    int tmp = (TMP1 == rn) ? TMP0 : TMP1;
+
+    if (imm < 0) {
+        op ^= 0x40000000;
+        imm = -imm;
+    }
+
+    if (imm < 0x1000) {
+        emit_32(xb, (op + A64_IMM) | ((uint32_t)imm << 10) | (rn << 5) | rd);
+    } else if (!(imm & 0xFFF) && imm < 0x1000000) {
+        emit_32(xb, (op + A64_IMM) | (1 << 22) | ((uint32_t)(imm >> 12) << 10)
+                  | (rn << 5) | rd);
+    } else if (!setflags && imm < 0x1000000) {
+        emit_32(xb, (op + A64_IMM) | (1 << 22) | ((uint32_t)(imm >> 12) << 10)
+                  | (rn << 5) | rd);
+        emit_32(xb, (op + A64_IMM) | ((uint32_t)(imm & 0xFFF) << 10)
+                  | (rd << 5) | rd);
+    } else {
+        emit_mov_imm(xb, (op & A64_X) != 0, tmp, (uint64_t)imm);
+        emit_32(xb, op | (tmp << 16) | (rn << 5) | rd);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Emit op (an A64_AND family register form) with an immediate second operand,
+// through a scratch register if it has no logical immediate encoding.
+static void emit_logical_imm(xlat_block_t *xb, uint32_t op, int rd, int rn,
+        uint64_t imm)
+{
+    int x64 = (op & A64_X) != 0;
+    int bits = encode_bitmask(imm, x64 ? 64 : 32);
+
+    if (bits >= 0) {
+        emit_32(xb, (op & 0xE0000000) | 0x12000000 | (bits << 10)
+                  | (rn << 5) | rd);
+    } else {
+        emit_mov_imm(xb, x64, TMP1, imm);
+        emit_32(xb, op | (TMP1 << 16) | (rn << 5) | rd);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Emit a load or store of 1 << shift bytes between rt and [rn + off].
+static void emit_ldst(xlat_block_t *xb, uint32_t op, int shift, int rt,
+        int rn, int off)
+{
+    if (off >= 0 && !(off & ((1 << shift) - 1)) && (off >> shift) < 0x1000) {
+        emit_32(xb, op | ((off >> shift) << 10) | (rn << 5) | rt);
+    } else if (off >= -256 && off < 256) {
+        // unscaled form, LDUR/STUR
+        emit_32(xb, (op & ~0x01000000) | ((off & 0x1FF) << 12)
+                  | (rn << 5) | rt);
+    } else {
+        int tmp = (TMP0 == rt || TMP0 == rn) ? TMP1 : TMP0;
+        assert(tmp != rt && tmp != rn);
+        emit_mov_imm(xb, 1, tmp, (uint64_t)(int64_t)off);
+        emit_32(xb, A64_X | A64_ADD | (tmp << 16) | (rn << 5) | tmp);
+        emit_32(xb, op | (tmp << 5) | rt);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Point rd at the cache, loaded from the context, returning what is left of
+// the displacement off. Anything beyond the reach of a scaled load is added.
+static int emit_data_page(xlat_block_t *xb, int rd, int off)
+{
+    emit_ldst(xb, A64_LDRX, 3, rd, XLAT_CTX_REG, XLAT_CTX(xc));
+    if (off & ~0xFFF)
+        emit_addsub_imm(xb, A64_X | A64_ADD, rd, rd, off & ~0xFFF);
+    return off & 0xFFF;
+}
+
+// -----------------------------------------------------------------------------
+// Emit a load or store between rt and the cache data at off, through TMP0.
+static void emit_ldst_data(xlat_block_t *xb, uint32_t op, int shift, int rt,
+        int off)
+{
+    off = emit_data_page(xb, TMP0, off);
+    emit_ldst(xb, op, shift, rt, TMP0, off);
+}
+
+// -----------------------------------------------------------------------------
+// Emit an indirect call to f, loaded into TMP0 from its slot in the helper
+// table. Only callee-saved registers and the argument registers set up by the
+// caller survive.
+static void emit_call(xlat_state_t *xs, void *f)
+{
+    void **slot = xlat_helper_slot(xs, f);
+    emit_ldst_data(xs->xb, A64_LDRX, 3, TMP0,
+                   XLAT_CACHE_OFFSET(xs->ctx->xc, slot));
+    emit_32(xs->xb, 0xD63F0000 | (TMP0 << 5));
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_call_0(xlat_state_t *xs, void *f)
+{
+    xlat_reserve_register_index(xs, 32, 0);
+    emit_call(xs, f);
+}
+
+// -----------------------------------------------------------------------------
+// Call f(ctx).
+void xlat_emit_call_ctx_0(xlat_state_t *xs, void *f)
+{
+    int x0 = xlat_reserve_register_index(xs, 32, 0);
+    xlat_emit_mov_r64r64(xs->xb, XLAT_CTX_REG, x0);
+    emit_call(xs, f);
+}
+
+// -----------------------------------------------------------------------------
+// Call f(ctx, d1).
+void xlat_emit_call_ctx_1(xlat_state_t *xs, void *f, size_t d1)
+{
+    int x0 = xlat_reserve_register_index(xs, 32, 0);
+    int x1 = xlat_reserve_register_index(xs, 32, 1);
+    xlat_emit_mov_r64r64(xs->xb, XLAT_CTX_REG, x0);
+    xlat_emit_mov_i64r64(xs->xb, d1, x1);
+    emit_call(xs, f);
+}
+
+// -----------------------------------------------------------------------------
+// Call f(ctx, d1, d2, d3).
+void xlat_emit_call_ctx_3(xlat_state_t *xs, void *f, size_t d1, size_t d2,
+        size_t d3)
+{
+    int x0 = xlat_reserve_register_index(xs, 32, 0);
+    int x1 = xlat_reserve_register_index(xs, 32, 1);
+    int x2 = xlat_reserve_register_index(xs, 32, 2);
+    int x3 = xlat_reserve_register_index(xs, 32, 3);
+    xlat_emit_mov_r64r64(xs->xb, XLAT_CTX_REG, x0);
+    xlat_emit_mov_i64r64(xs->xb, d1, x1);
+    xlat_emit_mov_i64r64(xs->xb, d2, x2);
+    xlat_emit_mov_i64r64(xs->xb, d3, x3);
+    emit_call(xs, f);
+}
+
+// -----------------------------------------------------------------------------
+// Emit a jump to target, or to the next instruction if target is NULL. The
+// returned site may later be retargeted with xlat_patch_jump.
+uint8_t *xlat_emit_jmp_i32(xlat_block_t *xb, void *target)
+{
+    uint8_t *site = xb->ptr;
+    emit_32(xb, 0x14000001);
+    if (NULL != target)
+        xlat_patch_jump(site, target);
+    return site;
+}
+
+// -----------------------------------------------------------------------------
+// Emit a conditional jump using one of the XLAT_CC_* condition codes. Its
+// range of 1MB covers the whole code arena.
+uint8_t *xlat_emit_jcc_i32(xlat_block_t *xb, int cc, void *target)
+{
+    uint8_t *site = xb->ptr;
+    emit_32(xb, 0x54000020 | arm_cond(cc));
+    if (NULL != target)
+        xlat_patch_jump(site, target);
+    return site;
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_jmp_r64(xlat_block_t *xb, int rs)
+{
+    emit_32(xb, 0xD61F0000 | (rs << 5));
+}
+
+// -----------------------------------------------------------------------------
+// Retarget a jump previously emitted by xlat_emit_jmp_i32 or xlat_emit_jcc_i32.
+void xlat_patch_jump(uint8_t *site, void *target)
+{
+    uint32_t insn = *(uint32_t *)site;
+    int64_t off = ((uint8_t *)target - site) >> 2;
+
+    if (0x14000000 == (insn & 0xFC000000)) {
+        assert(off >= -(1 << 25) && off < (1 << 25));
+        insn = 0x14000000 | (uint32_t)(off & 0x3FFFFFF);
+    } else {
+        assert(0x54000000 == (insn & 0xFF000010));
+        assert(off >= -(1 << 18) && off < (1 << 18));
+        insn = (insn & 0xFF00001F) | ((uint32_t)(off & 0x7FFFF) << 5);
+    }
+    *(uint32_t *)site = insn;
+    xlat_flush_icache(site, 4);
+}
+
+// -----------------------------------------------------------------------------
+// Make newly written code visible to instruction fetch, which on AArch64 is
+// not coherent with data stores.
+void xlat_flush_icache(void *start, long length)
+{
+    __builtin___clear_cache((char *)start, (char *)start + length);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_or_r8r8(xlat_block_t *xb, int rs, int rd)
+{
+    emit_32(xb, A64_ORR | (rs << 16) | (rd << 5) | rd);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_and_r8r8(xlat_block_t *xb, int rs, int rd)
+{
+    emit_32(xb, A64_AND | (rs << 16) | (rd << 5) | rd);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_xor_r8r8(xlat_block_t *xb, int rs, int rd)
+{
+    emit_32(xb, A64_EOR | (rs << 16) | (rd << 5) | rd);
+}
+
+// -----------------------------------------------------------------------------
+// Add two bytes. The carry out of bit 7 is left as LO (XLAT_CC_C) by comparing
+// the 9-bit sum against 0xFF before it is truncated.
+void xlat_emit_add_r8r8(xlat_block_t *xb, int rs, int rd)
+{
+    emit_32(xb, A64_ADD | (rs << 16) | (rd << 5) | rd);
+    emit_mov_imm(xb, 0, TMP1, 0xFF);
+    emit_32(xb, A64_SUBS | (rd << 16) | (TMP1 << 5) | REG_ZR);
+    emit_logical_imm(xb, A64_AND, rd, rd, 0xFF);
+}
+
+// -----------------------------------------------------------------------------
+// Subtract two bytes. A borrow leaves the carry clear, which is LO.
+void xlat_emit_sub_r8r8(xlat_block_t *xb, int rs, int rd)
+{
+    emit_32(xb, A64_SUBS | (rs << 16) | (rd << 5) | rd);
+    emit_logical_imm(xb, A64_AND, rd, rd, 0xFF);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_and_i8r8(xlat_block_t *xb, uint8_t imm, int rd)
+{
+    emit_logical_imm(xb, A64_AND, rd, rd, imm);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_add_i8r8(xlat_block_t *xb, uint8_t is, int rd)
+{
+    emit_addsub_imm(xb, A64_ADD, rd, rd, is);
+    emit_logical_imm(xb, A64_AND, rd, rd, 0xFF);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_and_i32r32(xlat_block_t *xb, uint32_t imm, int rd)
+{
+    emit_logical_imm(xb, A64_AND, rd, rd, imm);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_add_i32r64(xlat_block_t *xb, uint32_t is, int rd)
+{
+    emit_addsub_imm(xb, A64_X | A64_ADD, rd, rd, (int32_t)is);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_add_r64r64(xlat_block_t *xb, int rs, int rd)
+{
+    emit_32(xb, A64_X | A64_ADD | (rs << 16) | (rd << 5) | rd);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_r8r8(xlat_block_t *xb, int rs, int rd)
+{
+    xlat_emit_movzx_r8r32(xb, rs, rd);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_i8r8(xlat_block_t *xb, uint8_t is, int rd)
+{
+    emit_mov_imm(xb, 0, rd, is);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_r8rm_offset(xlat_block_t *xb, int rs, int rd, int off)
+{
+    emit_ldst(xb, A64_STRB, 0, rs, rd, off);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_i16r16(xlat_block_t *xb, uint16_t is, int rd)
+{
+    emit_mov_imm(xb, 0, rd, is);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_i32r32(xlat_block_t *xb, uint32_t is, int rd)
+{
+    emit_mov_imm(xb, 0, rd, is);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_i32m32(xlat_block_t *xb, uint32_t is, int md)
+{
+    emit_mov_imm(xb, 0, TMP1, is);
+    emit_ldst_data(xb, A64_STRW, 2, TMP1, md);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_m32r32(xlat_block_t *xb, int ms, int rd)
+{
+    emit_ldst_data(xb, A64_LDRW, 2, rd, ms);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_r32m32(xlat_block_t *xb, int rs, int md)
+{
+    emit_ldst_data(xb, A64_STRW, 2, rs, md);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_m64r64(xlat_block_t *xb, int ms, int rd)
+{
+    emit_ldst_data(xb, A64_LDRX, 3, rd, ms);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_r64m64(xlat_block_t *xb, int rs, int md)
+{
+    emit_ldst_data(xb, A64_STRX, 3, rs, md);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_r32r32(xlat_block_t *xb, int rs, int rd)
+{
+    emit_32(xb, A64_ORR | (rs << 16) | (REG_ZR << 5) | rd);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_i32rm_offset(xlat_block_t *xb, uint32_t is, int rd, int off)
+{
+    emit_mov_imm(xb, 0, TMP1, is);
+    emit_ldst(xb, A64_STRW, 2, TMP1, rd, off);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_test_r32r32(xlat_block_t *xb, int rs, int rd)
+{
+    emit_32(xb, A64_ANDS | (rs << 16) | (rd << 5) | REG_ZR);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_test_r64r64(xlat_block_t *xb, int rs, int rd)
+{
+    emit_32(xb, A64_X | A64_ANDS | (rs << 16) | (rd << 5) | REG_ZR);
+}
+
+// -----------------------------------------------------------------------------
+// Compare the value at md with rs, as CMP m32, r32 does on x86.
+void xlat_emit_cmp_r32m32(xlat_block_t *xb, int rs, int md)
+{
+    emit_ldst_data(xb, A64_LDRW, 2, TMP1, md);
+    emit_32(xb, A64_SUBS | (rs << 16) | (TMP1 << 5) | REG_ZR);
+}
+
+// -----------------------------------------------------------------------------
+// Compare the 32-bit value at [rb + off] with rs.
+void xlat_emit_cmp_r32rm_offset(xlat_block_t *xb, int rs, int rb, int off)
+{
+    emit_ldst(xb, A64_LDRW, 2, TMP1, rb, off);
+    emit_32(xb, A64_SUBS | (rs << 16) | (TMP1 << 5) | REG_ZR);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_cmp_i32m32(xlat_block_t *xb, uint32_t is, int md)
+{
+    emit_ldst_data(xb, A64_LDRW, 2, TMP1, md);
+    emit_addsub_imm(xb, A64_SUBS, REG_ZR, TMP1, (int32_t)is);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_cmp_i8m32(xlat_block_t *xb, int8_t is, int md)
+{
+    emit_ldst_data(xb, A64_LDRW, 2, TMP1, md);
+    emit_addsub_imm(xb, A64_SUBS, REG_ZR, TMP1, is);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_cmp_i32rm_offset(xlat_block_t *xb, uint32_t is, int rd, int offset)
+{
+    emit_ldst(xb, A64_LDRW, 2, TMP1, rd, offset);
+    emit_addsub_imm(xb, A64_SUBS, REG_ZR, TMP1, (int32_t)is);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_cmp_i8rm_offset(xlat_block_t *xb, int8_t is, int rd, int offset)
+{
+    emit_ldst(xb, A64_LDRW, 2, TMP1, rd, offset);
+    emit_addsub_imm(xb, A64_SUBS, REG_ZR, TMP1, is);
+}
+
+// -----------------------------------------------------------------------------
+// Subtract from a 32-bit value in memory without touching the flags.
+void xlat_emit_sub_i32m32(xlat_block_t *xb, uint32_t is, int md)
+{
+    int off = emit_data_page(xb, TMP0, md);
+    assert(is < 0x1000000);
+    emit_ldst(xb, A64_LDRW, 2, TMP1, TMP0, off);
+    emit_addsub_imm(xb, A64_SUB, TMP1, TMP1, is);
+    emit_ldst(xb, A64_STRW, 2, TMP1, TMP0, off);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_add_i32m32(xlat_block_t *xb, uint32_t is, int md)
+{
+    int off = emit_data_page(xb, TMP0, md);
+    assert(is < 0x1000000);
+    emit_ldst(xb, A64_LDRW, 2, TMP1, TMP0, off);
+    emit_addsub_imm(xb, A64_ADD, TMP1, TMP1, is);
+    emit_ldst(xb, A64_STRW, 2, TMP1, TMP0, off);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_r16rm_offset(xlat_block_t *xb, int rs, int rd, int offset)
+{
+    emit_ldst(xb, A64_STRH, 1, rs, rd, offset);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_rmr32_offset(xlat_block_t *xb, int rs, int rd, int offset)
+{
+    emit_ldst(xb, A64_LDRW, 2, rd, rs, offset);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_r32rm_offset(xlat_block_t *xb, int rs, int rd, int offset)
+{
+    emit_ldst(xb, A64_STRW, 2, rs, rd, offset);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_rmr64_offset(xlat_block_t *xb, int rs, int rd, int offset)
+{
+    emit_ldst(xb, A64_LDRX, 3, rd, rs, offset);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_r64rm_offset(xlat_block_t *xb, int rs, int rd, int offset)
+{
+    emit_ldst(xb, A64_STRX, 3, rs, rd, offset);
+}
+
+// -----------------------------------------------------------------------------
+// Load the 32-bit value at [rb + ri << scale] into rs.
+void xlat_emit_mov_rmr32_scale(xlat_block_t *xb, int rs, int rb, int ri, int scale)
+{
+    // add x16, rb, wi, uxtw #scale
+    emit_32(xb, 0x8B204000 | (ri << 16) | (scale << 10) | (rb << 5) | TMP0);
+    emit_ldst(xb, A64_LDRW, 2, rs, TMP0, 0);
+}
+
+// -----------------------------------------------------------------------------
+// Store the 32-bit value in rd to [rb + ri << scale].
+void xlat_emit_mov_r32rm_scale(xlat_block_t *xb, int rb, int ri, int scale, int rd)
+{
+    emit_32(xb, 0x8B204000 | (ri << 16) | (scale << 10) | (rb << 5) | TMP0);
+    emit_ldst(xb, A64_STRW, 2, rd, TMP0, 0);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_i64r64(xlat_block_t *xb, uint64_t is, int rd)
+{
+    emit_mov_imm(xb, 1, rd, is);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_r64r64(xlat_block_t *xb, int rs, int rd)
+{
+    emit_32(xb, A64_X | A64_ORR | (rs << 16) | (REG_ZR << 5) | rd);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_lea_rmr64_offset(xlat_block_t *xb, int rs, int rd, int offset)
+{
+    emit_addsub_imm(xb, A64_X | A64_ADD, rd, rs, offset);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_lea_m64r64(xlat_block_t *xb, int ms, int rd)
+{
+    int off = emit_data_page(xb, rd, ms);
+    if (off)
+        emit_addsub_imm(xb, A64_X | A64_ADD, rd, rd, off);
+}
+
+// -----------------------------------------------------------------------------
+// Zero-extend the low byte of rs into rd (UXTB).
+void xlat_emit_movzx_r8r32(xlat_block_t *xb, int rs, int rd)
+{
+    emit_32(xb, 0x53001C00 | (rs << 5) | rd);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_movzx_rm8r32_offset(xlat_block_t *xb, int rs, int rd, int offset)
+{
+    emit_ldst(xb, A64_LDRB, 0, rd, rs, offset);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_movzx_rm16r32_offset(xlat_block_t *xb, int rs, int rd, int offset)
+{
+    emit_ldst(xb, A64_LDRH, 1, rd, rs, offset);
+}
+
+// -----------------------------------------------------------------------------
+// Compare two bytes, setting the flags for rs - rd like the x86 emitter.
+void xlat_emit_cmp_r8r8(xlat_block_t *xb, int rs, int rd)
+{
+    emit_32(xb, A64_SUBS | (rd << 16) | (rs << 5) | REG_ZR);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_cmp_i8r8(xlat_block_t *xb, uint8_t i8, int rd)
+{
+    emit_addsub_imm(xb, A64_SUBS, REG_ZR, rd, i8);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_cmp_i32r32(xlat_block_t *xb, uint32_t is, int rd)
+{
+    emit_addsub_imm(xb, A64_SUBS, REG_ZR, rd, (int32_t)is);
+}
+
+// -----------------------------------------------------------------------------
+// Set rd to 1 if cc holds and 0 otherwise (CSET).
+void xlat_emit_setcc_r8(xlat_block_t *xb, int cc, int rd)
+{
+    emit_32(xb, 0x1A800400 | (REG_ZR << 16) | ((arm_cond(cc) ^ 1) << 12)
+              | (REG_ZR << 5) | rd);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_shl_i8r64(xlat_block_t *xb, uint8_t imm, int rd)
+{
+    // ubfm xd, xd, #(-imm mod 64), #(63 - imm)
+    emit_32(xb, 0xD3400000 | (((64 - imm) & 63) << 16) | ((63 - imm) << 10)
+              | (rd << 5) | rd);
+}
+
+// -----------------------------------------------------------------------------
+// Shift a byte right. The last bit shifted out is left as LO (XLAT_CC_C).
+void xlat_emit_shr_i8r8(xlat_block_t *xb, uint8_t imm, int rd)
+{
+    assert(imm > 0 && imm < 8);
+
+    // ubfx w17, wd, #(imm - 1), #1; cmp wzr, w17
+    emit_32(xb, 0x53000000 | ((imm - 1) << 16) | ((imm - 1) << 10)
+              | (rd << 5) | TMP1);
+    emit_32(xb, A64_SUBS | (TMP1 << 16) | (REG_ZR << 5) | REG_ZR);
+
+    // lsr wd, wd, #imm
+    emit_32(xb, 0x53000000 | (imm << 16) | (31 << 10) | (rd << 5) | rd);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_shr_i8r32(xlat_block_t *xb, uint8_t imm, int rd)
+{
+    // lsr wd, wd, #imm
+    emit_32(xb, 0x53000000 | (imm << 16) | (31 << 10) | (rd << 5) | rd);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_imul_i32r32(xlat_block_t *xb, uint32_t is, int rs, int rd)
+{
+    emit_mov_imm(xb, 0, TMP1, is);
+    emit_32(xb, 0x1B007C00 | (TMP1 << 16) | (rs << 5) | rd);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_ret(xlat_block_t *xb)
+{
+    emit_32(xb, 0xD65F0000 | (REG_LR << 5));
+}
+
+// -----------------------------------------------------------------------------
+// Hand out host registers to the first count entries of pins, whose guest
+// register, width and offset are already filled in. Returns how many could
+// be pinned.
+int xlat_assign_pins(xlat_pin_t *pins, int count)
+{
+    int i;
+    count = MIN(count, PIN_REGS);
+    for (i = 0; i < count; ++i)
+        pins[i].host_reg = pin_regs[i];
+    return count;
+}
+
+// -----------------------------------------------------------------------------
+INLINE int saved_reg(int i)
+{
+    return (i < HOST_REGS) ? xlat_host_regs[i] : XLAT_CTX_REG;
+}
+
+// -----------------------------------------------------------------------------
+// Emit a STP or LDP of a register pair at [sp + off].
+INLINE void emit_pair(xlat_block_t *xb, uint32_t op, int rt, int rt2, int off)
+{
+    emit_32(xb, op | (((off / 8) & 0x7F) << 15) | (rt2 << 10) | (REG_SP << 5)
+              | rt);
+}
+
+// -----------------------------------------------------------------------------
+// Emit the trampoline that C code calls to run a translated block. It pushes
+// a frame record, saves the allocatable registers in pairs, loads the context
+// into XLAT_CTX_REG, loads the pinned guest registers and jumps to the code.
+void xlat_emit_enter_stub(const xlat_cache_t *xc, xlat_block_t *xb)
+{
+    int i;
+
+    assert(!(SAVED_REGS & 1));
+    emit_pair(xb, 0xA9800000, REG_FP, REG_LR, -FRAME_SIZE);   // stp, pre-index
+    emit_32(xb, A64_X | (A64_ADD + A64_IMM) | (REG_SP << 5) | REG_FP);
+    for (i = 0; i < SAVED_REGS; i += 2)
+        emit_pair(xb, 0xA9000000, saved_reg(i), saved_reg(i + 1), 16 + i * 8);
+
+    xlat_emit_mov_r64r64(xb, 1, XLAT_CTX_REG);
+    for (i = 0; i < xc->num_pins; ++i)
+        xlat_emit_load_field(xb, xc->pins[i].bits, xc->pins[i].host_reg,
+                             xc->pins[i].offset);
+    xlat_emit_jmp_r64(xb, 0);
+}
+
+// -----------------------------------------------------------------------------
+// Emit the code every block exit jumps to in order to return to the caller
+// of the enter stub. Pinned guest registers are written back on the way out.
+void xlat_emit_exit_stub(const xlat_cache_t *xc, xlat_block_t *xb)
+{
+    int i;
+
+    for (i = 0; i < xc->num_pins; ++i)
+        xlat_emit_store_field(xb, xc->pins[i].bits, xc->pins[i].host_reg,
+                              xc->pins[i].offset);
+
+    for (i = 0; i < SAVED_REGS; i += 2)
+        emit_pair(xb, 0xA9400000, saved_reg(i), saved_reg(i + 1), 16 + i * 8);
+    emit_pair(xb, 0xA8C00000, REG_FP, REG_LR, FRAME_SIZE);    // ldp, post-index
+    xlat_emit_ret(xb);
+}
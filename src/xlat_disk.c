@@ -0,0 +1,535 @@
+// gchip - a simple recompiling chip-8 emulator
+// Copyright (C) 2011  Garrett Smith.
+// 
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+// 
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "chip8.h"
+#include "xlat.h"
+
+#ifdef PLATFORM_WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif // PLATFORM_WIN32
+
+// Translations are saved to a directory and loaded again the next time the
+// same program is run, so it starts with the blocks it had when it last quit.
+// A file is named after a hash of the program and the build that wrote it,
+// and holds the code arena as translated, which is position independent apart
+// from the helper table it calls C through. Helpers are saved by id and
+// looked up again on load. Code also refers to block records by their offset
+// in the cache, so the block map is saved and rebuilt with each leaf at its
+// old place in the pool. Every block records a checksum of the guest code it was translated
+// from, which must still match the program being loaded.
+
+#define XLAT_DISK_MAGIC   0x43584347    // "GCXC"
+#define XLAT_DISK_VERSION 4
+#define XLAT_DISK_BUILD   GCHIP_VERSION_STR " " __DATE__ " " __TIME__
+
+// options that change what translated code looks like
+#define XLAT_DISK_FEATURES  (XLAT_DISK_HCHIP | XLAT_DISK_SCHIP | \
+                             XLAT_DISK_MCHIP | XLAT_DISK_PINS)
+#ifdef HAVE_HCHIP_SUPPORT
+#define XLAT_DISK_HCHIP (1 << 0)
+#else
+#define XLAT_DISK_HCHIP 0
+#endif // HAVE_HCHIP_SUPPORT
+#ifdef HAVE_SCHIP_SUPPORT
+#define XLAT_DISK_SCHIP (1 << 1)
+#else
+#define XLAT_DISK_SCHIP 0
+#endif // HAVE_SCHIP_SUPPORT
+#ifdef HAVE_MCHIP_SUPPORT
+#define XLAT_DISK_MCHIP (1 << 2)
+#else
+#define XLAT_DISK_MCHIP 0
+#endif // HAVE_MCHIP_SUPPORT
+#ifdef HAVE_REGISTER_PINNING
+#define XLAT_DISK_PINS  (1 << 3)
+#else
+#define XLAT_DISK_PINS  0
+#endif // HAVE_REGISTER_PINNING
+
+typedef struct xlat_disk_header {
+    uint32_t magic;                 // XLAT_DISK_MAGIC
+    uint32_t version;               // XLAT_DISK_VERSION
+    char build[64];                 // XLAT_DISK_BUILD of the writer
+    uint32_t features;              // XLAT_DISK_FEATURES of the writer
+    uint32_t cache_size;            // sizeof(xlat_cache_t)
+    uint32_t block_size;            // sizeof(xlat_block_t)
+    int64_t code_size;              // size of the code arena
+    int64_t code_base;              // arena offset of the first block
+    int64_t code_used;              // bytes of the arena in use
+    uint64_t rom_hash;              // hash the file is named after
+    int32_t rom_size;               // address space the code wraps within
+    int32_t num_pins;               // pinned registers the code assumes
+    int32_t pins_chosen;            // set once the profile had been used
+    xlat_pin_t pins[XLAT_MAX_PINS];
+    int32_t num_helpers;            // helper ids that follow the header
+    int32_t num_leaves;             // leaves of the block map in use
+    int32_t leaves[XLAT_MAX_LEAVES]; // range of guest memory of each leaf
+    int32_t num_blocks;             // block records that follow the arena
+} xlat_disk_header_t;
+
+typedef struct xlat_disk_exit {
+    int32_t site;                   // offsets from the start of the block
+    int32_t stub;
+    int32_t target_pc;
+} xlat_disk_exit_t;
+
+typedef struct xlat_disk_block {
+    int64_t offset;                 // arena offset of the code
+    int64_t length;                 // bytes of code
+    int64_t num_cycles;
+    int32_t pc;
+    int32_t size;
+    int32_t idle;
+    int32_t trace;
+    int32_t countdown;
+    int32_t num_segs;
+    int32_t num_exits;
+    uint32_t checksum;              // of the guest code translated
+    xlat_seg_t segs[XLAT_MAX_SEGS - 1];
+    xlat_disk_exit_t exits[XLAT_MAX_EXITS];
+} xlat_disk_block_t;
+
+// most guest bytes a run of a block covers: every instruction decoded, and
+// as many stepped over by skips
+#define XLAT_DISK_MAX_RUN (XLAT_MAX_IR * 4)
+
+#define FNV_BASIS_32 0x811C9DC5u
+#define FNV_PRIME_32 0x01000193u
+#define FNV_BASIS_64 0xCBF29CE484222325ull
+#define FNV_PRIME_64 0x00000100000001B3ull
+
+// -----------------------------------------------------------------------------
+static uint64_t xlat_hash_64(uint64_t hash, const uint8_t *p, long length)
+{
+    while (length-- > 0)
+        hash = (hash ^ *p++) * FNV_PRIME_64;
+    return hash;
+}
+
+// -----------------------------------------------------------------------------
+static uint32_t xlat_hash_run(uint32_t hash, const c8_context_t *ctx, int pc,
+        int size)
+{
+    while (size-- > 0)
+        hash = (hash ^ ctx->rom[pc++ & ROM_MASK(ctx)]) * FNV_PRIME_32;
+    return hash;
+}
+
+// -----------------------------------------------------------------------------
+// Return a checksum of the guest code a block was translated from.
+static uint32_t xlat_hash_block(const c8_context_t *ctx,
+        const xlat_block_t *xb)
+{
+    uint32_t hash = xlat_hash_run(FNV_BASIS_32, ctx, xb->pc, xb->size);
+    int i;
+
+    for (i = 0; i < xb->num_segs; ++i)
+        hash = xlat_hash_run(hash, ctx, xb->segs[i].pc, xb->segs[i].size);
+    return hash;
+}
+
+// -----------------------------------------------------------------------------
+// Check that a header was written by this build for the same program and an
+// arena of the same layout.
+static int xlat_check_header(const xlat_cache_t *xc,
+        const xlat_disk_header_t *hdr, uint64_t rom_hash)
+{
+    return XLAT_DISK_MAGIC == hdr->magic &&
+           XLAT_DISK_VERSION == hdr->version &&
+           0 == strncmp(hdr->build, XLAT_DISK_BUILD, sizeof(hdr->build)) &&
+           XLAT_DISK_FEATURES == hdr->features &&
+           sizeof(xlat_cache_t) == hdr->cache_size &&
+           sizeof(xlat_block_t) == hdr->block_size &&
+           xc->code_size == hdr->code_size &&
+           rom_hash == hdr->rom_hash &&
+           xc->addr_mask + 1 == hdr->rom_size &&
+           hdr->code_base <= hdr->code_used &&
+           hdr->code_used <= hdr->code_size &&
+           hdr->num_pins >= 0 && hdr->num_pins <= XLAT_MAX_PINS &&
+           hdr->num_helpers >= 0 && hdr->num_helpers <= XLAT_MAX_HELPERS &&
+           hdr->num_leaves >= 0 && hdr->num_leaves <= xc->max_leaves &&
+           hdr->num_blocks >= 0 &&
+           hdr->num_blocks <= (hdr->num_leaves << XLAT_MAP_SHIFT);
+}
+
+// -----------------------------------------------------------------------------
+// Check that a run of guest code lies within the address space and is no
+// longer than a block can cover.
+static int xlat_check_run(const xlat_disk_header_t *hdr, int pc, int size)
+{
+    return pc >= 0 && pc < hdr->rom_size && size > 0 &&
+           size <= hdr->rom_size && size <= XLAT_DISK_MAX_RUN;
+}
+
+// -----------------------------------------------------------------------------
+// Check that a block record lies within the arena, whose code has been read,
+// and describes a block that could have been translated.
+static int xlat_check_block(const xlat_cache_t *xc,
+        const xlat_disk_header_t *hdr, const xlat_disk_block_t *rec)
+{
+    const uint8_t *code = xc->code + rec->offset;
+    int i;
+
+    if (rec->offset < hdr->code_base || rec->length <= 0 ||
+            rec->offset + rec->length > hdr->code_used ||
+            !xlat_check_run(hdr, rec->pc, rec->size) ||
+            rec->num_segs < 0 || rec->num_segs >= XLAT_MAX_SEGS ||
+            rec->num_exits < 0 || rec->num_exits > XLAT_MAX_EXITS)
+        return 0;
+
+    for (i = 0; i < rec->num_segs; ++i) {
+        if (!xlat_check_run(hdr, rec->segs[i].pc, rec->segs[i].size))
+            return 0;
+    }
+    for (i = 0; i < rec->num_exits; ++i) {
+        const xlat_disk_exit_t *ex = &rec->exits[i];
+        if (ex->site < 0 || ex->site >= rec->length ||
+                ex->site + XLAT_JUMP_SIZE(code + ex->site) > rec->length ||
+                ex->stub < 0 || ex->stub >= rec->length ||
+                ex->target_pc < 0 || ex->target_pc >= hdr->rom_size)
+            return 0;
+    }
+    return 1;
+}
+
+// -----------------------------------------------------------------------------
+// Install a saved block whose code is already in the arena, unless the guest
+// code it was translated from has changed. Returns nonzero if installed.
+static int xlat_install_block(c8_context_t *ctx, const xlat_disk_block_t *rec)
+{
+    xlat_cache_t *xc = ctx->xc;
+    xlat_block_t *xb = xlat_lookup_block(xc, rec->pc);
+    int i;
+
+    if (NULL == xb || NULL != xb->block)
+        return 0;
+
+    memset(xb, 0, sizeof(xlat_block_t));
+    xb->block = xc->code + rec->offset;
+    xb->ptr = xb->block + rec->length;
+    xb->length = (long)rec->length;
+    xb->num_cycles = (long)rec->num_cycles;
+    xb->pc = rec->pc;
+    xb->size = rec->size;
+    xb->idle = rec->idle;
+    xb->trace = rec->trace;
+    xb->countdown = rec->countdown;
+    xb->num_segs = rec->num_segs;
+    memcpy(xb->segs, rec->segs, sizeof(xb->segs));
+    xb->num_exits = rec->num_exits;
+    for (i = 0; i < rec->num_exits; ++i) {
+        xb->exits[i].site = xb->block + rec->exits[i].site;
+        xb->exits[i].stub = xb->block + rec->exits[i].stub;
+        xb->exits[i].target_pc = rec->exits[i].target_pc;
+    }
+    for (i = 0; i < XLAT_IC_SIZE; ++i)
+        xb->ic[i].pc = -1;
+
+    if (xlat_hash_block(ctx, xb) != rec->checksum) {
+        memset(xb, 0, sizeof(xlat_block_t));
+        return 0;
+    }
+
+    xlat_register_block(xc, xb);
+    return 1;
+}
+
+// -----------------------------------------------------------------------------
+// Read the rest of a saved cache whose header has been checked, and install
+// its blocks. Returns the number installed, or -1 if the file is unusable.
+static int xlat_read_cache(c8_context_t *ctx, FILE *fp,
+        const xlat_disk_header_t *hdr)
+{
+    xlat_cache_t *xc = ctx->xc;
+    xlat_disk_block_t *recs;
+    int32_t ids[XLAT_MAX_HELPERS];
+    long length = (long)(hdr->code_used - hdr->code_base);
+    int i, traces = 0, count = 0;
+
+    if ((size_t)hdr->num_helpers !=
+            fread(ids, sizeof(int32_t), hdr->num_helpers, fp))
+        return -1;
+    for (i = 0; i < hdr->num_helpers; ++i) {
+        xc->helpers[i] = xlat_helper_by_id(ids[i]);
+        xc->helper_ids[i] = ids[i];
+        if (NULL == xc->helpers[i])
+            return -1;
+    }
+    xc->num_helpers = hdr->num_helpers;
+
+    // the stubs come first in the arena, and must end where they did
+    xc->num_pins = hdr->num_pins;
+    memcpy(xc->pins, hdr->pins, sizeof(xc->pins));
+    xc->pins_chosen = hdr->pins_chosen;
+    xlat_emit_stubs(xc);
+    if (xc->code_base != hdr->code_base)
+        return -1;
+
+    if ((size_t)length != fread(xc->code + xc->code_base, 1, length, fp))
+        return -1;
+
+    for (i = 0; i < hdr->num_leaves; ++i) {
+        int dir = hdr->leaves[i];
+        if (dir < 0 || dir >= xc->num_dirs || NULL != xc->map[dir])
+            return -1;
+        xc->map[dir] = &xc->pool[i << XLAT_MAP_SHIFT];
+    }
+    xc->num_leaves = hdr->num_leaves;
+
+    recs = (xlat_disk_block_t *)malloc(
+            hdr->num_blocks * sizeof(xlat_disk_block_t) + 1);
+    if (NULL == recs)
+        return -1;
+    if ((size_t)hdr->num_blocks !=
+            fread(recs, sizeof(xlat_disk_block_t), hdr->num_blocks, fp)) {
+        free(recs);
+        return -1;
+    }
+    for (i = 0; i < hdr->num_blocks; ++i) {
+        traces += recs[i].num_segs > 0;
+        if (!xlat_check_block(xc, hdr, &recs[i]) ||
+                traces > XLAT_MAX_TRACES) {
+            free(recs);
+            return -1;
+        }
+    }
+
+    xc->code_used = (long)hdr->code_used;
+    xlat_flush_icache(xc->code + xc->code_base, length);
+    for (i = 0; i < hdr->num_blocks; ++i)
+        count += xlat_install_block(ctx, &recs[i]);
+    free(recs);
+    return count;
+}
+
+// -----------------------------------------------------------------------------
+// Name the file translations of the program loaded with length bytes are kept
+// in under dir, and load any that were saved there by an earlier run. The
+// cache must be empty. Returns the number of blocks loaded.
+int xlat_load_cache(c8_context_t *ctx, const char *dir, int length)
+{
+    xlat_cache_t *xc = ctx->xc;
+    xlat_disk_header_t hdr;
+    uint64_t hash;
+    size_t size;
+    FILE *fp;
+    int count;
+
+#if defined(ARCH_X86)
+    // 32-bit code addresses the cache absolutely, so it cannot be moved
+    return 0;
+#endif // ARCH_X86
+
+    assert(xc->code_used == xc->code_base && 0 == xc->num_helpers);
+
+    hash = xlat_hash_64(FNV_BASIS_64, (const uint8_t *)XLAT_DISK_BUILD,
+                        sizeof(XLAT_DISK_BUILD));
+    hash = xlat_hash_64(hash, ctx->rom + 0x200, length);
+
+    size = strlen(dir) + 24;
+    free(xc->save_path);
+    xc->save_path = (char *)malloc(size);
+    if (NULL == xc->save_path)
+        return 0;
+    snprintf(xc->save_path, size, "%s/%016llx.xlc", dir,
+             (unsigned long long)hash);
+    xc->save_hash = hash;
+
+    xc->saved_blocks = 0;
+    fp = fopen(xc->save_path, "rb");
+    if (NULL == fp)
+        return 0;
+
+    // a file left by another build is replaced when the cache is saved
+    count = 0;
+    if (1 == fread(&hdr, sizeof(hdr), 1, fp) && xlat_check_header(xc, &hdr, hash)) {
+        xc->saved_blocks = hdr.num_blocks;
+        count = xlat_read_cache(ctx, fp, &hdr);
+    }
+    fclose(fp);
+
+    if (count < 0) {
+        // start over with no blocks and no profile, as after a reset
+        log_err("ignoring unusable xlat cache \"%s\"\n", xc->save_path);
+        xc->num_pins = 0;
+        xc->pins_chosen = 0;
+        xc->num_helpers = 0;
+        xlat_emit_stubs(xc);
+        xlat_flush_cache(xc);
+        count = 0;
+    }
+
+    log_dbg("loaded %d xlat blocks from \"%s\"\n", count, xc->save_path);
+    xc->unsaved = 0;
+    return count;
+}
+
+// -----------------------------------------------------------------------------
+// Return nonzero if another run of the program has saved more blocks than
+// num_blocks since the file was loaded. Saved arenas cannot be merged, so the
+// larger one is kept rather than the last one written.
+static int xlat_saved_elsewhere(const xlat_cache_t *xc, int num_blocks)
+{
+    xlat_disk_header_t hdr;
+    int newer = 0;
+    FILE *fp;
+
+    fp = fopen(xc->save_path, "rb");
+    if (NULL == fp)
+        return 0;
+    if (1 == fread(&hdr, sizeof(hdr), 1, fp) &&
+            xlat_check_header(xc, &hdr, xc->save_hash)) {
+        newer = hdr.num_blocks != xc->saved_blocks &&
+                hdr.num_blocks > num_blocks;
+    }
+    fclose(fp);
+    return newer;
+}
+
+// -----------------------------------------------------------------------------
+// Write every live block to the file named by xlat_load_cache, if any were
+// translated since it was loaded and no other run has saved more since then.
+// Blocks are unlinked first, so this is only done when the cache is about to
+// be discarded.
+void xlat_save_cache(c8_context_t *ctx)
+{
+    xlat_cache_t *xc = ctx->xc;
+    xlat_disk_header_t hdr;
+    xlat_disk_block_t rec;
+    int32_t ids[XLAT_MAX_HELPERS];
+    char *tmp_path;
+    size_t size;
+    FILE *fp;
+    int i, r, ok;
+
+    if (NULL == xc->save_path || !xc->unsaved)
+        return;
+    xc->unsaved = 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = XLAT_DISK_MAGIC;
+    hdr.version = XLAT_DISK_VERSION;
+    strncpy(hdr.build, XLAT_DISK_BUILD, sizeof(hdr.build) - 1);
+    hdr.features = XLAT_DISK_FEATURES;
+    hdr.cache_size = sizeof(xlat_cache_t);
+    hdr.block_size = sizeof(xlat_block_t);
+    hdr.code_size = xc->code_size;
+    hdr.code_base = xc->code_base;
+    hdr.code_used = xc->code_used;
+    hdr.rom_hash = xc->save_hash;
+    hdr.rom_size = xc->addr_mask + 1;
+    hdr.num_pins = xc->num_pins;
+    memcpy(hdr.pins, xc->pins, sizeof(hdr.pins));
+    hdr.pins_chosen = xc->pins_chosen;
+    hdr.num_helpers = xc->num_helpers;
+    hdr.num_leaves = xc->num_leaves;
+    for (i = 0; i < xc->num_dirs; ++i) {
+        if (NULL != xc->map[i])
+            hdr.leaves[(xc->map[i] - xc->pool) >> XLAT_MAP_SHIFT] = i;
+    }
+
+    for (i = 0; i < xc->num_helpers; ++i) {
+        ids[i] = xc->helper_ids[i];
+        if (ids[i] < 0) {
+            log_err("xlat helper %p has no id, not saving cache\n",
+                    xc->helpers[i]);
+            return;
+        }
+    }
+
+    for (r = 0; r < XLAT_RECORDS(xc); ++r)
+        hdr.num_blocks += (NULL != xc->pool[r].block);
+    if (xlat_saved_elsewhere(xc, hdr.num_blocks)) {
+        log_dbg("keeping larger xlat cache \"%s\"\n", xc->save_path);
+        return;
+    }
+
+    // saved code must not jump into blocks that may not be loaded with it
+    for (r = 0; r < XLAT_RECORDS(xc); ++r) {
+        if (NULL != xc->pool[r].block)
+            xlat_unlink_block(&xc->pool[r]);
+    }
+
+    // write to a file of our own and rename it, so that a concurrent run of
+    // the same program never reads a partial cache
+    size = strlen(xc->save_path) + 24;
+    tmp_path = (char *)malloc(size);
+    if (NULL == tmp_path)
+        return;
+    snprintf(tmp_path, size, "%s.%d.tmp", xc->save_path, (int)getpid());
+    fp = fopen(tmp_path, "wb");
+    if (NULL == fp) {
+        log_err("failed to create xlat cache \"%s\"\n", tmp_path);
+        free(tmp_path);
+        return;
+    }
+
+    ok = 1 == fwrite(&hdr, sizeof(hdr), 1, fp);
+    ok = ok && (size_t)hdr.num_helpers ==
+               fwrite(ids, sizeof(int32_t), hdr.num_helpers, fp);
+    ok = ok && (size_t)(xc->code_used - xc->code_base) ==
+               fwrite(xc->code + xc->code_base, 1,
+                      xc->code_used - xc->code_base, fp);
+    for (r = 0; ok && r < XLAT_RECORDS(xc); ++r) {
+        xlat_block_t *xb = &xc->pool[r];
+        if (NULL == xb->block)
+            continue;
+
+        memset(&rec, 0, sizeof(rec));
+        rec.offset = xb->block - xc->code;
+        rec.length = xb->length;
+        rec.num_cycles = xb->num_cycles;
+        rec.pc = xb->pc;
+        rec.size = xb->size;
+        rec.idle = xb->idle;
+        rec.trace = xb->trace;
+        rec.countdown = xb->countdown;
+        rec.num_segs = xb->num_segs;
+        memcpy(rec.segs, xb->segs, sizeof(rec.segs));
+        rec.num_exits = xb->num_exits;
+        for (i = 0; i < xb->num_exits; ++i) {
+            rec.exits[i].site = (int32_t)(xb->exits[i].site - xb->block);
+            rec.exits[i].stub = (int32_t)(xb->exits[i].stub - xb->block);
+            rec.exits[i].target_pc = xb->exits[i].target_pc;
+        }
+        rec.checksum = xlat_hash_block(ctx, xb);
+        ok = 1 == fwrite(&rec, sizeof(rec), 1, fp);
+    }
+    ok = (0 == fclose(fp)) && ok;
+
+#ifdef PLATFORM_WIN32
+    if (ok)
+        remove(xc->save_path);
+#endif // PLATFORM_WIN32
+    if (!ok || 0 != rename(tmp_path, xc->save_path)) {
+        log_err("failed to write xlat cache \"%s\"\n", xc->save_path);
+        remove(tmp_path);
+    }
+    else {
+        log_dbg("saved %d xlat blocks to \"%s\"\n", hdr.num_blocks,
+                xc->save_path);
+        xc->saved_blocks = hdr.num_blocks;
+    }
+    free(tmp_path);
+}
@@ -0,0 +1,254 @@
+// gchip - a simple recompiling chip-8 emulator
+// Copyright (C) 2011  Garrett Smith.
+// 
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+// 
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#include <string.h>
+#include "chip8.h"
+#include "xlat.h"
+
+// most bytes of guest memory a sprite is read from
+#define XLAT_SPRITE_BYTES 32
+
+#define XLAT_ONES  0x0101010101010101ull
+#define XLAT_HIGHS 0x8080808080808080ull
+
+// nonzero if any byte of v is zero
+#define XLAT_HAS_ZERO(v) (((v) - XLAT_ONES) & ~(v) & XLAT_HIGHS)
+
+// Run row(j) once for each of the n rows of a sprite, without a loop. Rows
+// never cover the same pixels, so they may be drawn in any order.
+#define XLAT_DRAW_ROWS(n, row)     \
+    switch (n) {                   \
+    case 16: row(15); FALLTHROUGH; \
+    case 15: row(14); FALLTHROUGH; \
+    case 14: row(13); FALLTHROUGH; \
+    case 13: row(12); FALLTHROUGH; \
+    case 12: row(11); FALLTHROUGH; \
+    case 11: row(10); FALLTHROUGH; \
+    case 10: row(9); FALLTHROUGH;  \
+    case 9:  row(8); FALLTHROUGH;  \
+    case 8:  row(7); FALLTHROUGH;  \
+    case 7:  row(6); FALLTHROUGH;  \
+    case 6:  row(5); FALLTHROUGH;  \
+    case 5:  row(4); FALLTHROUGH;  \
+    case 4:  row(3); FALLTHROUGH;  \
+    case 3:  row(2); FALLTHROUGH;  \
+    case 2:  row(1); FALLTHROUGH;  \
+    case 1:  row(0);               \
+    }
+
+// bit offset of byte b of a row of pixels held in a uint64_t
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define XLAT_LANE(b) (56 - 8 * (b))
+#else
+#define XLAT_LANE(b) (8 * (b))
+#endif
+
+// pixel p of sprite byte d, placed in byte b of a row
+#define XLAT_PIXEL(d, p, b) \
+    ((uint64_t)(((d) >> (7 - (p))) & 1) << XLAT_LANE(b))
+
+// sprite byte d as a byte per pixel
+#define XLAT_NARROW(d)                                             \
+    (XLAT_PIXEL(d, 0, 0) | XLAT_PIXEL(d, 1, 1) | XLAT_PIXEL(d, 2, 2) | \
+     XLAT_PIXEL(d, 3, 3) | XLAT_PIXEL(d, 4, 4) | XLAT_PIXEL(d, 5, 5) | \
+     XLAT_PIXEL(d, 6, 6) | XLAT_PIXEL(d, 7, 7))
+
+// half h of sprite byte d with every pixel doubled
+#define XLAT_DOUBLE(d, p, b) (XLAT_PIXEL(d, p, b) | XLAT_PIXEL(d, p, (b) + 1))
+#define XLAT_HALF(d, h)                                            \
+    (XLAT_DOUBLE(d, 4 * (h), 0) | XLAT_DOUBLE(d, 4 * (h) + 1, 2) |  \
+     XLAT_DOUBLE(d, 4 * (h) + 2, 4) | XLAT_DOUBLE(d, 4 * (h) + 3, 6))
+#define XLAT_WIDE(d) { XLAT_HALF(d, 0), XLAT_HALF(d, 1) }
+
+// entry(d) for every sprite byte d from 0
+#define XLAT_TABLE_4(entry, d) \
+    entry(d), entry((d) + 1), entry((d) + 2), entry((d) + 3)
+#define XLAT_TABLE_16(entry, d)                                    \
+    XLAT_TABLE_4(entry, d), XLAT_TABLE_4(entry, (d) + 4),          \
+    XLAT_TABLE_4(entry, (d) + 8), XLAT_TABLE_4(entry, (d) + 12)
+#define XLAT_TABLE_64(entry, d)                                    \
+    XLAT_TABLE_16(entry, d), XLAT_TABLE_16(entry, (d) + 16),       \
+    XLAT_TABLE_16(entry, (d) + 32), XLAT_TABLE_16(entry, (d) + 48)
+#define XLAT_TABLE_256(entry)                                      \
+    XLAT_TABLE_64(entry, 0), XLAT_TABLE_64(entry, 64),             \
+    XLAT_TABLE_64(entry, 128), XLAT_TABLE_64(entry, 192)
+
+// Sprite drawing for translated code. DRW calls the routine for the system
+// active when its block was translated, which toggles a whole sprite row at
+// a time instead of a pixel at a time. Each routine hands the sprite back to
+// gfx_draw_sprite if the system has changed since, and to the generic drawing
+// code if the sprite wraps around the right edge of the screen or the top of
+// guest memory.
+//
+// The framebuffer holds a byte per pixel. A row is XORed eight bytes at once
+// with its pixels expanded from the sprite byte by the tables below, and
+// collides if one of the bytes it is tested on was cleared. The tables are
+// constant, as translated code in any context may be reading them.
+
+#ifdef HAVE_SCHIP_SUPPORT
+// sprite byte as a byte per pixel
+static const uint64_t xlat_pixels[256] = { XLAT_TABLE_256(XLAT_NARROW) };
+#endif // HAVE_SCHIP_SUPPORT
+
+// the same with every pixel doubled
+static const uint64_t xlat_wide[256][2] = { XLAT_TABLE_256(XLAT_WIDE) };
+
+// the first byte of each pixel pair
+static const uint64_t xlat_even =
+    (1ull << XLAT_LANE(0)) | (1ull << XLAT_LANE(2)) |
+    (1ull << XLAT_LANE(4)) | (1ull << XLAT_LANE(6));
+
+// -----------------------------------------------------------------------------
+// XOR mask into the eight pixels at p. Returns nonzero if a pixel both set in
+// mask and selected by test was cleared.
+static uint64_t xlat_toggle(uint8_t *p, uint64_t mask, uint64_t test)
+{
+    uint64_t pixels;
+
+    memcpy(&pixels, p, 8);
+    pixels ^= mask;
+    memcpy(p, &pixels, 8);
+
+    // only the tested lanes are left able to be zero
+    pixels |= ~((mask & test) * 0xFF);
+    return XLAT_HAS_ZERO(pixels);
+}
+
+// -----------------------------------------------------------------------------
+// Draw an 8xN or 8x16 sprite in CHIP8 mode, where each pixel is 2x2.
+int xlat_draw_chip8(c8_context_t *ctx, int rx, int ry, int n)
+{
+    int x = ctx->v[rx] & 0x3F, y = ctx->v[ry];
+    const uint8_t *data;
+    uint8_t *gfx = &ctx->gfx[x << 1];
+    uint64_t hit = 0;
+
+    if (SYSTEM_CHIP8 != ctx->system)
+        return gfx_draw_sprite(ctx, rx, ry, n);
+
+    ctx->dirty = 1;
+    if (x > CHIP8_XRES - 8 || ctx->i > ctx->rom_size - XLAT_SPRITE_BYTES)
+        return gfx_draw_chip8_sprite(ctx, x, y, n);
+    data = &ctx->rom[ctx->i];
+
+#define XLAT_CHIP8_ROW(j) do {                                     \
+        uint8_t *p = gfx + (((y + j) & 0x1F) << 8);                \
+        const uint64_t *mask = xlat_wide[data[j]];                 \
+        hit |= xlat_toggle(p, mask[0], xlat_even);                 \
+        hit |= xlat_toggle(p + 8, mask[1], xlat_even);             \
+        xlat_toggle(p + SCHIP_XRES, mask[0], 0);                   \
+        xlat_toggle(p + SCHIP_XRES + 8, mask[1], 0);               \
+    } while (0)
+
+    XLAT_DRAW_ROWS(n ? n : 16, XLAT_CHIP8_ROW);
+#undef XLAT_CHIP8_ROW
+    return 0 != hit;
+}
+
+#ifdef HAVE_HCHIP_SUPPORT
+// -----------------------------------------------------------------------------
+// Draw an 8xN or 8x16 sprite in HCHIP mode, where each pixel is 2x1.
+int xlat_draw_hchip(c8_context_t *ctx, int rx, int ry, int n)
+{
+    int x = ctx->v[rx] & 0x3F, y = ctx->v[ry];
+    const uint8_t *data;
+    uint8_t *gfx = &ctx->gfx[x << 1];
+    uint64_t hit = 0;
+
+    if (SYSTEM_HCHIP != ctx->system)
+        return gfx_draw_sprite(ctx, rx, ry, n);
+
+    ctx->dirty = 1;
+    if (x > HCHIP_XRES - 8 || ctx->i > ctx->rom_size - XLAT_SPRITE_BYTES)
+        return gfx_draw_hchip_sprite(ctx, x, y, n);
+    data = &ctx->rom[ctx->i];
+
+#define XLAT_HCHIP_ROW(j) do {                                     \
+        uint8_t *p = gfx + (((y + j) & 0x3F) << 7);                \
+        const uint64_t *mask = xlat_wide[data[j]];                 \
+        hit |= xlat_toggle(p, mask[0], xlat_even);                 \
+        hit |= xlat_toggle(p + 8, mask[1], xlat_even);             \
+    } while (0)
+
+    XLAT_DRAW_ROWS(n ? n : 16, XLAT_HCHIP_ROW);
+#undef XLAT_HCHIP_ROW
+    return 0 != hit;
+}
+#endif // HAVE_HCHIP_SUPPORT
+
+#ifdef HAVE_SCHIP_SUPPORT
+// -----------------------------------------------------------------------------
+// Draw an 8xN or 16x16 sprite in SCHIP mode.
+int xlat_draw_schip(c8_context_t *ctx, int rx, int ry, int n)
+{
+    int x = ctx->v[rx] & 0x7F, y = ctx->v[ry];
+    const uint8_t *data;
+    uint8_t *gfx = &ctx->gfx[x];
+    uint64_t hit = 0;
+
+    if (SYSTEM_SCHIP != ctx->system)
+        return gfx_draw_sprite(ctx, rx, ry, n);
+
+    ctx->dirty = 1;
+    if (x > SCHIP_XRES - (n ? 8 : 16) ||
+            ctx->i > ctx->rom_size - XLAT_SPRITE_BYTES)
+        return gfx_draw_schip_sprite(ctx, x, y, n);
+    data = &ctx->rom[ctx->i];
+
+#define XLAT_SCHIP_ROW(j)                                          \
+        hit |= xlat_toggle(gfx + (((y + j) & 0x3F) << 7),          \
+                           xlat_pixels[data[j]], ~0ull)
+
+#define XLAT_SCHIP_WIDE_ROW(j) do {                                \
+        uint8_t *p = gfx + (((y + j) & 0x3F) << 7);                \
+        hit |= xlat_toggle(p, xlat_pixels[data[2 * j]], ~0ull);    \
+        hit |= xlat_toggle(p + 8, xlat_pixels[data[2 * j + 1]],    \
+                           ~0ull);                                 \
+    } while (0)
+
+    if (n > 0) {
+        XLAT_DRAW_ROWS(n, XLAT_SCHIP_ROW);
+    }
+    else {
+        XLAT_DRAW_ROWS(16, XLAT_SCHIP_WIDE_ROW);
+    }
+#undef XLAT_SCHIP_ROW
+#undef XLAT_SCHIP_WIDE_ROW
+    return 0 != hit;
+}
+#endif // HAVE_SCHIP_SUPPORT
+
+// -----------------------------------------------------------------------------
+// Select the sprite routine for the given system. MegaChip sprites are drawn
+// from the palette and keep the generic routine.
+void *xlat_draw_routine(int system)
+{
+    switch (system) {
+    case SYSTEM_CHIP8:
+        return (void *)xlat_draw_chip8;
+#ifdef HAVE_HCHIP_SUPPORT
+    case SYSTEM_HCHIP:
+        return (void *)xlat_draw_hchip;
+#endif
+#ifdef HAVE_SCHIP_SUPPORT
+    case SYSTEM_SCHIP:
+        return (void *)xlat_draw_schip;
+#endif
+    default:
+        return (void *)gfx_draw_sprite;
+    }
+}
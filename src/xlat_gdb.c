@@ -0,0 +1,256 @@
+// gchip - a simple recompiling chip-8 emulator
+// Copyright (C) 2011  Garrett Smith.
+// 
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+// 
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#include <stdlib.h>
+#include <string.h>
+#include "chip8.h"
+#include "xlat.h"
+
+// Registration of translated code with gdb through its JIT interface. gdb
+// sets a breakpoint in __jit_debug_register_code and, whenever it is called,
+// reads the object file described by __jit_debug_descriptor. Each block is
+// described by a small in-memory ELF relocatable holding a single function
+// symbol, named after the guest code, over a .text section placed at the
+// block's host address. Nothing else is described, so gdb can name the
+// block a crash happened in but not unwind through it.
+//
+// The interface is process wide, while blocks belong to a cache, so every
+// entry is removed again before its code is dropped or its cache destroyed.
+// Only one context at a time should have the interface enabled, since the
+// list of entries is not locked.
+
+// -----------------------------------------------------------------------------
+// The names and layout of these are fixed by gdb.
+
+enum { JIT_NOACTION, JIT_REGISTER_FN, JIT_UNREGISTER_FN };
+
+struct jit_code_entry {
+    struct jit_code_entry *next_entry;
+    struct jit_code_entry *prev_entry;
+    const char *symfile_addr;
+    uint64_t symfile_size;
+};
+
+struct jit_descriptor {
+    uint32_t version;
+    uint32_t action_flag;
+    struct jit_code_entry *relevant_entry;
+    struct jit_code_entry *first_entry;
+};
+
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void __jit_debug_register_code(void);
+
+struct jit_descriptor __jit_debug_descriptor = { 1, JIT_NOACTION, NULL, NULL };
+
+// -----------------------------------------------------------------------------
+void __jit_debug_register_code(void)
+{
+#if defined(__GNUC__)
+    // keep calls to the empty function from being optimized away
+    __asm__ __volatile__("");
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// The parts of ELF needed for a symbol file, in the host's word size.
+
+#if defined(ARCH_X86)
+#define XLAT_ELF_CLASS   1          // ELFCLASS32
+#define XLAT_ELF_MACHINE 3          // EM_386
+typedef uint32_t xlat_elf_addr_t;
+#elif defined(ARCH_ARM64)
+#define XLAT_ELF_CLASS   2          // ELFCLASS64
+#define XLAT_ELF_MACHINE 183        // EM_AARCH64
+typedef uint64_t xlat_elf_addr_t;
+#else
+#define XLAT_ELF_CLASS   2
+#define XLAT_ELF_MACHINE 62         // EM_X86_64
+typedef uint64_t xlat_elf_addr_t;
+#endif
+
+typedef struct xlat_elf_header {
+    uint8_t ident[16];
+    uint16_t type, machine;
+    uint32_t version;
+    xlat_elf_addr_t entry, phoff, shoff;
+    uint32_t flags;
+    uint16_t ehsize, phentsize, phnum, shentsize, shnum, shstrndx;
+} xlat_elf_header_t;
+
+typedef struct xlat_elf_section {
+    uint32_t name, type;
+    xlat_elf_addr_t flags, addr, offset, size;
+    uint32_t link, info;
+    xlat_elf_addr_t addralign, entsize;
+} xlat_elf_section_t;
+
+typedef struct xlat_elf_symbol {
+#if XLAT_ELF_CLASS == 1
+    uint32_t name, value, size;
+    uint8_t info, other;
+    uint16_t shndx;
+#else
+    uint32_t name;
+    uint8_t info, other;
+    uint16_t shndx;
+    uint64_t value, size;
+#endif
+} xlat_elf_symbol_t;
+
+enum { SECT_NULL, SECT_TEXT, SECT_SYMTAB, SECT_STRTAB, SECT_SHSTRTAB, SECTS };
+
+#define XLAT_ELF_NAMES "\0.text\0.symtab\0.strtab\0.shstrtab"
+
+// the symbol file for one block, with the entry that registers it
+typedef struct xlat_gdb_entry {
+    struct jit_code_entry entry;
+    xlat_elf_header_t header;
+    xlat_elf_section_t sections[SECTS];
+    xlat_elf_symbol_t symbols[2];
+    char shstrtab[sizeof(XLAT_ELF_NAMES)];
+    char strtab[48];
+} xlat_gdb_entry_t;
+
+#define XLAT_ELF_OFFSET(field) \
+    (offsetof(xlat_gdb_entry_t, field) - offsetof(xlat_gdb_entry_t, header))
+
+// -----------------------------------------------------------------------------
+// Fill in the symbol file naming the code of xb.
+static void xlat_gdb_describe(xlat_gdb_entry_t *ge, const xlat_block_t *xb)
+{
+    xlat_elf_header_t *eh = &ge->header;
+    xlat_elf_section_t *sh = ge->sections;
+    xlat_elf_symbol_t *sym = &ge->symbols[1];
+
+    memcpy(eh->ident, "\177ELF", 4);
+    eh->ident[4] = XLAT_ELF_CLASS;
+    eh->ident[5] = 1;                       // little endian
+    eh->ident[6] = 1;                       // current version
+    eh->type = 1;                           // relocatable
+    eh->machine = XLAT_ELF_MACHINE;
+    eh->version = 1;
+    eh->shoff = XLAT_ELF_OFFSET(sections);
+    eh->ehsize = sizeof(xlat_elf_header_t);
+    eh->shentsize = sizeof(xlat_elf_section_t);
+    eh->shnum = SECTS;
+    eh->shstrndx = SECT_SHSTRTAB;
+
+    memcpy(ge->shstrtab, XLAT_ELF_NAMES, sizeof(XLAT_ELF_NAMES));
+    ge->strtab[0] = '\0';
+    xlat_name_block(xb, ge->strtab + 1, sizeof(ge->strtab) - 1);
+
+    // the code is not copied, the section just claims its address
+    sh[SECT_TEXT].name = 1;
+    sh[SECT_TEXT].type = 8;                 // SHT_NOBITS
+    sh[SECT_TEXT].flags = 0x6;              // SHF_ALLOC | SHF_EXECINSTR
+    sh[SECT_TEXT].addr = (xlat_elf_addr_t)(size_t)xb->block;
+    sh[SECT_TEXT].size = xb->length;
+    sh[SECT_TEXT].addralign = 1;
+
+    sh[SECT_SYMTAB].name = 7;
+    sh[SECT_SYMTAB].type = 2;               // SHT_SYMTAB
+    sh[SECT_SYMTAB].offset = XLAT_ELF_OFFSET(symbols);
+    sh[SECT_SYMTAB].size = sizeof(ge->symbols);
+    sh[SECT_SYMTAB].link = SECT_STRTAB;
+    sh[SECT_SYMTAB].info = 1;               // first global symbol
+    sh[SECT_SYMTAB].addralign = sizeof(xlat_elf_addr_t);
+    sh[SECT_SYMTAB].entsize = sizeof(xlat_elf_symbol_t);
+
+    sh[SECT_STRTAB].name = 15;
+    sh[SECT_STRTAB].type = 3;               // SHT_STRTAB
+    sh[SECT_STRTAB].offset = XLAT_ELF_OFFSET(strtab);
+    sh[SECT_STRTAB].size = sizeof(ge->strtab);
+    sh[SECT_STRTAB].addralign = 1;
+
+    sh[SECT_SHSTRTAB].name = 23;
+    sh[SECT_SHSTRTAB].type = 3;
+    sh[SECT_SHSTRTAB].offset = XLAT_ELF_OFFSET(shstrtab);
+    sh[SECT_SHSTRTAB].size = sizeof(ge->shstrtab);
+    sh[SECT_SHSTRTAB].addralign = 1;
+
+    // a global function at the start of .text covering the whole block
+    sym->name = 1;
+    sym->info = 0x12;                       // STB_GLOBAL, STT_FUNC
+    sym->shndx = SECT_TEXT;
+    sym->value = 0;
+    sym->size = xb->length;
+
+    ge->entry.symfile_addr = (const char *)eh;
+    ge->entry.symfile_size = XLAT_ELF_OFFSET(strtab) + sizeof(ge->strtab);
+}
+
+// -----------------------------------------------------------------------------
+// Describe a newly committed block to gdb.
+void xlat_gdb_add_block(xlat_block_t *xb)
+{
+    struct jit_descriptor *jd = &__jit_debug_descriptor;
+    xlat_gdb_entry_t *ge;
+
+    ge = (xlat_gdb_entry_t *)calloc(1, sizeof(xlat_gdb_entry_t));
+    if (NULL == ge) {
+        log_err("failed to register xlat block @PC=%04X with gdb\n", xb->pc);
+        return;
+    }
+    xlat_gdb_describe(ge, xb);
+
+    ge->entry.next_entry = jd->first_entry;
+    if (NULL != jd->first_entry)
+        jd->first_entry->prev_entry = &ge->entry;
+    jd->first_entry = &ge->entry;
+
+    jd->relevant_entry = &ge->entry;
+    jd->action_flag = JIT_REGISTER_FN;
+    __jit_debug_register_code();
+    xb->debug = ge;
+}
+
+// -----------------------------------------------------------------------------
+// Withdraw the description of a block that is about to be dropped.
+void xlat_gdb_remove_block(xlat_block_t *xb)
+{
+    struct jit_descriptor *jd = &__jit_debug_descriptor;
+    xlat_gdb_entry_t *ge = xb->debug;
+
+    if (NULL == ge)
+        return;
+
+    if (NULL != ge->entry.prev_entry)
+        ge->entry.prev_entry->next_entry = ge->entry.next_entry;
+    else
+        jd->first_entry = ge->entry.next_entry;
+    if (NULL != ge->entry.next_entry)
+        ge->entry.next_entry->prev_entry = ge->entry.prev_entry;
+
+    jd->relevant_entry = &ge->entry;
+    jd->action_flag = JIT_UNREGISTER_FN;
+    __jit_debug_register_code();
+
+    free(ge);
+    xb->debug = NULL;
+}
+
+// -----------------------------------------------------------------------------
+// Withdraw every block in the cache, before it is flushed or destroyed.
+void xlat_gdb_remove_all(xlat_cache_t *xc)
+{
+    int r;
+    for (r = 0; r < XLAT_RECORDS(xc); ++r)
+        xlat_gdb_remove_block(&xc->pool[r]);
+}
@@ -0,0 +1,749 @@
+// gchip - a simple recompiling chip-8 emulator
+// Copyright (C) 2011  Garrett Smith.
+// 
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+// 
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#include "chip8.h"
+#include "xlat.h"
+
+#define IR_X(op) (((op) >> 8) & 0xF)
+#define IR_Y(op) (((op) >> 4) & 0xF)
+#define IR_B(op) ((op) & 0xFF)
+#define IR_T(op) ((op) & 0xFFF)
+
+// build 6xkk, which every folded result is expressed as
+#define IR_MOV(x, b) (0x6000 | ((x) << 8) | ((b) & 0xFF))
+
+#define IR_VF (1u << 0xF)
+#define IR_I  (1u << R_I)
+
+// what is known about the guest registers at some point in a block
+typedef struct xlat_values {
+    int v[16];          // value held by each V register, or -1
+    int i;              // value held by I, or -1
+    int copy[16];       // another V register holding the same value, or -1
+} xlat_values_t;
+
+// -----------------------------------------------------------------------------
+// Return nonzero if the instruction conditionally skips the one after it.
+static int xlat_is_skip(int opcode)
+{
+    switch (opcode & 0xF000) {
+    case 0x3000: case 0x4000: case 0x5000: case 0x9000:
+        return 1;
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Return nonzero if the instruction always leaves the block.
+static int xlat_is_branch(int opcode)
+{
+    switch (opcode & 0xF000) {
+    case 0x1000: case 0x2000: case 0xB000:
+        return 1;
+    }
+    return 0x00EE == opcode;
+}
+
+// -----------------------------------------------------------------------------
+// Return the address of the instruction following the one at pc.
+static int xlat_next_pc(const c8_context_t *ctx, int opcode, int pc)
+{
+#ifdef HAVE_MCHIP_SUPPORT
+    // MegaChip LDHI carries its operand in the following two bytes
+    if (0x0100 == (opcode & 0xFF00))
+        return (pc + 4) & ROM_MASK(ctx);
+#endif
+    return (pc + 2) & ROM_MASK(ctx);
+}
+
+// -----------------------------------------------------------------------------
+// Decode the block starting at pc into ir. Decoding stops after a branch, after
+// a skip that has to leave the block, or once max instructions are decoded,
+// although an instruction that may be skipped is always kept with its skip.
+// Returns the number of instructions decoded, which is at most max + 1.
+int xlat_decode_block(const c8_context_t *ctx, int pc, xlat_ir_t *ir, int max)
+{
+    int count = 0, shadow = 0;
+
+    for (;;) {
+        int opcode = (ctx->rom[pc] << 8) | ctx->rom[(pc + 1) & ROM_MASK(ctx)];
+        xlat_ir_t *e = &ir[count++];
+
+        e->pc = pc;
+        e->op[0] = opcode;
+        e->num_ops = 1;
+        e->flags = shadow ? XLAT_IR_SHADOW : 0;
+        e->kill = -1;
+        pc = xlat_next_pc(ctx, opcode, pc);
+
+        if (shadow) {
+            // a skipped branch only ends the block when it is taken
+            shadow = 0;
+        }
+        else if (xlat_is_skip(opcode)) {
+            // see xlat_can_skip_inline for what may be skipped within a block
+            int next = (ctx->rom[pc] << 8) | ctx->rom[(pc + 1) & ROM_MASK(ctx)];
+            if (xlat_is_skip(next) || 0xE000 == (next & 0xF000) ||
+                    0x0100 == (next & 0xFF00))
+                break;
+            shadow = 1;
+            continue;
+        }
+        else if (xlat_is_branch(opcode)) {
+            break;
+        }
+
+        if (count >= max)
+            break;
+    }
+
+    return count;
+}
+
+// -----------------------------------------------------------------------------
+// Return the successor of a skip at pc that the profile of the block starting
+// at head favors, or -1 if that block did not end in the skip or neither side
+// clearly dominates. Both sides are exits of such a block.
+static int xlat_likely_side(const xlat_cache_t *xc, int head, int pc)
+{
+    const xlat_block_t *xb = xlat_lookup_block(xc, head);
+    int next = (pc + 2) & xc->addr_mask, skip = (pc + 4) & xc->addr_mask;
+    long n_next = -1, n_skip = -1;
+    int i;
+
+    if (NULL == xb || NULL == xb->block || xb->trace)
+        return -1;
+
+    for (i = 0; i < xb->num_exits; ++i) {
+        if (xb->exits[i].target_pc == next)
+            n_next = xb->exits[i].taken;
+        else if (xb->exits[i].target_pc == skip)
+            n_skip = xb->exits[i].taken;
+    }
+
+    if (n_next < 0 || n_skip < 0)
+        return -1;
+    if (n_next > 3 * n_skip)
+        return next;
+    if (n_skip > 3 * n_next)
+        return skip;
+    return -1;
+}
+
+// -----------------------------------------------------------------------------
+// Return nonzero if the instruction at pc is already part of the trace.
+static int xlat_in_trace(const xlat_ir_t *ir, int count, int pc)
+{
+    int n;
+    for (n = 0; n < count; ++n)
+        if (ir[n].pc == pc)
+            return 1;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Flag the followed calls in ir whose return is not also followed. They still
+// push a prediction for the 00EE that eventually leaves through an exit.
+static void xlat_mark_returns(xlat_ir_t *ir, int count)
+{
+    int calls[XLAT_MAX_SEGS];   // followed calls that have not yet returned
+    int depth = 0, n;
+
+    for (n = 0; n < count; ++n) {
+        ir[n].flags &= ~XLAT_IR_RAS;
+        if (!(ir[n].flags & XLAT_IR_FOLLOW))
+            continue;
+        if (0x2000 == (ir[n].op[0] & 0xF000))
+            calls[depth++] = n;
+        else if (0x00EE == ir[n].op[0])
+            --depth;
+    }
+
+    for (n = 0; n < depth; ++n)
+        ir[calls[n]].flags |= XLAT_IR_RAS;
+}
+
+// -----------------------------------------------------------------------------
+// Decode a trace starting at pc into ir. This is a block that continues
+// through unconditional jumps, into calls and back out of their returns, and
+// past skips that would otherwise end it along the side the profile favors.
+// A skip followed this way leaves through a side exit when it goes the other
+// way. Code already in the trace is not entered again, so loops end in an
+// exit. Returns the number of instructions decoded, which is at most max + 1.
+int xlat_decode_trace(const c8_context_t *ctx, int pc, xlat_ir_t *ir, int max)
+{
+    int calls[XLAT_MAX_SEGS];   // followed calls that have not yet returned
+    int count = 0, shadow = 0, segs = 1, depth = 0, head = pc;
+
+    for (;;) {
+        int opcode = (ctx->rom[pc] << 8) | ctx->rom[(pc + 1) & ROM_MASK(ctx)];
+        xlat_ir_t *e = &ir[count++];
+        int target = -1, flags = XLAT_IR_FOLLOW;
+
+        e->pc = pc;
+        e->op[0] = opcode;
+        e->num_ops = 1;
+        e->flags = shadow ? XLAT_IR_SHADOW : 0;
+        e->kill = -1;
+        pc = xlat_next_pc(ctx, opcode, pc);
+
+        if (shadow) {
+            // a skipped branch only ends the block when it is taken
+            shadow = 0;
+        }
+        else if (xlat_is_skip(opcode)) {
+            int next = (ctx->rom[pc] << 8) | ctx->rom[(pc + 1) & ROM_MASK(ctx)];
+            if (!xlat_is_skip(next) && 0xE000 != (next & 0xF000) &&
+                    0x0100 != (next & 0xFF00)) {
+                shadow = 1;
+                continue;
+            }
+            target = xlat_likely_side(ctx->xc, head, e->pc);
+            if (target < 0)
+                break;
+            flags = XLAT_IR_EXIT | (target != pc ? XLAT_IR_TAKEN : 0);
+        }
+        else if (0x1000 == (opcode & 0xF000) || 0x2000 == (opcode & 0xF000)) {
+            target = IR_T(opcode);
+        }
+        else if (0x00EE == opcode && depth > 0) {
+            target = (ir[calls[depth - 1]].pc + 2) & ROM_MASK(ctx);
+        }
+        else if (xlat_is_branch(opcode)) {
+            break;
+        }
+
+        if (target >= 0) {
+            // a followed branch starts another run of guest code
+            int jump = !(flags & XLAT_IR_EXIT);
+            if (count >= max || xlat_in_trace(ir, count, target) ||
+                    (jump && segs == XLAT_MAX_SEGS))
+                break;
+
+            e->flags |= flags;
+            if (0x2000 == (opcode & 0xF000))
+                calls[depth++] = count - 1;
+            else if (0x00EE == opcode)
+                --depth;
+            if (jump)
+                ++segs;
+
+            // the code at the target was last run as a block of its own
+            head = target;
+            pc = target;
+            continue;
+        }
+
+        if (count >= max)
+            break;
+    }
+
+    xlat_mark_returns(ir, count);
+    return count;
+}
+
+// -----------------------------------------------------------------------------
+// Cut a block decoded by xlat_decode_block or xlat_decode_trace back to what
+// decoding it again with the given max would produce, without looking at the
+// guest memory or profile again. Returns the new number of instructions.
+int xlat_trim_block(xlat_ir_t *ir, int count, int max)
+{
+    if (max >= count)
+        return count;
+
+    // an instruction that may be skipped is kept with its skip, otherwise
+    // the last instruction is no longer followed anywhere
+    if (ir[max].flags & XLAT_IR_SHADOW)
+        ++max;
+    else
+        ir[max - 1].flags &= ~(XLAT_IR_FOLLOW | XLAT_IR_EXIT | XLAT_IR_TAKEN);
+
+    xlat_mark_returns(ir, max);
+    return max;
+}
+
+// operands named by xlat_guest_ops, resolved against the opcode
+#define IR_USE_X    0x001   // Vx
+#define IR_USE_Y    0x002   // Vy
+#define IR_USE_VF   0x004   // VF
+#define IR_USE_V0   0x008   // V0
+#define IR_USE_V0X  0x010   // V0 through Vx
+#define IR_USE_I    0x020   // I
+#define IR_USE_SP   0x040   // the stack pointer
+#define IR_USE_DT   0x080   // the delay timer
+#define IR_USE_ST   0x100   // the sound timer
+
+// what each instruction does with the guest registers. The first entry that
+// matches an opcode describes it, and opcodes that match none are handed to
+// the interpreter, so they are barriers
+static const struct xlat_guest_op {
+    uint16_t mask, match;   // (opcode & mask) == match
+    uint16_t reads, writes; // IR_USE_* operands
+    int flags;              // XLAT_GUEST_* flags
+} xlat_guest_ops[] = {
+    { 0xFFFF, 0x00EE, IR_USE_SP, IR_USE_SP, XLAT_GUEST_BARRIER },
+#ifdef HAVE_SCHIP_SUPPORT
+    // scrolling is a direct call that only looks at the display
+    { 0xFFFF, 0x00FB, 0, 0, 0 },
+    { 0xFFFF, 0x00FC, 0, 0, 0 },
+    { 0xFFF0, 0x00C0, 0, 0, 0 },
+#endif // HAVE_SCHIP_SUPPORT
+    { 0xF000, 0x1000, 0, 0, XLAT_GUEST_BARRIER },
+    { 0xF000, 0x2000, IR_USE_SP, IR_USE_SP, XLAT_GUEST_BARRIER },
+    { 0xF000, 0x3000, IR_USE_X, 0, XLAT_GUEST_SKIP },
+    { 0xF000, 0x4000, IR_USE_X, 0, XLAT_GUEST_SKIP },
+    { 0xF000, 0x5000, IR_USE_X | IR_USE_Y, 0, XLAT_GUEST_SKIP },
+    { 0xF000, 0x6000, 0, IR_USE_X, XLAT_GUEST_PURE },
+    { 0xF000, 0x7000, IR_USE_X, IR_USE_X, XLAT_GUEST_PURE },
+    { 0xF00F, 0x8000, IR_USE_Y, IR_USE_X, XLAT_GUEST_PURE },
+    { 0xF00F, 0x8001, IR_USE_X | IR_USE_Y, IR_USE_X, XLAT_GUEST_PURE },
+    { 0xF00F, 0x8002, IR_USE_X | IR_USE_Y, IR_USE_X, XLAT_GUEST_PURE },
+    { 0xF00F, 0x8003, IR_USE_X | IR_USE_Y, IR_USE_X, XLAT_GUEST_PURE },
+    { 0xF00F, 0x8004, IR_USE_X | IR_USE_Y, IR_USE_X | IR_USE_VF,
+      XLAT_GUEST_PURE },
+    { 0xF00F, 0x8005, IR_USE_X | IR_USE_Y, IR_USE_X | IR_USE_VF,
+      XLAT_GUEST_PURE | XLAT_GUEST_VF_FIRST },
+    { 0xF00F, 0x8006, IR_USE_X, IR_USE_X | IR_USE_VF,
+      XLAT_GUEST_PURE | XLAT_GUEST_VF_FIRST },
+    { 0xF00F, 0x8007, IR_USE_X | IR_USE_Y, IR_USE_X | IR_USE_VF,
+      XLAT_GUEST_PURE | XLAT_GUEST_VF_FIRST },
+    { 0xF00F, 0x800E, IR_USE_X, IR_USE_X | IR_USE_VF,
+      XLAT_GUEST_PURE | XLAT_GUEST_VF_FIRST },
+    { 0xF000, 0x9000, IR_USE_X | IR_USE_Y, 0, XLAT_GUEST_SKIP },
+    { 0xF000, 0xA000, 0, IR_USE_I, XLAT_GUEST_PURE },
+    { 0xF000, 0xB000, IR_USE_V0, 0, XLAT_GUEST_BARRIER },
+    // the random number generator is not registers, but it is state
+    { 0xF000, 0xC000, 0, IR_USE_X, 0 },
+    { 0xF000, 0xD000, IR_USE_X | IR_USE_Y | IR_USE_I, IR_USE_VF, 0 },
+    { 0xF0FF, 0xF007, IR_USE_DT, IR_USE_X, XLAT_GUEST_PURE },
+    { 0xF0FF, 0xF015, IR_USE_X, IR_USE_DT, 0 },
+    { 0xF0FF, 0xF018, IR_USE_X, IR_USE_ST, 0 },
+    { 0xF0FF, 0xF01E, IR_USE_X | IR_USE_I, IR_USE_VF | IR_USE_I,
+      XLAT_GUEST_PURE },
+    { 0xF0FF, 0xF033, IR_USE_X | IR_USE_I, 0, XLAT_GUEST_CALL },
+    { 0xF0FF, 0xF055, IR_USE_V0X | IR_USE_I, 0, XLAT_GUEST_CALL },
+};
+
+// -----------------------------------------------------------------------------
+// Resolve IR_USE_* operands of the opcode to a set of guest registers.
+static uint32_t xlat_guest_operands(int opcode, int use)
+{
+    uint32_t x = 1u << IR_X(opcode), regs = 0;
+
+    if (use & IR_USE_X)
+        regs |= x;
+    if (use & IR_USE_Y)
+        regs |= 1u << IR_Y(opcode);
+    if (use & IR_USE_VF)
+        regs |= IR_VF;
+    if (use & IR_USE_V0)
+        regs |= 1u << 0;
+    if (use & IR_USE_V0X)
+        regs |= (x << 1) - 1;
+    if (use & IR_USE_I)
+        regs |= IR_I;
+    if (use & IR_USE_SP)
+        regs |= 1u << R_SP;
+    if (use & IR_USE_DT)
+        regs |= 1u << R_DT;
+    if (use & IR_USE_ST)
+        regs |= 1u << R_ST;
+    return regs;
+}
+
+// -----------------------------------------------------------------------------
+// Look the instruction up in xlat_guest_ops, setting the guest registers it
+// reads and those it always writes. Returns its XLAT_GUEST_* flags.
+int xlat_guest_regs(int opcode, uint32_t *reads, uint32_t *writes)
+{
+    const struct xlat_guest_op *g;
+    int n = sizeof(xlat_guest_ops) / sizeof(xlat_guest_ops[0]);
+
+    for (g = xlat_guest_ops; g < xlat_guest_ops + n; ++g) {
+        if ((opcode & g->mask) == g->match) {
+            *reads = xlat_guest_operands(opcode, g->reads);
+            *writes = xlat_guest_operands(opcode, g->writes);
+            return g->flags;
+        }
+    }
+
+    *reads = *writes = 0;
+    return XLAT_GUEST_BARRIER;
+}
+
+// -----------------------------------------------------------------------------
+// Determine the registers among V0-VF and I that the instruction reads and
+// always writes. Instructions that may leave the block, including any handed
+// to the interpreter, read and write every register. Returns nonzero if the
+// writes are the only effect, so that the instruction may be dropped once
+// every register it writes is overwritten.
+static int xlat_guest_effects(int opcode, uint32_t *reads, uint32_t *writes)
+{
+    int flags = xlat_guest_regs(opcode, reads, writes);
+
+    // VF is set before the operands are read, so an instruction that takes
+    // VF as an operand does not compute what its reads would suggest
+    if ((flags & (XLAT_GUEST_BARRIER | XLAT_GUEST_CALL)) ||
+        ((flags & XLAT_GUEST_VF_FIRST) && (*reads & IR_VF))) {
+        *reads = *writes = ~0u;
+        return 0;
+    }
+
+    *reads &= 0xFFFF | IR_I;
+    *writes &= 0xFFFF | IR_I;
+    return (flags & XLAT_GUEST_PURE) != 0;
+}
+
+// -----------------------------------------------------------------------------
+// Return the oldest register known to hold the same value as V[reg].
+static int xlat_copy_root(const xlat_values_t *k, int reg)
+{
+    return (k->copy[reg] >= 0) ? k->copy[reg] : reg;
+}
+
+// -----------------------------------------------------------------------------
+// Forget what is known about the registers in mask.
+static void xlat_forget_values(xlat_values_t *k, uint32_t mask)
+{
+    int r, z;
+
+    for (r = 0; r < 16; ++r) {
+        if (!(mask & (1u << r)))
+            continue;
+        k->v[r] = -1;
+        k->copy[r] = -1;
+        for (z = 0; z < 16; ++z)
+            if (k->copy[z] == r)
+                k->copy[z] = -1;
+    }
+
+    if (mask & IR_I)
+        k->i = -1;
+}
+
+// -----------------------------------------------------------------------------
+// Update what is known about the registers to follow the effect of opcode.
+static void xlat_apply_values(xlat_values_t *k, int opcode)
+{
+    int x = IR_X(opcode), y = IR_Y(opcode);
+    uint32_t reads, writes;
+
+    if (0x6000 == (opcode & 0xF000)) {
+        xlat_forget_values(k, 1u << x);
+        k->v[x] = IR_B(opcode);
+    }
+    else if (0x8000 == (opcode & 0xF00F) && x != y) {
+        int value = k->v[y], root = xlat_copy_root(k, y);
+        xlat_forget_values(k, 1u << x);
+        k->v[x] = value;
+        if (root != x)
+            k->copy[x] = root;
+    }
+    else if (0xA000 == (opcode & 0xF000)) {
+        k->i = IR_T(opcode);
+    }
+    else {
+        xlat_guest_effects(opcode, &reads, &writes);
+        xlat_forget_values(k, writes);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Fold an 8xyN instruction, see xlat_fold. The results are ordered as the
+// interpreter assigns them, which matters when Vx is VF. Instructions that set
+// VF first and then compute Vx from VF are left to the interpreter.
+static int xlat_fold_alu(const xlat_values_t *k, int opcode, uint16_t *op)
+{
+    int x = IR_X(opcode), y = IR_Y(opcode), vx = k->v[x], vy = k->v[y];
+    int known = (vx >= 0 && vy >= 0);
+
+    switch (opcode & 0xF) {
+    case 0x5: case 0x7:
+        if (0xF == y)
+            known = 0;
+        // fall through
+    case 0x6: case 0xE:
+        if (0xF == x) {
+            known = 0;
+            vx = -1;
+        }
+        break;
+    }
+    int same = (xlat_copy_root(k, x) == xlat_copy_root(k, y)) ||
+               (known && vx == vy);
+
+    switch (opcode & 0xF) {
+    case 0x0:
+        if (same)
+            return 0;
+        if (vy >= 0) {
+            op[0] = IR_MOV(x, vy);
+            return 1;
+        }
+        break;
+    case 0x1:
+        if (same)
+            return 0;
+        if (known) {
+            op[0] = IR_MOV(x, vx | vy);
+            return 1;
+        }
+        break;
+    case 0x2:
+        if (same)
+            return 0;
+        if (known) {
+            op[0] = IR_MOV(x, vx & vy);
+            return 1;
+        }
+        break;
+    case 0x3:
+        if (same || known) {
+            op[0] = IR_MOV(x, same ? 0 : vx ^ vy);
+            return 1;
+        }
+        break;
+    case 0x4:
+        if (known) {
+            op[0] = IR_MOV(x, vx + vy);
+            op[1] = IR_MOV(0xF, (vx + vy) > 0xFF);
+            return 2;
+        }
+        break;
+    case 0x5:
+        if (known) {
+            op[0] = IR_MOV(0xF, vx >= vy);
+            op[1] = IR_MOV(x, vx - vy);
+            return 2;
+        }
+        break;
+    case 0x6:
+        if (vx >= 0) {
+            op[0] = IR_MOV(0xF, vx & 1);
+            op[1] = IR_MOV(x, vx >> 1);
+            return 2;
+        }
+        break;
+    case 0x7:
+        if (known) {
+            op[0] = IR_MOV(0xF, vy >= vx);
+            op[1] = IR_MOV(x, vy - vx);
+            return 2;
+        }
+        break;
+    case 0xE:
+        if (vx >= 0) {
+            op[0] = IR_MOV(0xF, vx >> 7);
+            op[1] = IR_MOV(x, vx << 1);
+            return 2;
+        }
+        break;
+    }
+
+    op[0] = opcode;
+    return 1;
+}
+
+// -----------------------------------------------------------------------------
+// Rewrite opcode using what is known about the registers before it, storing
+// the equivalent opcodes in op. Registers that are only read are renamed to
+// the oldest copy of their value, and instructions whose inputs are constant
+// are folded. Returns the number of opcodes stored, which may be zero.
+static int xlat_fold(const xlat_values_t *k, int opcode, uint16_t *op)
+{
+    int x = IR_X(opcode), y = IR_Y(opcode), vx, vy, base;
+
+    switch (opcode & 0xF000) {
+    case 0x3000: case 0x4000:
+        x = xlat_copy_root(k, x);
+        break;
+    case 0x5000: case 0x9000: case 0xD000:
+        x = xlat_copy_root(k, x);
+        y = xlat_copy_root(k, y);
+        break;
+    case 0x8000:
+        // the interpreter reads Vy after setting VF in 8xy5 and 8xy7, so VF
+        // may neither be renamed nor take the place of another register
+        switch (opcode & 0xF) {
+        case 0x5: case 0x7:
+            if (0xF == y || 0xF == xlat_copy_root(k, y))
+                break;
+            // fall through
+        case 0x0: case 0x1: case 0x2: case 0x3: case 0x4:
+            y = xlat_copy_root(k, y);
+            break;
+        }
+        break;
+    case 0xF000:
+        switch (opcode & 0xFF) {
+        case 0x15: case 0x18: case 0x1E: case 0x29: case 0x30: case 0x33:
+            x = xlat_copy_root(k, x);
+            break;
+        }
+        break;
+    }
+
+    opcode = (opcode & 0xF00F) | (x << 8) | (y << 4);
+    vx = k->v[x];
+    vy = k->v[y];
+
+    switch (opcode & 0xF000) {
+    case 0x5000: case 0x9000:
+        // compare against an immediate when either side is known
+        base = (0x5000 == (opcode & 0xF000)) ? 0x3000 : 0x4000;
+        if (vy >= 0)
+            opcode = base | (x << 8) | vy;
+        else if (vx >= 0)
+            opcode = base | (y << 8) | vx;
+        break;
+    case 0x7000:
+        if (0 == IR_B(opcode))
+            return 0;
+        if (vx >= 0)
+            opcode = IR_MOV(x, vx + IR_B(opcode));
+        break;
+    case 0x8000:
+        return xlat_fold_alu(k, opcode, op);
+    case 0xB000:
+        // a known target turns the indirect jump into one that can be chained
+        if (k->v[0] >= 0)
+            opcode = 0x1000 | ((k->v[0] + IR_T(opcode)) & 0xFFF);
+        break;
+    case 0xF000:
+        switch (opcode & 0xFF) {
+        case 0x1E:
+            if (k->i >= 0 && vx >= 0 && k->i + vx <= 0xFFF) {
+                op[0] = 0xA000 | (k->i + vx);
+                op[1] = IR_MOV(0xF, 0);
+                return 2;
+            }
+            break;
+        case 0x29:
+            if (vx >= 0)
+                opcode = 0xA000 | ((vx & 0xF) * 5);
+            break;
+#ifdef HAVE_SCHIP_SUPPORT
+        case 0x30:
+            if (vx >= 0)
+                opcode = 0xA000 | (LFONT_SIZE + (vx & 0xF) * 10);
+            break;
+#endif // HAVE_SCHIP_SUPPORT
+        }
+        break;
+    }
+
+    op[0] = opcode;
+    return 1;
+}
+
+// -----------------------------------------------------------------------------
+// Return nonzero if opcode loads a register with the value it already holds.
+static int xlat_is_redundant(const xlat_values_t *k, int opcode)
+{
+    switch (opcode & 0xF000) {
+    case 0x6000:
+        return k->v[IR_X(opcode)] == IR_B(opcode);
+    case 0xA000:
+        return k->i == IR_T(opcode);
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Optimize a decoded block in place. Constants and copies are propagated
+// forward through the block, folding instructions and dropping loads of values
+// that are already in place. A backward pass then removes stores that are
+// overwritten before anything reads them, recording in each instruction the
+// latest one that made a store it held dead.
+// Instructions that may be skipped are left alone, and only invalidate what is
+// known about the registers they write.
+void xlat_optimize_block(xlat_ir_t *ir, int count)
+{
+    int killer[GUEST_REGS];
+    uint32_t reads, writes, live;
+    xlat_values_t k;
+    int n, i, r;
+
+    for (r = 0; r < 16; ++r)
+        k.v[r] = k.copy[r] = -1;
+    k.i = -1;
+
+    for (n = 0; n < count; ++n) {
+        xlat_ir_t *e = &ir[n];
+        uint16_t op[2];
+        int num_ops;
+
+        if (e->flags & XLAT_IR_SHADOW) {
+            xlat_guest_effects(e->op[0], &reads, &writes);
+            xlat_forget_values(&k, writes);
+            continue;
+        }
+
+        // a followed branch only moves the stack pointer, if anything
+        if (e->flags & XLAT_IR_FOLLOW)
+            continue;
+
+        num_ops = xlat_fold(&k, e->op[0], op);
+        e->num_ops = 0;
+        for (i = 0; i < num_ops; ++i) {
+            if (xlat_is_redundant(&k, op[i]))
+                continue;
+            e->op[e->num_ops++] = op[i];
+            xlat_apply_values(&k, op[i]);
+        }
+    }
+
+    // every register is written back by the exit ending the block
+    live = ~0u;
+    for (r = 0; r < GUEST_REGS; ++r)
+        killer[r] = -1;
+
+    for (n = count - 1; n >= 0; --n) {
+        xlat_ir_t *e = &ir[n];
+        int shadow = e->flags & XLAT_IR_SHADOW;
+
+        if (e->flags & XLAT_IR_FOLLOW)
+            continue;
+
+        // as does the side exit of a skip
+        if (e->flags & XLAT_IR_EXIT)
+            live = ~0u;
+
+        for (i = e->num_ops - 1; i >= 0; --i) {
+            int pure = xlat_guest_effects(e->op[i], &reads, &writes);
+
+            if (!shadow && pure && !(writes & live)) {
+                for (r = 0; r < GUEST_REGS; ++r)
+                    if (writes & (1u << r))
+                        e->kill = MAX(e->kill, killer[r]);
+                for (r = i; r + 1 < e->num_ops; ++r)
+                    e->op[r] = e->op[r + 1];
+                --e->num_ops;
+                continue;
+            }
+
+            // a skipped instruction may leave its registers as they were
+            if (!shadow) {
+                live &= ~writes;
+                for (r = 0; r < GUEST_REGS; ++r)
+                    if (writes & (1u << r))
+                        killer[r] = n;
+            }
+            live |= reads;
+        }
+    }
+}
@@ -0,0 +1,118 @@
+// gchip - a simple recompiling chip-8 emulator
+// Copyright (C) 2011  Garrett Smith.
+// 
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+// 
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#include <stdio.h>
+#include "chip8.h"
+#include "xlat.h"
+
+#ifdef PLATFORM_WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif // PLATFORM_WIN32
+
+// Symbols for translated code in the format read by Linux perf, which looks
+// for /tmp/perf-<pid>.map when it meets addresses outside any mapped image.
+// Each line gives the host address and size of a block and names the guest
+// code it was translated from. Blocks are appended as they are committed,
+// and the whole file is written again once dropped blocks have left it
+// naming code that is dead or about to be reused.
+
+// -----------------------------------------------------------------------------
+static FILE *xlat_perf_create(void)
+{
+    char path[64];
+    FILE *fp;
+
+    sprintf(path, "/tmp/perf-%d.map", (int)getpid());
+    fp = fopen(path, "w");
+    if (NULL == fp)
+        log_err("failed to create perf map \"%s\"\n", path);
+    return fp;
+}
+
+// -----------------------------------------------------------------------------
+static void xlat_perf_write(FILE *fp, const xlat_block_t *xb)
+{
+    char name[48];
+    xlat_name_block(xb, name, sizeof(name));
+    fprintf(fp, "%llx %lx %s\n",
+            (unsigned long long)(size_t)xb->block, xb->length, name);
+}
+
+// -----------------------------------------------------------------------------
+// Write the map from scratch, listing the stubs and every block still live.
+static void xlat_perf_rewrite(xlat_cache_t *xc)
+{
+    int r;
+
+    if (NULL != xc->perf_map)
+        fclose(xc->perf_map);
+    xc->perf_map = xlat_perf_create();
+    if (NULL == xc->perf_map)
+        return;
+
+    fprintf(xc->perf_map, "%llx %lx c8_stubs\n",
+            (unsigned long long)(size_t)xc->code, xc->code_base);
+    for (r = 0; r < XLAT_RECORDS(xc); ++r) {
+        xlat_block_t *xb = &xc->pool[r];
+        if (NULL != xb->block)
+            xlat_perf_write(xc->perf_map, xb);
+    }
+    fflush(xc->perf_map);
+    xc->perf_stale = 0;
+}
+
+// -----------------------------------------------------------------------------
+// Start writing the perf map for the cache.
+void xlat_perf_open(xlat_cache_t *xc)
+{
+    xlat_perf_rewrite(xc);
+}
+
+// -----------------------------------------------------------------------------
+// Stop writing the perf map. The file is left for perf to read afterwards.
+void xlat_perf_close(xlat_cache_t *xc)
+{
+    if (NULL != xc->perf_map)
+        fclose(xc->perf_map);
+    xc->perf_map = NULL;
+}
+
+// -----------------------------------------------------------------------------
+// Name a newly committed block in the perf map.
+void xlat_perf_add_block(xlat_cache_t *xc, const xlat_block_t *xb)
+{
+    if (NULL == xc->perf_map)
+        return;
+
+    if (xc->perf_stale) {
+        xlat_perf_rewrite(xc);
+        return;
+    }
+    xlat_perf_write(xc->perf_map, xb);
+    fflush(xc->perf_map);
+}
+
+// -----------------------------------------------------------------------------
+// Remove blocks dropped since the map was last written.
+void xlat_perf_sync(xlat_cache_t *xc)
+{
+    if (NULL != xc->perf_map && xc->perf_stale)
+        xlat_perf_rewrite(xc);
+}
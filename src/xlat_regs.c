@@ -0,0 +1,340 @@
+// gchip - a simple recompiling chip-8 emulator
+// Copyright (C) 2011  Garrett Smith.
+// 
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+// 
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#include <assert.h>
+#include "xlat.h"
+
+// -----------------------------------------------------------------------------
+int xlat_alloc_state(xlat_state_t *xs)
+{
+    int i;
+
+    // every host register starts out unreserved
+    for (i = 0; i < HOST_REG_IDS; ++i)
+        xs->host_map[i] = XLAT_HOST_FREE;
+    xs->locked = 0;
+    xs->dirty = 0;
+    xs->pinned = 0;
+    xs->flag_op = XLAT_FLAG_NONE;
+
+    // set all guest register mappings to unreserved state
+    for (i = 0; i < GUEST_REGS; ++i)
+        xs->reg_map[i] = -1;
+
+    // pinned registers stay mapped for the whole block
+    for (i = 0; i < xs->ctx->xc->num_pins; ++i) {
+        const xlat_pin_t *pin = &xs->ctx->xc->pins[i];
+        xs->host_map[pin->host_reg] = pin->reg;
+        xs->reg_map[pin->reg] = pin->host_reg;
+        xs->reg_bits[pin->reg] = pin->bits;
+        xs->reg_sync[pin->reg] = (uint8_t *)xs->ctx + pin->offset;
+        xs->pinned |= 1u << pin->reg;
+    }
+
+    xs->skip_site = NULL;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+void xlat_free_state(xlat_state_t *xs)
+{
+#ifndef NDEBUG
+    int i;
+    for (i = 0; i < xlat_num_host_regs; ++i)
+        assert(XLAT_HOST_TEMP != xs->host_map[xlat_host_regs[i]]);
+#endif // NDEBUG
+}
+
+// -----------------------------------------------------------------------------
+// Copy the register allocation of src into dst.
+void xlat_copy_state(xlat_state_t *dst, const xlat_state_t *src)
+{
+    *dst = *src;
+}
+
+// -----------------------------------------------------------------------------
+// Load a context field of the given width into a host register.
+void xlat_emit_load_field(xlat_block_t *xb, int bits, int host_reg, int off)
+{
+    switch (bits) {
+    default:
+        assert(!"xlat_emit_load_field: invalid bit width specified");
+        // fall through to 8-bit for release builds
+    case 8:
+        xlat_emit_movzx_rm8r32_offset(xb, XLAT_CTX_REG, host_reg, off);
+        break;
+    case 16:
+        xlat_emit_movzx_rm16r32_offset(xb, XLAT_CTX_REG, host_reg, off);
+        break;
+    case 32:
+        xlat_emit_mov_rmr32_offset(xb, XLAT_CTX_REG, host_reg, off);
+        break;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Store a host register into a context field of the given width.
+void xlat_emit_store_field(xlat_block_t *xb, int bits, int host_reg, int off)
+{
+    switch (bits) {
+    default:
+        assert(!"xlat_emit_store_field: invalid bit width specified");
+        // fall through to 8-bit for release builds
+    case 8:
+        xlat_emit_mov_r8rm_offset(xb, host_reg, XLAT_CTX_REG, off);
+        break;
+    case 16:
+        xlat_emit_mov_r16rm_offset(xb, host_reg, XLAT_CTX_REG, off);
+        break;
+    case 32:
+        xlat_emit_mov_r32rm_offset(xb, host_reg, XLAT_CTX_REG, off);
+        break;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Load a mapped guest register from the emulator context.
+static void xlat_load_register(xlat_state_t *xs, int reg)
+{
+    xlat_emit_load_field(xs->xb, xs->reg_bits[reg], xs->reg_map[reg],
+                         XLAT_CTX_OFFSET(xs, xs->reg_sync[reg]));
+}
+
+// -----------------------------------------------------------------------------
+// Return to the allocation in saved at a join point. Guest registers that have
+// moved or been mapped since it was taken are written back and released, then
+// any it had mapped that are no longer in place are reloaded into the same
+// host registers. A register stays dirty if it is dirty on either path.
+void xlat_merge_state(xlat_state_t *xs, const xlat_state_t *saved)
+{
+    int i;
+
+    for (i = 0; i < GUEST_REGS; ++i)
+        if (xs->reg_map[i] >= 0 && xs->reg_map[i] != saved->reg_map[i])
+            xlat_free_register(xs, i);
+
+    for (i = 0; i < GUEST_REGS; ++i) {
+        int host_reg = saved->reg_map[i];
+        if (host_reg < 0 || xs->reg_map[i] == host_reg)
+            continue;
+
+        assert(XLAT_HOST_FREE == xs->host_map[host_reg]);
+        xs->host_map[host_reg] = i;
+        xs->reg_map[i] = host_reg;
+        xs->reg_bits[i] = saved->reg_bits[i];
+        xs->reg_sync[i] = saved->reg_sync[i];
+        xlat_load_register(xs, i);
+    }
+
+    xs->dirty |= saved->dirty;
+}
+
+// -----------------------------------------------------------------------------
+// Pick a host register for a new mapping. When none are free, the guest
+// register whose next use lies furthest ahead is spilled back to the context;
+// registers already used by the current instruction are never chosen.
+static int xlat_alloc_host(xlat_state_t *xs)
+{
+    int i, victim = -1, furthest = -1;
+
+    for (i = xlat_num_host_regs - 1; i >= 0; --i)
+        if (XLAT_HOST_FREE == xs->host_map[xlat_host_regs[i]])
+            return xlat_host_regs[i];
+
+    for (i = 0; i < xlat_num_host_regs; ++i) {
+        int host_reg = xlat_host_regs[i], reg = xs->host_map[host_reg], next;
+        if ((xs->locked & (1u << host_reg)) || reg < 0 ||
+                (xs->pinned & (1u << reg)))
+            continue;
+
+        next = xlat_next_use(xs, reg);
+        if (next > furthest) {
+            furthest = next;
+            victim = host_reg;
+        }
+    }
+
+    if (victim < 0) {
+        assert(!"xlat_alloc_host: every host register is in use");
+        return -1;
+    }
+
+    log_spew("spilling guest register %d from host register %d\n",
+             xs->host_map[victim], victim);
+    xlat_free_register(xs, xs->host_map[victim]);
+    return victim;
+}
+
+// -----------------------------------------------------------------------------
+// Map guest register reg into a host register without initializing it. A
+// negative reg or NULL sync reserves a temporary instead.
+static int xlat_map_register(xlat_state_t *xs, int bits, int reg, void *sync)
+{
+    int host_reg;
+
+    if ((reg >= 0) && (xs->reg_map[reg] >= 0)) {
+        // the register is already reserved, just return its assigned index
+        xs->locked |= 1u << xs->reg_map[reg];
+        return xs->reg_map[reg];
+    }
+
+    host_reg = xlat_alloc_host(xs);
+    if (host_reg < 0)
+        return -1;
+
+    xs->locked |= 1u << host_reg;
+    if ((reg < 0) || (NULL == sync)) {
+        xs->host_map[host_reg] = XLAT_HOST_TEMP;
+        return host_reg;
+    }
+
+    xs->host_map[host_reg] = reg;
+    xs->reg_map[reg] = host_reg;
+    xs->reg_bits[reg] = bits;
+    xs->reg_sync[reg] = sync;
+    return host_reg;
+}
+
+// -----------------------------------------------------------------------------
+int xlat_reserve_register(xlat_state_t *xs, int bits, int reg, void *sync)
+{
+    int host_reg, mapped = (reg >= 0) && (xs->reg_map[reg] >= 0);
+
+    host_reg = xlat_map_register(xs, bits, reg, sync);
+    if (!mapped && host_reg >= 0 && reg >= 0 && NULL != sync) {
+        // initialize the register using the emulator context
+        xlat_load_register(xs, reg);
+    }
+    return host_reg;
+}
+
+// -----------------------------------------------------------------------------
+int xlat_reserve_register_wo(xlat_state_t *xs, int bits, int reg, void *sync)
+{
+    int host_reg = xlat_map_register(xs, bits, reg, sync);
+    if (host_reg >= 0 && reg >= 0 && NULL != sync)
+        xs->dirty |= 1u << reg;
+    return host_reg;
+}
+
+// -----------------------------------------------------------------------------
+int xlat_reserve_register_rw(xlat_state_t *xs, int bits, int reg, void *sync)
+{
+    int host_reg = xlat_reserve_register(xs, bits, reg, sync);
+    if (host_reg >= 0 && reg >= 0 && NULL != sync)
+        xs->dirty |= 1u << reg;
+    return host_reg;
+}
+
+// -----------------------------------------------------------------------------
+int xlat_reserve_register_temp(xlat_state_t *xs, int bits)
+{
+    return xlat_reserve_register(xs, bits, -1, NULL);
+}
+
+// -----------------------------------------------------------------------------
+int xlat_reserve_register_index(xlat_state_t *xs, int bits, int index)
+{
+    int i;
+    for (i = 0; i < GUEST_REGS; i++) {
+        if (xs->reg_map[i] == index) {
+            log_spew("ejecting register index %d (%d)\n", index, i);
+            xlat_free_register(xs, i);
+            break;
+        }
+    }
+    return index;
+}
+
+// -----------------------------------------------------------------------------
+// Write a guest register back if the context may not hold its value. Pinned
+// registers are always written, since an earlier block may have changed them.
+void xlat_commit_register(xlat_state_t *xs, int bits, int reg)
+{
+    int host_reg = xs->reg_map[reg];
+    if (host_reg < 0 || !((xs->dirty | xs->pinned) & (1u << reg)))
+        return;
+
+    // the context now holds the current value
+    xs->dirty &= ~(1u << reg);
+    xlat_emit_store_field(xs->xb, bits, host_reg,
+                          XLAT_CTX_OFFSET(xs, xs->reg_sync[reg]));
+}
+
+// -----------------------------------------------------------------------------
+void xlat_free_register(xlat_state_t *xs, int reg)
+{
+    int host_reg = xs->reg_map[reg];
+    if (host_reg < 0) {
+        assert(!"attempting to free unreserved register");
+        return;
+    }
+    assert(!(xs->pinned & (1u << reg)));
+
+    // write the register back if it was modified and release its host register
+    xlat_commit_register(xs, xs->reg_bits[reg], reg);
+    xs->host_map[host_reg] = XLAT_HOST_FREE;
+    xs->locked &= ~(1u << host_reg);
+    xs->reg_map[reg] = -1;
+}
+
+// -----------------------------------------------------------------------------
+void xlat_free_register_temp(xlat_state_t *xs, int host_reg)
+{
+    assert(XLAT_HOST_TEMP == xs->host_map[host_reg]);
+    xs->host_map[host_reg] = XLAT_HOST_FREE;
+    xs->locked &= ~(1u << host_reg);
+}
+
+
+// -----------------------------------------------------------------------------
+// Write every pinned guest register to the context, ahead of C code that
+// reads it.
+void xlat_emit_store_pins(xlat_state_t *xs)
+{
+    xlat_cache_t *xc = xs->ctx->xc;
+    int i;
+
+    for (i = 0; i < xc->num_pins; ++i)
+        xlat_emit_store_field(xs->xb, xc->pins[i].bits,
+                              xc->pins[i].host_reg, xc->pins[i].offset);
+}
+
+// -----------------------------------------------------------------------------
+// Reload every pinned guest register after C code that may have changed it.
+void xlat_emit_load_pins(xlat_state_t *xs)
+{
+    xlat_cache_t *xc = xs->ctx->xc;
+    int i;
+
+    for (i = 0; i < xc->num_pins; ++i)
+        xlat_emit_load_field(xs->xb, xc->pins[i].bits,
+                             xc->pins[i].host_reg, xc->pins[i].offset);
+}
+
+// -----------------------------------------------------------------------------
+// Write every modified guest register back to the emulator context and release
+// all mappings, other than pinned registers which carry over into the next
+// block. Only moves are emitted, so the host flags are preserved.
+void xlat_emit_epilogue(xlat_state_t *xs)
+{
+    int i;
+
+    for (i = 0; i < GUEST_REGS; ++i)
+        if (xs->reg_map[i] >= 0 && !(xs->pinned & (1u << i)))
+            xlat_free_register(xs, i);
+}
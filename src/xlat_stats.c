@@ -0,0 +1,167 @@
+// gchip - a simple recompiling chip-8 emulator
+// Copyright (C) 2011  Garrett Smith.
+// 
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+// 
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+
+#include <string.h>
+#include "chip8.h"
+#include "xlat.h"
+
+#ifdef PLATFORM_WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif // PLATFORM_WIN32
+
+// Statistics on how well translation pays off for a program. Translations,
+// their cost and the reasons translated code returned to the dispatcher are
+// totalled as they happen. Rankings are taken over the blocks still live,
+// whose entries are only all counted when JIT_STATS was set as the blocks were
+// translated. Otherwise just entries from the dispatcher are.
+
+static const char *exit_names[JIT_EXITS] = {
+    "chain", "dynamic", "budget", "hot", "idle"
+};
+
+// -----------------------------------------------------------------------------
+// Return a monotonic time in nanoseconds.
+uint64_t xlat_stats_clock(void)
+{
+#ifdef PLATFORM_WIN32
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)(count.QuadPart * 1000000000.0 / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif // PLATFORM_WIN32
+}
+
+// -----------------------------------------------------------------------------
+// Count a block just committed, whose translation began at time start.
+void xlat_stats_add_block(xlat_cache_t *xc, const xlat_block_t *xb,
+                          uint64_t start)
+{
+    c8_jit_stats_t *stats = &xc->stats;
+    int bucket = 0;
+
+    while (bucket < JIT_LENGTHS - 1 && (xb->num_cycles >> (bucket + 1)))
+        ++bucket;
+
+    ++stats->blocks;
+    stats->traces += xb->trace;
+    stats->translate_ms += (xlat_stats_clock() - start) / 1e6;
+    stats->guest_ops += xb->num_cycles;
+    stats->host_bytes += xb->length;
+    ++stats->lengths[bucket];
+}
+
+// -----------------------------------------------------------------------------
+// Insert entry into a ranking of JIT_TOP blocks, ordered by visits or cycles.
+static void xlat_stats_rank(c8_jit_block_t *top, const c8_jit_block_t *entry,
+                            int by_cycles)
+{
+    long value = by_cycles ? entry->cycles : entry->visits;
+    int i = JIT_TOP;
+
+    while (i > 0 && value > (by_cycles ? top[i - 1].cycles : top[i - 1].visits))
+        --i;
+    if (JIT_TOP == i)
+        return;
+    memmove(&top[i + 1], &top[i], (JIT_TOP - i - 1) * sizeof(c8_jit_block_t));
+    top[i] = *entry;
+}
+
+// -----------------------------------------------------------------------------
+void xlat_get_stats(const xlat_cache_t *xc, c8_jit_stats_t *stats)
+{
+    int r;
+
+    *stats = xc->stats;
+    stats->invalidations = xc->invalidations;
+    stats->flushes = xc->flushes;
+    stats->live = 0;
+    memset(stats->top_visits, 0, sizeof(stats->top_visits));
+    memset(stats->top_cycles, 0, sizeof(stats->top_cycles));
+
+    for (r = 0; r < XLAT_RECORDS(xc); ++r) {
+        const xlat_block_t *xb = &xc->pool[r];
+        c8_jit_block_t entry;
+
+        if (NULL == xb->block)
+            continue;
+        ++stats->live;
+
+        entry.pc = xb->pc;
+        entry.length = (int)xb->num_cycles;
+        entry.visits = (uint32_t)xb->visits;
+        entry.cycles = entry.visits * xb->num_cycles;
+        xlat_stats_rank(stats->top_visits, &entry, 0);
+        xlat_stats_rank(stats->top_cycles, &entry, 1);
+    }
+}
+
+// -----------------------------------------------------------------------------
+static void xlat_print_ranking(const char *title, const c8_jit_block_t *top)
+{
+    int i;
+
+    log_info("  top blocks by %s:\n", title);
+    for (i = 0; i < JIT_TOP && top[i].length; ++i) {
+        log_info("    %04X  %3d instructions  %10ld visits  %12ld cycles\n",
+                 top[i].pc, top[i].length, top[i].visits, top[i].cycles);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Print the statistics through log_info, for --jit-stats.
+void xlat_print_stats(const xlat_cache_t *xc)
+{
+    c8_jit_stats_t stats;
+    int i;
+
+    xlat_get_stats(xc, &stats);
+
+    log_info("JIT statistics:\n");
+    log_info("  blocks translated: %ld (%ld traces) in %.3f ms, %d live\n",
+             stats.blocks, stats.traces, stats.translate_ms, stats.live);
+    log_info("  guest instructions translated: %ld, %.1f host bytes each\n",
+             stats.guest_ops,
+             stats.guest_ops ? (double)stats.host_bytes / stats.guest_ops : 0.0);
+
+    log_info("  block lengths:");
+    for (i = 0; i < JIT_LENGTHS; ++i) {
+        if (JIT_LENGTHS - 1 == i)
+            log_info(" %d+: %ld", 1 << i, stats.lengths[i]);
+        else if (0 == i)
+            log_info(" 1: %ld", stats.lengths[i]);
+        else
+            log_info(" %d-%d: %ld", 1 << i, (2 << i) - 1, stats.lengths[i]);
+    }
+    log_info("\n");
+
+    log_info("  exits:");
+    for (i = 0; i < JIT_EXITS; ++i)
+        log_info(" %s %ld", exit_names[i], stats.exits[i]);
+    log_info("\n");
+
+    log_info("  invalidations: %ld, flushes: %ld\n",
+             stats.invalidations, stats.flushes);
+    xlat_print_ranking("visits", stats.top_visits);
+    xlat_print_ranking("cycles", stats.top_cycles);
+}
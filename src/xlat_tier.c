@@ -0,0 +1,470 @@
+// gchip - a simple recompiling chip-8 emulator
+// Copyright (C) 2011  Garrett Smith.
+// 
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+// 
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+// 
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "chip8.h"
+#include "xlat.h"
+
+#ifdef PLATFORM_WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif // PLATFORM_WIN32
+
+#define XLAT_TIER_THRESHOLD 16  // entries before a block is queued to compile
+#define XLAT_TIER_QUEUE     64  // blocks waiting for the compiler thread
+
+// Tiered execution runs every block in a caching interpreter until it has
+// been entered XLAT_TIER_THRESHOLD times, then hands it to a compiler thread.
+// Entries are counted here rather than in block records, so that the block
+// map only takes leaves for code that is actually compiled.
+// Translated blocks that become hot are handed back to be made traces.
+//
+// The lock guards the translation cache, the requests and stores into guest
+// memory. The compiler thread holds it while it decodes and translates, and
+// only ever fills empty records, each of which it publishes with a release
+// store once complete. The emulator thread runs published blocks without the
+// lock; it only tries to take it to queue requests and to reorganize the
+// cache, which waits for a later block if the compiler thread is busy. Other
+// emulator state is not read by the compiler thread, so each request carries
+// the system its block is to be translated for.
+struct xlat_tier {
+    c8_context_t *ctx;
+#ifdef PLATFORM_WIN32
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE wake;
+    HANDLE thread;
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+#endif // PLATFORM_WIN32
+    int quit;                       // compiler thread should terminate
+    int full;                       // cache must be emptied for more blocks
+    int head, count;                // oldest request and number queued
+    int queue[XLAT_TIER_QUEUE];
+    int systems[XLAT_TIER_QUEUE];   // system active when each was queued
+    int trace_pc;                   // trace waiting to be translated, or -1
+    int trace_len;
+    int trace_system;               // system active when it was decoded
+    xlat_ir_t trace[XLAT_MAX_IR];   // its instructions, decoded from a profile
+    uint16_t *opcodes;              // decoded instruction at each address
+    c8_opcode_fn *fns;              // its handler, or NULL if not decoded
+    uint8_t *visits;                // interpreted entries of a block there
+};
+
+// -----------------------------------------------------------------------------
+static void xlat_tier_lock(struct xlat_tier *tier)
+{
+#ifdef PLATFORM_WIN32
+    EnterCriticalSection(&tier->lock);
+#else
+    pthread_mutex_lock(&tier->lock);
+#endif // PLATFORM_WIN32
+}
+
+// -----------------------------------------------------------------------------
+static int xlat_tier_trylock(struct xlat_tier *tier)
+{
+#ifdef PLATFORM_WIN32
+    return 0 != TryEnterCriticalSection(&tier->lock);
+#else
+    return 0 == pthread_mutex_trylock(&tier->lock);
+#endif // PLATFORM_WIN32
+}
+
+// -----------------------------------------------------------------------------
+static void xlat_tier_unlock(struct xlat_tier *tier)
+{
+#ifdef PLATFORM_WIN32
+    LeaveCriticalSection(&tier->lock);
+#else
+    pthread_mutex_unlock(&tier->lock);
+#endif // PLATFORM_WIN32
+}
+
+// -----------------------------------------------------------------------------
+static void xlat_tier_wait(struct xlat_tier *tier)
+{
+#ifdef PLATFORM_WIN32
+    SleepConditionVariableCS(&tier->wake, &tier->lock, INFINITE);
+#else
+    pthread_cond_wait(&tier->wake, &tier->lock);
+#endif // PLATFORM_WIN32
+}
+
+// -----------------------------------------------------------------------------
+static void xlat_tier_signal(struct xlat_tier *tier)
+{
+#ifdef PLATFORM_WIN32
+    WakeConditionVariable(&tier->wake);
+#else
+    pthread_cond_signal(&tier->wake);
+#endif // PLATFORM_WIN32
+}
+
+// -----------------------------------------------------------------------------
+// Translate the waiting trace, then queued blocks, until asked to quit. The
+// lock is only released while waiting. Blocks are not translated once the
+// cache is full, as translated code may be running from it; they are asked
+// for again after the emulator thread has emptied it.
+static void xlat_tier_compile(struct xlat_tier *tier)
+{
+    c8_context_t *ctx = tier->ctx;
+    xlat_cache_t *xc = ctx->xc;
+
+    xlat_tier_lock(tier);
+    for (;;) {
+        xlat_block_t *xb;
+        int pc, system, trace;
+
+        while (0 == tier->count && tier->trace_pc < 0 && !tier->quit)
+            xlat_tier_wait(tier);
+        if (tier->quit)
+            break;
+
+        trace = (tier->trace_pc >= 0);
+        if (trace) {
+            pc = tier->trace_pc;
+            system = tier->trace_system;
+            tier->trace_pc = -1;
+        }
+        else {
+            pc = tier->queue[tier->head];
+            system = tier->systems[tier->head];
+            tier->head = (tier->head + 1) % XLAT_TIER_QUEUE;
+            --tier->count;
+        }
+
+        xb = xlat_map_block(xc, pc);
+        if (NULL == xb || xlat_cache_full(xc)) {
+            tier->full = 1;
+            continue;
+        }
+
+        // the block may have been translated since it was queued
+        if (NULL != xb->block)
+            continue;
+        if (trace && 0 > xlat_build_trace(ctx, xb, tier->trace,
+                                          tier->trace_len, system))
+            log_err("failed to form xlat trace @PC=%04X\n", pc);
+        else if (!trace && 0 > xlat_translate_block(ctx, xb, pc, system))
+            log_err("failed to compile xlat block @PC=%04X\n", pc);
+    }
+    xlat_tier_unlock(tier);
+}
+
+#ifdef PLATFORM_WIN32
+// -----------------------------------------------------------------------------
+static DWORD WINAPI xlat_tier_main(LPVOID arg)
+{
+    xlat_tier_compile((struct xlat_tier *)arg);
+    return 0;
+}
+#else
+// -----------------------------------------------------------------------------
+static void *xlat_tier_main(void *arg)
+{
+    xlat_tier_compile((struct xlat_tier *)arg);
+    return NULL;
+}
+#endif // PLATFORM_WIN32
+
+// -----------------------------------------------------------------------------
+static void xlat_tier_free(struct xlat_tier *tier)
+{
+    free(tier->opcodes);
+    free(tier->fns);
+    free(tier->visits);
+    free(tier);
+}
+
+// -----------------------------------------------------------------------------
+// Start the compiler thread for the context's translation cache.
+int xlat_create_tier(c8_context_t *ctx)
+{
+    struct xlat_tier *tier;
+
+    tier = (struct xlat_tier *)calloc(1, sizeof(struct xlat_tier));
+    if (NULL == tier)
+        return -1;
+    tier->ctx = ctx;
+    tier->trace_pc = -1;
+
+    // one entry for each address, as the program may run from any of them
+    tier->opcodes = (uint16_t *)calloc(ctx->rom_size, sizeof(uint16_t));
+    tier->fns = (c8_opcode_fn *)calloc(ctx->rom_size, sizeof(c8_opcode_fn));
+    tier->visits = (uint8_t *)calloc(ctx->rom_size, sizeof(uint8_t));
+    if (NULL == tier->opcodes || NULL == tier->fns || NULL == tier->visits) {
+        xlat_tier_free(tier);
+        return -1;
+    }
+
+#ifdef PLATFORM_WIN32
+    InitializeCriticalSection(&tier->lock);
+    InitializeConditionVariable(&tier->wake);
+    tier->thread = CreateThread(NULL, 0, xlat_tier_main, tier, 0, NULL);
+    if (NULL == tier->thread) {
+        DeleteCriticalSection(&tier->lock);
+#else
+    pthread_mutex_init(&tier->lock, NULL);
+    pthread_cond_init(&tier->wake, NULL);
+    if (0 != pthread_create(&tier->thread, NULL, xlat_tier_main, tier)) {
+        pthread_cond_destroy(&tier->wake);
+        pthread_mutex_destroy(&tier->lock);
+#endif // PLATFORM_WIN32
+        log_err("failed to start xlat compiler thread\n");
+        xlat_tier_free(tier);
+        return -1;
+    }
+
+    ctx->xc->tier = tier;
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Stop the compiler thread, abandoning any blocks still queued.
+void xlat_destroy_tier(xlat_cache_t *xc)
+{
+    struct xlat_tier *tier = xc->tier;
+
+    if (NULL == tier)
+        return;
+
+    xlat_tier_lock(tier);
+    tier->quit = 1;
+    xlat_tier_signal(tier);
+    xlat_tier_unlock(tier);
+
+#ifdef PLATFORM_WIN32
+    WaitForSingleObject(tier->thread, INFINITE);
+    CloseHandle(tier->thread);
+    DeleteCriticalSection(&tier->lock);
+#else
+    pthread_join(tier->thread, NULL);
+    pthread_cond_destroy(&tier->wake);
+    pthread_mutex_destroy(&tier->lock);
+#endif // PLATFORM_WIN32
+
+    xlat_tier_free(tier);
+    xc->tier = NULL;
+}
+
+// -----------------------------------------------------------------------------
+// Wait for the compiler thread to finish its current block and keep it out of
+// the cache until xlat_unlock_tier, for instance while translated code stores
+// into guest memory. Does nothing if there is no compiler thread.
+void xlat_lock_tier(xlat_cache_t *xc)
+{
+    if (NULL != xc->tier)
+        xlat_tier_lock(xc->tier);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_unlock_tier(xlat_cache_t *xc)
+{
+    if (NULL != xc->tier)
+        xlat_tier_unlock(xc->tier);
+}
+
+// -----------------------------------------------------------------------------
+// Lock the compiler thread out until xlat_resume_tier. Requests, decoded
+// instructions and entry counts are dropped, since the cache is about to be
+// reset.
+void xlat_pause_tier(xlat_cache_t *xc)
+{
+    struct xlat_tier *tier = xc->tier;
+
+    if (NULL == tier)
+        return;
+
+    xlat_tier_lock(tier);
+    tier->count = 0;
+    tier->trace_pc = -1;
+    tier->full = 0;
+    memset(tier->fns, 0, tier->ctx->rom_size * sizeof(c8_opcode_fn));
+    memset(tier->visits, 0, tier->ctx->rom_size * sizeof(uint8_t));
+}
+
+// -----------------------------------------------------------------------------
+void xlat_resume_tier(xlat_cache_t *xc)
+{
+    if (NULL != xc->tier)
+        xlat_tier_unlock(xc->tier);
+}
+
+// -----------------------------------------------------------------------------
+// Drop decoded instructions overlapping guest memory in [addr, addr + length),
+// along with a waiting trace decoded from any of them. Called with the lock
+// held.
+void xlat_forget_opcodes(xlat_cache_t *xc, int addr, int length)
+{
+    struct xlat_tier *tier = xc->tier;
+    int pc, n;
+
+    for (pc = addr - 1; pc < addr + length; ++pc)
+        tier->fns[pc & xc->addr_mask] = NULL;
+
+    for (n = 0; tier->trace_pc >= 0 && n < tier->trace_len; ++n)
+        if (((tier->trace[n].pc + 1 - addr) & xc->addr_mask) <= length)
+            tier->trace_pc = -1;
+}
+
+// -----------------------------------------------------------------------------
+// Queue the block at pc for the compiler thread. Called with the lock held.
+static void xlat_tier_request(struct xlat_tier *tier, int pc)
+{
+    int tail = (tier->head + tier->count) % XLAT_TIER_QUEUE;
+
+    if (XLAT_TIER_QUEUE == tier->count)
+        return;
+
+    tier->queue[tail] = pc;
+    tier->systems[tail] = tier->ctx->system;
+    ++tier->count;
+    xlat_tier_signal(tier);
+}
+
+// -----------------------------------------------------------------------------
+// Hand the hot block at pc to the compiler thread to be made a trace. It is
+// decoded and dropped here, since translated code updates the profile the
+// trace is formed from, and is interpreted until the trace is published. The
+// block asks again on its next entry if the compiler thread is busy.
+static void xlat_tier_heat(struct xlat_tier *tier, int pc)
+{
+    c8_context_t *ctx = tier->ctx;
+    xlat_block_t *xb = xlat_lookup_block(ctx->xc, pc);
+
+    if (xlat_tier_trylock(tier)) {
+        if (tier->trace_pc < 0) {
+            tier->trace_len = xlat_prepare_trace(ctx, xb, tier->trace);
+            tier->trace_system = ctx->system;
+            tier->trace_pc = pc;
+            xlat_tier_signal(tier);
+            xb = NULL;
+        }
+        xlat_tier_unlock(tier);
+    }
+    if (NULL != xb)
+        xb->countdown = 1;
+}
+
+// -----------------------------------------------------------------------------
+// Reorganize the cache for the compiler thread, if it is idle: empty it once
+// the compiler thread has run out of room, and count a dispatch towards the
+// register profile.
+static void xlat_tier_service(struct xlat_tier *tier)
+{
+    xlat_cache_t *xc = tier->ctx->xc;
+
+    if (!xlat_tier_trylock(tier))
+        return;
+
+    if (tier->full) {
+        log_spew("xlat cache is full, flushing\n");
+        xlat_empty_cache(xc);
+        tier->full = 0;
+    }
+#ifdef HAVE_REGISTER_PINNING
+    xlat_sample_pins(tier->ctx);
+#endif // HAVE_REGISTER_PINNING
+    xlat_tier_unlock(tier);
+}
+
+// -----------------------------------------------------------------------------
+long c8_execute_cycles_tiered(c8_context_t *ctx, long cycles)
+{
+    struct xlat_tier *tier;
+    long start_cycles;
+    xlat_cache_t *xc;
+    int pc;
+
+    // translated blocks are kept in the context until it is destroyed
+    if (NULL == ctx->xc && 0 > xlat_create_cache(ctx))
+        return 0;
+    if (NULL == ctx->xc->tier && 0 > xlat_create_tier(ctx))
+        return 0;
+
+    xc = ctx->xc;
+    tier = xc->tier;
+    start_cycles = ctx->cycles;
+    while (cycles > 0) {
+        if (!ctx->exec_flags) {
+            xlat_block_t *xb;
+
+            xlat_tier_service(tier);
+
+            // a record is only taken from the pool once the block is compiled,
+            // and a block may be published at any time
+            xb = xlat_lookup_block(xc, ctx->pc);
+            if (NULL != xb && NULL != XLAT_LOAD_ACQUIRE(&xb->block)) {
+                cycles -= xlat_run_block(ctx, xb, cycles);
+                if (XLAT_EXIT_HOT == xc->exit_id)
+                    xlat_tier_heat(tier, ctx->pc);
+                continue;
+            }
+
+            // no exit is chained to code that is still interpreted. the count
+            // starts over once the block is queued, or if the queue is full,
+            // and is checked again on the next entry if the lock is busy
+            xc->pending = NULL;
+            if (++tier->visits[ctx->pc] >= XLAT_TIER_THRESHOLD &&
+                    xlat_tier_trylock(tier)) {
+                tier->visits[ctx->pc] = 0;
+                xlat_tier_request(tier, ctx->pc);
+                xlat_tier_unlock(tier);
+            }
+        }
+
+        // interpret up to the next branch, where another block is entered
+        do {
+            pc = ctx->pc;
+            if (NULL == tier->fns[pc]) {
+                tier->opcodes[pc] = (ctx->rom[pc] << 8)
+                                  | ctx->rom[(pc + 1) & ROM_MASK(ctx)];
+                tier->fns[pc] = c8_decode_opcode(tier->opcodes[pc]);
+            }
+            ctx->opcode = tier->opcodes[pc];
+            ctx->pc = (pc + 2) & ROM_MASK(ctx);
+
+            if (ctx->exec_flags && c8_debug_instruction(ctx, pc)) {
+                ctx->pc = pc;
+                return ctx->cycles - start_cycles;
+            }
+
+            // stores are made under the lock, as the compiler thread may be
+            // decoding guest memory
+            if (XLAT_TIER_STORE(ctx->opcode)) {
+                xlat_tier_lock(tier);
+                tier->fns[pc](ctx);
+                xlat_tier_unlock(tier);
+            }
+            else {
+                tier->fns[pc](ctx);
+            }
+
+            ++ctx->cycles;
+            --cycles;
+            if (0x1000 == (ctx->opcode & 0xF000) && !ctx->exec_flags)
+                cycles -= c8_skip_idle(ctx, cycles);
+        } while (cycles > 0 && ctx->pc == ((pc + 2) & ROM_MASK(ctx)));
+    }
+
+    return ctx->cycles - start_cycles;
+}
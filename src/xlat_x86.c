@@ -17,13 +17,42 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include "xlat.h"
 
-#ifdef ARCH_X86
-#define HOST_REGS 8
+// Host registers handed out by the allocator. Only callee-saved registers are
+// used, so guest values survive calls from translated code into the emulator.
+// XLAT_CTX_REG is callee-saved as well but never handed out.
+#if defined(ARCH_X86)
+const int xlat_host_regs[] = { 3, 5, 6 };
+#elif defined(PLATFORM_WIN32)
+const int xlat_host_regs[] = { 3, 5, 6, 7, 12, 13, 14 };
 #else
-#define HOST_REGS 16
+const int xlat_host_regs[] = { 3, 5, 12, 13, 14 };
+#endif
+
+#define HOST_REGS ((int)(sizeof(xlat_host_regs) / sizeof(xlat_host_regs[0])))
+const int xlat_num_host_regs = HOST_REGS;
+
+// registers preserved by the enter and exit stubs
+#define SAVED_REGS (HOST_REGS + 1)
+
+// Host registers that may hold pinned guest registers, taken from the end of
+// xlat_host_regs. Two allocatable registers are always left over, which is enough
+// for any single instruction. The 32-bit build has none to spare.
+#if !defined(ARCH_X86)
+static const int pin_regs[] = { 14, 13, 12 };
+#define PIN_REGS ((int)(sizeof(pin_regs) / sizeof(pin_regs[0])))
+#endif
+
+// Scratch register that holds the cache address within a single emitter. The
+// 32-bit build has none to spare, so one that is not an operand is saved
+// around the access instead.
+#if defined(ARCH_X86)
+#define DATA_REG(avoid) ((0 == (avoid)) ? 1 : 0)
+#else
+#define DATA_REG(avoid) 11
 #endif
 
 // -----------------------------------------------------------------------------
@@ -42,6 +71,31 @@ INLINE uint32_t memaddr(const xlat_block_t *xb, const void *addr, size_t length)
 #endif
 }
 
+// -----------------------------------------------------------------------------
+// Load the cache address from the context into a scratch register other than
+// avoid, for an access to the cache data. Pair with emit_data_done.
+static int emit_data_base(xlat_block_t *xb, int avoid)
+{
+    int reg = DATA_REG(avoid);
+#if defined(ARCH_X86)
+    xlat_emit_push_r32(xb, reg);
+#endif
+    xlat_emit_mov_rmr64_offset(xb, XLAT_CTX_REG, reg, XLAT_CTX(xc));
+    return reg;
+}
+
+// -----------------------------------------------------------------------------
+// Release the scratch register returned by emit_data_base.
+static void emit_data_done(xlat_block_t *xb, int reg)
+{
+#if defined(ARCH_X86)
+    xlat_emit_pop_r32(xb, reg);
+#else
+    (void)xb;
+    (void)reg;
+#endif
+}
+
 // -----------------------------------------------------------------------------
 // Write an arbitrary 8-bit value to the translation buffer.
 INLINE void emit_08(xlat_block_t *xb, uint8_t data)
@@ -50,10 +104,11 @@ INLINE void emit_08(xlat_block_t *xb, uint8_t data)
 }
 
 // -----------------------------------------------------------------------------
-// Write an arbitrary 16-bit value to the translation buffer.
+// Write an arbitrary 16-bit value to the translation buffer. Values wider than
+// a byte are copied, as instructions are not aligned.
 INLINE void emit_16(xlat_block_t *xb, uint16_t data)
 {
-    *(uint16_t *)xb->ptr = data;
+    memcpy(xb->ptr, &data, sizeof(data));
     xb->ptr += 2;
 }
 
@@ -70,7 +125,7 @@ INLINE void emit_24(xlat_block_t *xb, uint32_t data)
 // Write an arbitrary 32-bit value to the translation buffer.
 INLINE void emit_32(xlat_block_t *xb, uint32_t data)
 {
-    *(uint32_t *)xb->ptr = data;
+    memcpy(xb->ptr, &data, sizeof(data));
     xb->ptr += 4;
 }
 
@@ -78,7 +133,7 @@ INLINE void emit_32(xlat_block_t *xb, uint32_t data)
 // Write an arbitrary 64-bit value to the translation buffer.
 INLINE void emit_64(xlat_block_t *xb, uint64_t data)
 {
-    *(uint64_t *)xb->ptr = data;
+    memcpy(xb->ptr, &data, sizeof(data));
     xb->ptr += 8;
 }
 
@@ -130,6 +185,25 @@ INLINE void emit_rexrxb(xlat_block_t *xb, int w, int r, int x, int b)
         emit_rex(xb, w, r >= 8, x >= 8, b >= 8);
 }
 
+// -----------------------------------------------------------------------------
+// Byte operands 4-7 need a REX prefix to select SPL/BPL/SIL/DIL over AH-BH.
+INLINE void emit_rexr8(xlat_block_t *xb, int r)
+{
+    if (r >= 4) emit_rex(xb, 0, r >= 8, 0, 0);
+}
+
+// -----------------------------------------------------------------------------
+INLINE void emit_rexb8(xlat_block_t *xb, int b)
+{
+    if (b >= 4) emit_rex(xb, 0, 0, 0, b >= 8);
+}
+
+// -----------------------------------------------------------------------------
+INLINE void emit_rexrb8(xlat_block_t *xb, int r, int b)
+{
+    if ((r >= 4) || (b >= 4)) emit_rex(xb, 0, r >= 8, 0, b >= 8);
+}
+
 #else
 
 #define emit_rex(xb, w, r, x, b)
@@ -137,6 +211,9 @@ INLINE void emit_rexrxb(xlat_block_t *xb, int w, int r, int x, int b)
 #define emit_rexb(xb, w, b)
 #define emit_rexrb(xb, w, r, b)
 #define emit_rexrxb(xb, w, r, x, b)
+#define emit_rexr8(xb, r)
+#define emit_rexb8(xb, b)
+#define emit_rexrb8(xb, r, b)
 
 #endif
 
@@ -239,41 +316,51 @@ void emit_call_func_4(xlat_state_t *xs, void *func, uint64_t data1, uint64_t dat
 #endif
 }
 
+// -----------------------------------------------------------------------------
+// Emit an indirect call to f through its slot in the helper table, which keeps
+// the address of f out of the translated code. The table is found through the
+// context in rax, which every caller has reserved for the result.
+static void emit_call_helper(xlat_state_t *xs, void *f)
+{
+    void **slot = xlat_helper_slot(xs, f);
+    xlat_emit_mov_rmr64_offset(xs->xb, XLAT_CTX_REG, 0, XLAT_CTX(xc));
+    xlat_emit_mov_rmr64_offset(xs->xb, 0, 0,
+                               XLAT_CACHE_OFFSET(xs->ctx->xc, slot));
+    xlat_emit_call_r64(xs->xb, 0);
+}
+
 // -----------------------------------------------------------------------------
 void xlat_emit_call_0(xlat_state_t *xs, void *f)
 {
-    int rax = xlat_reserve_register_index(xs, 32, 0);
-    xlat_emit_mov_i64r64(xs->xb, (uint64_t)f, rax);
-    xlat_emit_call_r64(xs->xb, rax);
+    xlat_reserve_register_index(xs, 32, 0);
+    emit_call_helper(xs, f);
 }
 
 // -----------------------------------------------------------------------------
 void xlat_emit_call_1(xlat_state_t *xs, void *f, size_t d1)
 {
-    int rax = xlat_reserve_register_index(xs, 32, 0);
+    xlat_reserve_register_index(xs, 32, 0);
     int rdi = xlat_reserve_register_index(xs, 32, 7);
     xlat_emit_mov_i64r64(xs->xb, d1, rdi);
-    xlat_emit_mov_i64r64(xs->xb, (uint64_t)f, rax);
-    xlat_emit_call_r64(xs->xb, rax);
+    emit_call_helper(xs, f);
 }
 
 // -----------------------------------------------------------------------------
 void xlat_emit_call_2(xlat_state_t *xs, void *f, size_t d1, size_t d2)
 {
-    int rax = xlat_reserve_register_index(xs, 32, 0);
+    xlat_reserve_register_index(xs, 32, 0);
     int rdi = xlat_reserve_register_index(xs, 32, 7);
     int rsi = xlat_reserve_register_index(xs, 32, 6);
     xlat_emit_mov_i64r64(xs->xb, d1, rdi);
     xlat_emit_mov_i64r64(xs->xb, d2, rsi);
-    xlat_emit_mov_i64r64(xs->xb, (uint64_t)f, rax);
-    xlat_emit_call_r64(xs->xb, rax);
+    emit_call_helper(xs, f);
 }
 
 // -----------------------------------------------------------------------------
 void xlat_emit_call_4(xlat_state_t *xs, void *f, size_t d1, size_t d2,
         size_t d3, size_t d4)
 {
-    int rax = xlat_reserve_register_index(xs, 32, 0);
+    xlat_reserve_register_index(xs, 32, 0);
     int rdi = xlat_reserve_register_index(xs, 32, 7);
     int rsi = xlat_reserve_register_index(xs, 32, 6);
     int rdx = xlat_reserve_register_index(xs, 32, 2);
@@ -282,15 +369,14 @@ void xlat_emit_call_4(xlat_state_t *xs, void *f, size_t d1, size_t d2,
     xlat_emit_mov_i64r64(xs->xb, d2, rsi);
     xlat_emit_mov_i64r64(xs->xb, d3, rdx);
     xlat_emit_mov_i64r64(xs->xb, d4, rcx);
-    xlat_emit_mov_i64r64(xs->xb, (uint64_t)f, rax);
-    xlat_emit_call_r64(xs->xb, rax);
+    emit_call_helper(xs, f);
 }
 
 // -----------------------------------------------------------------------------
 void xlat_emit_call_5(xlat_state_t *xs, void *f, size_t d1, size_t d2,
         size_t d3, size_t d4, size_t d5)
 {
-    int rax = xlat_reserve_register_index(xs, 32, 0);
+    xlat_reserve_register_index(xs, 32, 0);
     int rdi = xlat_reserve_register_index(xs, 32, 7);
     int rsi = xlat_reserve_register_index(xs, 32, 6);
     int rdx = xlat_reserve_register_index(xs, 32, 2);
@@ -301,8 +387,46 @@ void xlat_emit_call_5(xlat_state_t *xs, void *f, size_t d1, size_t d2,
     xlat_emit_mov_i64r64(xs->xb, d3, rdx);
     xlat_emit_mov_i64r64(xs->xb, d4, rcx);
     xlat_emit_mov_i64r64(xs->xb, d5, r08);
-    xlat_emit_mov_i64r64(xs->xb, (uint64_t)f, rax);
-    xlat_emit_call_r64(xs->xb, rax);
+    emit_call_helper(xs, f);
+}
+
+// -----------------------------------------------------------------------------
+// Call f(ctx), passing the context held in XLAT_CTX_REG.
+void xlat_emit_call_ctx_0(xlat_state_t *xs, void *f)
+{
+    xlat_reserve_register_index(xs, 32, 0);
+    int rdi = xlat_reserve_register_index(xs, 32, 7);
+    xlat_emit_mov_r64r64(xs->xb, XLAT_CTX_REG, rdi);
+    emit_call_helper(xs, f);
+}
+
+// -----------------------------------------------------------------------------
+// Call f(ctx, d1).
+void xlat_emit_call_ctx_1(xlat_state_t *xs, void *f, size_t d1)
+{
+    xlat_reserve_register_index(xs, 32, 0);
+    int rdi = xlat_reserve_register_index(xs, 32, 7);
+    int rsi = xlat_reserve_register_index(xs, 32, 6);
+    xlat_emit_mov_r64r64(xs->xb, XLAT_CTX_REG, rdi);
+    xlat_emit_mov_i64r64(xs->xb, d1, rsi);
+    emit_call_helper(xs, f);
+}
+
+// -----------------------------------------------------------------------------
+// Call f(ctx, d1, d2, d3).
+void xlat_emit_call_ctx_3(xlat_state_t *xs, void *f, size_t d1, size_t d2,
+        size_t d3)
+{
+    xlat_reserve_register_index(xs, 32, 0);
+    int rdi = xlat_reserve_register_index(xs, 32, 7);
+    int rsi = xlat_reserve_register_index(xs, 32, 6);
+    int rdx = xlat_reserve_register_index(xs, 32, 2);
+    int rcx = xlat_reserve_register_index(xs, 32, 1);
+    xlat_emit_mov_r64r64(xs->xb, XLAT_CTX_REG, rdi);
+    xlat_emit_mov_i64r64(xs->xb, d1, rsi);
+    xlat_emit_mov_i64r64(xs->xb, d2, rdx);
+    xlat_emit_mov_i64r64(xs->xb, d3, rcx);
+    emit_call_helper(xs, f);
 }
 
 // -----------------------------------------------------------------------------
@@ -388,10 +512,64 @@ void xlat_emit_call_r64(xlat_block_t *xb, int rs)
     emit_modrm(xb, 3, 2, rs);
 }
 
+// -----------------------------------------------------------------------------
+// Emit a jump to target, or to the next instruction if target is NULL. The
+// returned site may later be retargeted with xlat_patch_jump.
+uint8_t *xlat_emit_jmp_i32(xlat_block_t *xb, void *target)
+{
+    uint8_t *site = xb->ptr;
+    emit_08(xb, 0xE9);
+    emit_32(xb, 0);
+    if (NULL != target)
+        xlat_patch_jump(site, target);
+    return site;
+}
+
+// -----------------------------------------------------------------------------
+// Emit a conditional jump using one of the XLAT_CC_* condition codes.
+uint8_t *xlat_emit_jcc_i32(xlat_block_t *xb, int cc, void *target)
+{
+    uint8_t *site = xb->ptr;
+    emit_08(xb, 0x0F);
+    emit_08(xb, 0x80 | (cc & 0xF));
+    emit_32(xb, 0);
+    if (NULL != target)
+        xlat_patch_jump(site, target);
+    return site;
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_jmp_r64(xlat_block_t *xb, int rs)
+{
+    emit_rexb(xb, 0, rs);
+    emit_08(xb, 0xFF);
+    emit_modrm(xb, 3, 4, rs);
+}
+
+// -----------------------------------------------------------------------------
+// Retarget a jump previously emitted by xlat_emit_jmp_i32 or xlat_emit_jcc_i32.
+void xlat_patch_jump(uint8_t *site, void *target)
+{
+    uint8_t *next = site + XLAT_JUMP_SIZE(site);
+    int64_t off = (int64_t)((uint8_t *)target - next);
+    uint32_t rel = (uint32_t)off;
+    assert(off <= 0x7FFFFFFF && off >= -0x7FFFFFFF);
+    memcpy(next - 4, &rel, sizeof(rel));
+}
+
+// -----------------------------------------------------------------------------
+// Make newly written code visible to instruction fetch. x86 keeps its caches
+// coherent with stores, so there is nothing to do.
+void xlat_flush_icache(void *start, long length)
+{
+    (void)start;
+    (void)length;
+}
+
 // -----------------------------------------------------------------------------
 void xlat_emit_or_r8r8(xlat_block_t *xb, int rs, int rd)
 {
-    emit_rexrb(xb, 0, rs, rd);
+    emit_rexrb8(xb, rs, rd);
     emit_08(xb, 0x08);
     emit_modrm(xb, 3, rs, rd);
 }
@@ -399,7 +577,7 @@ void xlat_emit_or_r8r8(xlat_block_t *xb, int rs, int rd)
 // -----------------------------------------------------------------------------
 void xlat_emit_and_r8r8(xlat_block_t *xb, int rs, int rd)
 {
-    emit_rexrb(xb, 0, rd, rs);
+    emit_rexrb8(xb, rd, rs);
     emit_08(xb, 0x22);
     emit_modrm(xb, 3, rd, rs);
 }
@@ -407,7 +585,7 @@ void xlat_emit_and_r8r8(xlat_block_t *xb, int rs, int rd)
 // -----------------------------------------------------------------------------
 void xlat_emit_xor_r8r8(xlat_block_t *xb, int rs, int rd)
 {
-    emit_rexrb(xb, 0, rd, rs);
+    emit_rexrb8(xb, rd, rs);
     emit_08(xb, 0x32);
     emit_modrm(xb, 3, rd, rs);
 }
@@ -415,15 +593,23 @@ void xlat_emit_xor_r8r8(xlat_block_t *xb, int rs, int rd)
 // -----------------------------------------------------------------------------
 void xlat_emit_add_r8r8(xlat_block_t *xb, int rs, int rd)
 {
-    emit_rexrb(xb, 0, rd, rs);
-    emit_08(xb, 0x00);
+    emit_rexrb8(xb, rd, rs);
+    emit_08(xb, 0x02);
+    emit_modrm(xb, 3, rd, rs);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_sub_r8r8(xlat_block_t *xb, int rs, int rd)
+{
+    emit_rexrb8(xb, rd, rs);
+    emit_08(xb, 0x2A);
     emit_modrm(xb, 3, rd, rs);
 }
 
 // -----------------------------------------------------------------------------
 void xlat_emit_or_i8r8(xlat_block_t *xb, uint8_t imm, int rd)
 {
-    emit_rexb(xb, 0, rd);
+    emit_rexb8(xb, rd);
     emit_08(xb, 0x80);
     emit_modrm(xb, 3, 1, rd);
     emit_08(xb, imm);
@@ -432,7 +618,7 @@ void xlat_emit_or_i8r8(xlat_block_t *xb, uint8_t imm, int rd)
 // -----------------------------------------------------------------------------
 void xlat_emit_and_i8r8(xlat_block_t *xb, uint8_t imm, int rd)
 {
-    emit_rexb(xb, 0, rd);
+    emit_rexb8(xb, rd);
     emit_08(xb, 0x80);
     emit_modrm(xb, 3, 4, rd);
     emit_08(xb, imm);
@@ -441,7 +627,7 @@ void xlat_emit_and_i8r8(xlat_block_t *xb, uint8_t imm, int rd)
 // -----------------------------------------------------------------------------
 void xlat_emit_xor_i8r8(xlat_block_t *xb, uint8_t imm, int rd)
 {
-    emit_rexb(xb, 0, rd);
+    emit_rexb8(xb, rd);
     emit_08(xb, 0x80);
     emit_modrm(xb, 3, 6, rd);
     emit_08(xb, imm);
@@ -450,7 +636,7 @@ void xlat_emit_xor_i8r8(xlat_block_t *xb, uint8_t imm, int rd)
 // -----------------------------------------------------------------------------
 void xlat_emit_add_i8r8(xlat_block_t *xb, uint8_t imm, int rd)
 {
-    emit_rexb(xb, 0, rd);
+    emit_rexb8(xb, rd);
     emit_08(xb, 0x80);
     emit_modrm(xb, 3, 0, rd);
     emit_08(xb, imm);
@@ -459,7 +645,20 @@ void xlat_emit_add_i8r8(xlat_block_t *xb, uint8_t imm, int rd)
 // -----------------------------------------------------------------------------
 void xlat_emit_and_i16r16(xlat_block_t *xb, uint16_t imm, int rd)
 {
+    emit_08(xb, 0x66);
+    emit_rexb(xb, 0, rd);
+    emit_08(xb, 0x81);
+    emit_modrm(xb, 3, 4, rd);
+    emit_16(xb, imm);
+}
 
+// -----------------------------------------------------------------------------
+void xlat_emit_and_i32r32(xlat_block_t *xb, uint32_t imm, int rd)
+{
+    emit_rexb(xb, 0, rd);
+    emit_08(xb, 0x81);
+    emit_modrm(xb, 3, 4, rd);
+    emit_32(xb, imm);
 }
 
 // -----------------------------------------------------------------------------
@@ -506,7 +705,7 @@ void xlat_emit_add_r64r64(xlat_block_t *xb, int rs, int rd)
 // -----------------------------------------------------------------------------
 void xlat_emit_mov_r8r8(xlat_block_t *xb, int rs, int rd)
 {
-    emit_rexrb(xb, 0, rs, rd);
+    emit_rexrb8(xb, rs, rd);
     emit_08(xb, 0x88);
     emit_modrm(xb, 3, rs, rd);
 }
@@ -514,7 +713,7 @@ void xlat_emit_mov_r8r8(xlat_block_t *xb, int rs, int rd)
 // -----------------------------------------------------------------------------
 void xlat_emit_mov_r8m8(xlat_block_t *xb, int rs, uint8_t *md)
 {
-    emit_rexr(xb, 0, rs);
+    emit_rexr8(xb, rs);
     emit_08(xb, 0x88);
     emit_modrm(xb, 0, rs, 5);
     emit_32(xb, memaddr(xb, md, 4));
@@ -523,7 +722,7 @@ void xlat_emit_mov_r8m8(xlat_block_t *xb, int rs, uint8_t *md)
 // -----------------------------------------------------------------------------
 void xlat_emit_mov_m8r8(xlat_block_t *xb, uint8_t *ms, int rd)
 {
-    emit_rexr(xb, 0, rd);
+    emit_rexr8(xb, rd);
     emit_08(xb, 0x8A);
     emit_modrm(xb, 0, rd, 5);
     emit_32(xb, memaddr(xb, ms, 4));
@@ -532,7 +731,7 @@ void xlat_emit_mov_m8r8(xlat_block_t *xb, uint8_t *ms, int rd)
 // -----------------------------------------------------------------------------
 void xlat_emit_mov_i8r8(xlat_block_t *xb, uint8_t is, int rd)
 {
-    emit_rexb(xb, 0, rd);
+    emit_rexb8(xb, rd);
     emit_08(xb, 0xB0 | (rd & 7));
     emit_08(xb, is);
 }
@@ -600,7 +799,7 @@ INLINE void WriteRmOffsetFrom(xlat_block_t *xb, int to, int from, int offset)
         }
     }
     else {
-        if( offset == 0 ) {
+        if( offset == 0 && (from&7) != 5 ) {
             emit_modrm(xb, 0, to, from );
         }
         else if( offset < 128 && offset >= -128 ) {
@@ -617,7 +816,7 @@ INLINE void WriteRmOffsetFrom(xlat_block_t *xb, int to, int from, int offset)
 // -----------------------------------------------------------------------------
 void xlat_emit_mov_rmr8(xlat_block_t *xb, int rs, int rd)
 {
-    emit_rexrb(xb, 0, rd, rs);
+    emit_rexrb8(xb, rd, rs);
     emit_08(xb, 0x8A);
     WriteRmOffsetFrom(xb, rd, rs, 0);
 }
@@ -625,11 +824,19 @@ void xlat_emit_mov_rmr8(xlat_block_t *xb, int rs, int rd)
 // -----------------------------------------------------------------------------
 void xlat_emit_mov_r8rm(xlat_block_t *xb, int rs, int rd)
 {
-    emit_rexrb(xb, 0, rs, rd);
+    emit_rexrb8(xb, rs, rd);
     emit_08(xb, 0x88);
     WriteRmOffsetFrom(xb, rs, rd, 0);
 }
 
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_r8rm_offset(xlat_block_t *xb, int rs, int rd, int off)
+{
+    emit_rexrb8(xb, rs, rd);
+    emit_08(xb, 0x88);
+    WriteRmOffsetFrom(xb, rs, rd, off);
+}
+
 // -----------------------------------------------------------------------------
 void xlat_emit_mov_r16m16(xlat_block_t *xb, int rs, uint16_t *md)
 {
@@ -659,6 +866,14 @@ void xlat_emit_mov_i16r16(xlat_block_t *xb, uint16_t is, int rd)
     emit_16(xb, is);
 }
 
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_i32r32(xlat_block_t *xb, uint32_t is, int rd)
+{
+    emit_rexb(xb, 0, rd);
+    emit_08(xb, 0xB8 | (rd & 0x7));
+    emit_32(xb, is);
+}
+
 // -----------------------------------------------------------------------------
 void xlat_emit_mov_i16m16(xlat_block_t *xb, uint16_t is, uint16_t *md)
 {
@@ -669,6 +884,63 @@ void xlat_emit_mov_i16m16(xlat_block_t *xb, uint16_t is, uint16_t *md)
     emit_16(xb, is); 
 }
 
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_i32m32(xlat_block_t *xb, uint32_t is, int md)
+{
+    int rb = emit_data_base(xb, -1);
+    xlat_emit_mov_i32rm_offset(xb, is, rb, md);
+    emit_data_done(xb, rb);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_m32r32(xlat_block_t *xb, int ms, int rd)
+{
+    int rb = emit_data_base(xb, rd);
+    xlat_emit_mov_rmr32_offset(xb, rb, rd, ms);
+    emit_data_done(xb, rb);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_r32m32(xlat_block_t *xb, int rs, int md)
+{
+    int rb = emit_data_base(xb, rs);
+    xlat_emit_mov_r32rm_offset(xb, rs, rb, md);
+    emit_data_done(xb, rb);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_m64r64(xlat_block_t *xb, int ms, int rd)
+{
+    int rb = emit_data_base(xb, rd);
+    xlat_emit_mov_rmr64_offset(xb, rb, rd, ms);
+    emit_data_done(xb, rb);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_r64m64(xlat_block_t *xb, int rs, int md)
+{
+    int rb = emit_data_base(xb, rs);
+    xlat_emit_mov_r64rm_offset(xb, rs, rb, md);
+    emit_data_done(xb, rb);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_r32r32(xlat_block_t *xb, int rs, int rd)
+{
+    emit_rexrb(xb, 0, rs, rd);
+    emit_08(xb, 0x89);
+    emit_modrm(xb, 3, rs, rd);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_i32rm_offset(xlat_block_t *xb, uint32_t is, int rd, int off)
+{
+    emit_rexb(xb, 0, rd);
+    emit_08(xb, 0xC7);
+    WriteRmOffsetFrom(xb, 0, rd, off);
+    emit_32(xb, is);
+}
+
 // -----------------------------------------------------------------------------
 void xlat_emit_mov_i16rm_index(xlat_block_t *xb, uint16_t is, int rb, int ri)
 {
@@ -705,13 +977,28 @@ void xlat_emit_mov_r16rm_offset(xlat_block_t *xb, int rs, int rd, int off)
     emit_08(xb, 0x66);
     emit_rexrb(xb, 0, rs, rd);
     emit_08(xb, 0x89);
-    emit_modrm(xb, 0, rs, rd );
+    WriteRmOffsetFrom(xb, rs, rd, off);
 }
 
 // -----------------------------------------------------------------------------
-void xlat_emit_mov_rmr16_scale(xlat_block_t *xb, int rs, int rb, int ri, int scale)
+void xlat_emit_mov_rmr32_offset(xlat_block_t *xb, int rs, int rd, int off)
+{
+    emit_rexrb(xb, 0, rd, rs);
+    emit_08(xb, 0x8B);
+    WriteRmOffsetFrom(xb, rd, rs, off);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_r32rm_offset(xlat_block_t *xb, int rs, int rd, int off)
+{
+    emit_rexrb(xb, 0, rs, rd);
+    emit_08(xb, 0x89);
+    WriteRmOffsetFrom(xb, rs, rd, off);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_rmr32_scale(xlat_block_t *xb, int rs, int rb, int ri, int scale)
 {
-    emit_08(xb, 0x66);
     emit_rexrxb(xb, 0, rs, ri, rb);
     emit_08(xb, 0x8B);
     emit_modrm(xb, 0, rs, 0x4 );
@@ -719,9 +1006,8 @@ void xlat_emit_mov_rmr16_scale(xlat_block_t *xb, int rs, int rb, int ri, int sca
 }
 
 // -----------------------------------------------------------------------------
-void xlat_emit_mov_r16rm_scale(xlat_block_t *xb, int rb, int ri, int scale, int rd)
+void xlat_emit_mov_r32rm_scale(xlat_block_t *xb, int rb, int ri, int scale, int rd)
 {
-    emit_08(xb, 0x66);
     emit_rexrxb(xb, 0, rd, ri, rb);
     emit_08(xb, 0x89);
     emit_modrm(xb, 0, rd, 0x4 );
@@ -744,6 +1030,29 @@ void xlat_emit_mov_r64rm_offset(xlat_block_t *xb, int rs, int rd, int off)
     WriteRmOffsetFrom(xb, rs, rd, off);
 }
 
+// -----------------------------------------------------------------------------
+void xlat_emit_mov_r64r64(xlat_block_t *xb, int rs, int rd)
+{
+    emit_rexrb(xb, 1, rs, rd);
+    emit_08(xb, 0x89);
+    emit_modrm(xb, 3, rs, rd);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_lea_rmr64_offset(xlat_block_t *xb, int rs, int rd, int off)
+{
+    emit_rexrb(xb, 1, rd, rs);
+    emit_08(xb, 0x8D);
+    WriteRmOffsetFrom(xb, rd, rs, off);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_lea_m64r64(xlat_block_t *xb, int ms, int rd)
+{
+    xlat_emit_mov_rmr64_offset(xb, XLAT_CTX_REG, rd, XLAT_CTX(xc));
+    xlat_emit_lea_rmr64_offset(xb, rd, rd, ms);
+}
+
 // -----------------------------------------------------------------------------
 void xlat_emit_mov_i64r64(xlat_block_t *xb, uint64_t is, int rd)
 {
@@ -770,6 +1079,30 @@ void xlat_emit_movzx_m16r32(xlat_block_t *xb, uint16_t *is, int rd)
     emit_32(xb, memaddr(xb, is, 4));
 }
 
+// -----------------------------------------------------------------------------
+void xlat_emit_movzx_rm8r32_offset(xlat_block_t *xb, int rs, int rd, int off)
+{
+    emit_rexrb(xb, 0, rd, rs);
+    emit_16(xb, 0xB60F);
+    WriteRmOffsetFrom(xb, rd, rs, off);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_movzx_rm16r32_offset(xlat_block_t *xb, int rs, int rd, int off)
+{
+    emit_rexrb(xb, 0, rd, rs);
+    emit_16(xb, 0xB70F);
+    WriteRmOffsetFrom(xb, rd, rs, off);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_movzx_r8r32(xlat_block_t *xb, int rs, int rd)
+{
+    emit_rexrb8(xb, rd, rs);
+    emit_16(xb, 0xB60F);
+    emit_modrm(xb, 3, rd, rs);
+}
+
 // -----------------------------------------------------------------------------
 void xlat_emit_movzx_m8r64(xlat_block_t *xb, uint8_t *is, int rd)
 {
@@ -778,7 +1111,7 @@ void xlat_emit_movzx_m8r64(xlat_block_t *xb, uint8_t *is, int rd)
 // -----------------------------------------------------------------------------
 void xlat_emit_cmp_r8r8(xlat_block_t *xb, int rs, int rd)
 {
-    emit_rexrb(xb, 0, rs, rd);
+    emit_rexrb8(xb, rs, rd);
     emit_08(xb, 0x3A);
     emit_modrm(xb, 3, rs, rd);
 }
@@ -786,7 +1119,7 @@ void xlat_emit_cmp_r8r8(xlat_block_t *xb, int rs, int rd)
 // -----------------------------------------------------------------------------
 void xlat_emit_cmp_i8r8(xlat_block_t *xb, uint8_t i8, int rd)
 {
-    emit_rexb(xb, 0, rd);
+    emit_rexb8(xb, rd);
     if (rd == 0) {
         emit_08(xb, 0x3C);
     } 
@@ -797,6 +1130,115 @@ void xlat_emit_cmp_i8r8(xlat_block_t *xb, uint8_t i8, int rd)
     emit_08(xb, i8);
 }
 
+// -----------------------------------------------------------------------------
+void xlat_emit_cmp_i32r32(xlat_block_t *xb, uint32_t is, int rd)
+{
+    emit_rexb(xb, 0, rd);
+    emit_08(xb, 0x81);
+    emit_modrm(xb, 3, 7, rd);
+    emit_32(xb, is);
+}
+
+// -----------------------------------------------------------------------------
+// Set rd to 1 if condition cc holds, otherwise 0.
+void xlat_emit_setcc_r8(xlat_block_t *xb, int cc, int rd)
+{
+    emit_rexb8(xb, rd);
+    emit_08(xb, 0x0F);
+    emit_08(xb, 0x90 | cc);
+    emit_modrm(xb, 3, 0, rd);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_test_r32r32(xlat_block_t *xb, int rs, int rd)
+{
+    emit_rexrb(xb, 0, rs, rd);
+    emit_08(xb, 0x85);
+    emit_modrm(xb, 3, rs, rd);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_test_r64r64(xlat_block_t *xb, int rs, int rd)
+{
+    emit_rexrb(xb, 1, rs, rd);
+    emit_08(xb, 0x85);
+    emit_modrm(xb, 3, rs, rd);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_cmp_r32m32(xlat_block_t *xb, int rs, int md)
+{
+    int rb = emit_data_base(xb, rs);
+    emit_rexrb(xb, 0, rs, rb);
+    emit_08(xb, 0x39);
+    WriteRmOffsetFrom(xb, rs, rb, md);
+    emit_data_done(xb, rb);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_cmp_r32rm_offset(xlat_block_t *xb, int rs, int rb, int off)
+{
+    emit_rexrb(xb, 0, rs, rb);
+    emit_08(xb, 0x39);
+    WriteRmOffsetFrom(xb, rs, rb, off);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_cmp_i32m32(xlat_block_t *xb, uint32_t is, int md)
+{
+    int rb = emit_data_base(xb, -1);
+    xlat_emit_cmp_i32rm_offset(xb, is, rb, md);
+    emit_data_done(xb, rb);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_cmp_i8m32(xlat_block_t *xb, int8_t is, int md)
+{
+    int rb = emit_data_base(xb, -1);
+    xlat_emit_cmp_i8rm_offset(xb, is, rb, md);
+    emit_data_done(xb, rb);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_cmp_i32rm_offset(xlat_block_t *xb, uint32_t is, int rd, int off)
+{
+    emit_rexb(xb, 0, rd);
+    emit_08(xb, 0x81);
+    WriteRmOffsetFrom(xb, 7, rd, off);
+    emit_32(xb, is);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_cmp_i8rm_offset(xlat_block_t *xb, int8_t is, int rd, int off)
+{
+    emit_rexb(xb, 0, rd);
+    emit_08(xb, 0x83);
+    WriteRmOffsetFrom(xb, 7, rd, off);
+    emit_08(xb, is);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_sub_i32m32(xlat_block_t *xb, uint32_t is, int md)
+{
+    int rb = emit_data_base(xb, -1);
+    emit_rexb(xb, 0, rb);
+    emit_08(xb, 0x81);
+    WriteRmOffsetFrom(xb, 5, rb, md);
+    emit_32(xb, is);
+    emit_data_done(xb, rb);
+}
+
+// -----------------------------------------------------------------------------
+void xlat_emit_add_i32m32(xlat_block_t *xb, uint32_t is, int md)
+{
+    int rb = emit_data_base(xb, -1);
+    emit_rexb(xb, 0, rb);
+    emit_08(xb, 0x81);
+    WriteRmOffsetFrom(xb, 0, rb, md);
+    emit_32(xb, is);
+    emit_data_done(xb, rb);
+}
+
 // -----------------------------------------------------------------------------
 void xlat_emit_cmove_r16m16(xlat_block_t *xb, int is, uint16_t *md)
 {
@@ -849,202 +1291,116 @@ void xlat_emit_shl_i8r64(xlat_block_t *xb, uint8_t imm, int rd)
 }
 
 // -----------------------------------------------------------------------------
-void xlat_emit_mul_r8(xlat_block_t *xb, int rs)
+void xlat_emit_shr_i8r8(xlat_block_t *xb, uint8_t imm, int rd)
 {
-    emit_rexb(xb, 0, rs);
-    emit_08(xb, 0xF6);
-    emit_modrm(xb, 3, 4, rs);
-}
-
-// -----------------------------------------------------------------------------
-int xlat_alloc_state(xlat_state_t *xs)
-{
-    int i;
-
-    // allocate and populate host register list
-    xs->num_free = HOST_REGS;
-    xs->free_regs = (int *)malloc(sizeof(int) * HOST_REGS);
-
-    for (i = 0; i < HOST_REGS; ++i)
-        xs->free_regs[i] = i;
-
-    // set all guest register mappings to unreserved state
-    for (i = 0; i < GUEST_REGS; ++i)
-        xs->reg_map[i] = -1;
-
-    return 0;
-}
-
-// -----------------------------------------------------------------------------
-void xlat_free_state(xlat_state_t *xs)
-{
-    assert(NULL != xs->free_regs);
-    SAFE_FREE(xs->free_regs);
-}
-
-// -----------------------------------------------------------------------------
-int xlat_reserve_register(xlat_state_t *xs, int bits, int reg, void *sync)
-{
-    if ((reg >= 0) && (xs->reg_map[reg] >= 0)) {
-        // the register is already reserved, just return its assigned index
-        return xs->reg_map[reg];
-    }
-
-    if (xs->num_free <= 0) {
-        // we're out of registers, need to do a replacement... (TODO)
-        assert(!"register replacement not yet implemented!");
-        return -1;
+    emit_rexb8(xb, rd);
+    if (imm == 1) {
+        emit_08(xb, 0xD0);
+        emit_modrm(xb, 3, 5, rd);
     }
     else {
-        // pull the next unreserved host register from the free list
-        int host_reg = xs->free_regs[--xs->num_free];
-        if ((reg < 0) || (NULL == sync))
-            return host_reg;
-        
-        assert((reg >= 0) && (NULL != sync));
-        xs->reg_map[reg] = host_reg;
-        xs->reg_bits[reg] = bits;
-        xs->reg_sync[reg] = sync;
-
-        // initialize the register using the emulator context
-        switch (bits) {
-        default:
-            assert(!"xlat_reserve_register: invalid bit width specified");
-            // fall through to 8-bit for release builds
-        case 8:
-            xlat_emit_movzx_m8r32(xs->xb, (uint8_t *)sync, host_reg);
-            break;
-        case 16:
-            xlat_emit_movzx_m16r32(xs->xb, (uint16_t *)sync, host_reg);
-            break;
-        }
-
-        return host_reg;
+        emit_08(xb, 0xC0);
+        emit_modrm(xb, 3, 5, rd);
+        emit_08(xb, imm);
     }
 }
 
 // -----------------------------------------------------------------------------
-int xlat_reserve_register_wo(xlat_state_t *xs, int bits, int reg, void *sync)
+void xlat_emit_shr_i8r32(xlat_block_t *xb, uint8_t imm, int rd)
 {
-    if ((reg >= 0) && (xs->reg_map[reg] >= 0)) {
-        // the register is already reserved, just return its assigned index
-        return xs->reg_map[reg];
-    }
-
-    if (xs->num_free <= 0) {
-        // we're out of registers, need to do a replacement... (TODO)
-        assert(!"register replacement not yet implemented!");
-        return -1;
+    emit_rexb(xb, 0, rd);
+    if (imm == 1) {
+        emit_08(xb, 0xD1);
+        emit_modrm(xb, 3, 5, rd);
     }
     else {
-        // pull the next unreserved host register from the free list
-        int host_reg = xs->free_regs[--xs->num_free];
-        if ((reg < 0) || (NULL == sync))
-            return host_reg;
-        
-        assert((reg >= 0) && (NULL != sync));
-        xs->reg_map[reg] = host_reg;
-        xs->reg_bits[reg] = bits;
-        xs->reg_sync[reg] = sync;
-        return host_reg;
+        emit_08(xb, 0xC1);
+        emit_modrm(xb, 3, 5, rd);
+        emit_08(xb, imm);
     }
 }
 
 // -----------------------------------------------------------------------------
-int xlat_reserve_register_temp(xlat_state_t *xs, int bits)
+void xlat_emit_imul_i32r32(xlat_block_t *xb, uint32_t is, int rs, int rd)
 {
-    return xlat_reserve_register(xs, bits, -1, NULL);
-}
-
-// -----------------------------------------------------------------------------
-int xlat_reserve_register_index(xlat_state_t *xs, int bits, int index)
-{
-    int i;
-    for (i = 0; i < GUEST_REGS; i++) {
-        if (xs->reg_map[i] == index) {
-            log_spew("ejecting register index %d (%d)\n", index, i);
-            xlat_free_register(xs, i);
-            break;
-        }
-    }
-    return index;
+    emit_rexrb(xb, 0, rd, rs);
+    emit_08(xb, 0x69);
+    emit_modrm(xb, 3, rd, rs);
+    emit_32(xb, is);
 }
 
 // -----------------------------------------------------------------------------
-void xlat_commit_register(xlat_state_t *xs, int bits, int reg)
+void xlat_emit_mul_r8(xlat_block_t *xb, int rs)
 {
-    void *reg_sync = xs->reg_sync[reg];
-    int host_reg = xs->reg_map[reg];
-    if (host_reg < 0)
-        return;
-
-    switch (bits) {
-    default:
-        assert(!"xlat_free_register: invalid bit width specified");
-        // fall through to 8-bit for release builds
-    case 8:
-        xlat_emit_mov_r8m8(xs->xb, host_reg, (uint8_t *)reg_sync);
-        break;
-    case 16:
-        xlat_emit_mov_r16m16(xs->xb, host_reg, (uint16_t *)reg_sync);
-        break;
-    }
+    emit_rexb8(xb, rs);
+    emit_08(xb, 0xF6);
+    emit_modrm(xb, 3, 4, rs);
 }
 
 // -----------------------------------------------------------------------------
-void xlat_free_register(xlat_state_t *xs, int reg)
+// Hand out host registers to the first count entries of pins, whose guest
+// register, width and offset are already filled in. Returns how many could
+// be pinned.
+int xlat_assign_pins(xlat_pin_t *pins, int count)
 {
-    if (xs->reg_map[reg] < 0) {
-        assert(!"attempting to free unreserved register");
-        return;
-    }
-
-    // write register back to the emulator context and add to unreserved list
-    xs->free_regs[xs->num_free++] = xs->reg_map[reg];
-    xlat_commit_register(xs, xs->reg_bits[reg], reg);
+#if defined(ARCH_X86)
+    return 0;
+#else
+    int i;
+    count = MIN(count, PIN_REGS);
+    for (i = 0; i < count; ++i)
+        pins[i].host_reg = pin_regs[i];
+    return count;
+#endif
 }
 
 // -----------------------------------------------------------------------------
-void xlat_free_register_temp(xlat_state_t *xs, int host_reg)
+// Emit the trampoline that C code calls to run a translated block. It saves
+// the allocatable registers, aligns the stack, loads the context into
+// XLAT_CTX_REG, loads the pinned guest registers and jumps to the code.
+void xlat_emit_enter_stub(const xlat_cache_t *xc, xlat_block_t *xb)
 {
-    xs->free_regs[xs->num_free++] = host_reg;
-}
+    int i;
 
-// -----------------------------------------------------------------------------
-void xlat_emit_prologue(xlat_state_t *state)
-{
-    // save the reserved registers to the stack before we continue
-#ifdef PLATFORM_WIN32
-    xlat_emit_push_r32(state->xb, 3);
-    xlat_emit_push_r32(state->xb, 6);
-    xlat_emit_push_r32(state->xb, 7);
+    for (i = 0; i < HOST_REGS; ++i)
+        xlat_emit_push_r32(xb, xlat_host_regs[i]);
+    xlat_emit_push_r32(xb, XLAT_CTX_REG);
+    if (!(SAVED_REGS & 1))
+        xlat_emit_sub_sp(xb, 8);
+
+#if defined(ARCH_X86)
+    i = (SAVED_REGS + !(SAVED_REGS & 1) * 2 + 1) * (int)sizeof(void *);
+    xlat_emit_mov_rmr64_offset(xb, 4, XLAT_CTX_REG, i + (int)sizeof(void *));
+    xlat_emit_mov_rmr64_offset(xb, 4, 0, i);
+#elif defined(PLATFORM_WIN32)
+    xlat_emit_mov_r64r64(xb, 2, XLAT_CTX_REG);
+    xlat_emit_mov_r64r64(xb, 1, 0);
 #else
-    xlat_emit_push_r32(state->xb, 0xC);
-    xlat_emit_push_r32(state->xb, 0xE);
-#endif // PLATFORM_WIN32
+    xlat_emit_mov_r64r64(xb, 6, XLAT_CTX_REG);
+    xlat_emit_mov_r64r64(xb, 7, 0);
+#endif
+
+    for (i = 0; i < xc->num_pins; ++i)
+        xlat_emit_load_field(xb, xc->pins[i].bits, xc->pins[i].host_reg,
+                             xc->pins[i].offset);
+    xlat_emit_jmp_r64(xb, 0);
 }
 
 // -----------------------------------------------------------------------------
-void xlat_emit_epilogue(xlat_state_t *state)
+// Emit the code every block exit jumps to in order to return to the caller
+// of the enter stub. Pinned guest registers are written back on the way out.
+void xlat_emit_exit_stub(const xlat_cache_t *xc, xlat_block_t *xb)
 {
     int i;
 
-    // commit updated registers to the emulator context
-    for (i = 0; i < GUEST_REGS; ++i)
-        if (state->reg_map[i] >= 0)
-            xlat_free_register(state, i);
+    for (i = 0; i < xc->num_pins; ++i)
+        xlat_emit_store_field(xb, xc->pins[i].bits, xc->pins[i].host_reg,
+                              xc->pins[i].offset);
 
-    // pop the reserved registers from the stack before returning to interpreter
-#ifdef PLATFORM_WIN32
-    xlat_emit_pop_r32(state->xb, 7);
-    xlat_emit_pop_r32(state->xb, 6);
-    xlat_emit_pop_r32(state->xb, 3);
-#else
-    xlat_emit_pop_r32(state->xb, 0xE);
-    xlat_emit_pop_r32(state->xb, 0xC);
-#endif // PLATFORM_WIN32
-
-    // generate a return to escape back to the interpreter
-    xlat_emit_ret(state->xb);
+    if (!(SAVED_REGS & 1))
+        xlat_emit_add_sp(xb, 8);
+    xlat_emit_pop_r32(xb, XLAT_CTX_REG);
+    for (i = HOST_REGS - 1; i >= 0; --i)
+        xlat_emit_pop_r32(xb, xlat_host_regs[i]);
+    xlat_emit_ret(xb);
 }
-
@@ -0,0 +1,191 @@
+// gchip - a simple recompiling chip-8 emulator
+// Copyright (C) 2011  Garrett Smith.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "gen.h"
+
+// Random programs for the tests. Each is well behaved: it never leaves its
+// own code, never overflows the stack and only stores into scratch memory or
+// into its own code where a statement patches itself.
+
+// layout of a generated program: main loop, subroutines, and scratch memory
+#define GEN_MAIN        0x200
+#define GEN_SUBS        0x400
+#define GEN_SUB_SIZE    0x40
+#define GEN_MAX_SUBS    6
+#define GEN_DATA        0x700
+
+static uint16_t image[(GEN_DATA - GEN_MAIN) / 2];
+static int image_pos;
+static uint32_t gen_state;
+
+// -----------------------------------------------------------------------------
+// Small LCG, so the programs are the same whatever the C library's rand is.
+static int gen_rand(int n)
+{
+    gen_state = gen_state * 1103515245 + 12345;
+    return (int)((gen_state >> 16) % (uint32_t)n);
+}
+
+// -----------------------------------------------------------------------------
+static void gen_put(int opcode)
+{
+    image[image_pos++] = (uint16_t)opcode;
+}
+
+// -----------------------------------------------------------------------------
+static int gen_addr(int pos)
+{
+    return GEN_MAIN + pos * 2;
+}
+
+// -----------------------------------------------------------------------------
+// Emit one statement: a few instructions that never leave the program, never
+// overflow the stack and only store into the scratch area or, through I
+// wrapping around the top of memory, below the program.
+static void gen_statement(int sub, int num_subs)
+{
+    int x = gen_rand(8), y = gen_rand(8), n, i;
+
+    switch (gen_rand(21)) {
+    case 0:  gen_put(0x6000 | x << 8 | gen_rand(0x100)); break;
+    case 1:  gen_put(0x7000 | x << 8 | gen_rand(0x100)); break;
+    case 2:  gen_put(0x8000 | x << 8 | y << 4 | gen_rand(4)); break;
+    case 3:  // arithmetic whose flag is consumed
+        gen_put(0x8000 | x << 8 | y << 4 | (4 + gen_rand(4)));
+        gen_put(0x8F04 | gen_rand(8) << 4);
+        break;
+    case 4:  // shifts whose flag is consumed, or overwritten
+        gen_put(0x8006 | x << 8 | y << 4 | (gen_rand(2) ? 8 : 0));
+        gen_put(gen_rand(2) ? 0x3F01 : 0x8006 | y << 8 | x << 4);
+        gen_put(0x7001 | x << 8);
+        break;
+    case 5:  // skips over one instruction
+        gen_put((gen_rand(2) ? 0x3000 : 0x4000) | x << 8 | gen_rand(4));
+        gen_put(0x7003 | y << 8);
+        break;
+    case 6:
+        gen_put((gen_rand(2) ? 0x5000 : 0x9000) | x << 8 | y << 4);
+        gen_put(0x8014 | x << 8);
+        break;
+    case 7:  // forward jump over dead code
+        n = 1 + gen_rand(3);
+        gen_put(0x1000 | gen_addr(image_pos + 1 + n));
+        while (n--)
+            gen_put(0x00E0);
+        break;
+    case 8:
+    case 9:  // call a later subroutine, so the call depth is bounded
+        if (sub + 1 < num_subs)
+            gen_put(0x2000 | (GEN_SUBS + GEN_SUB_SIZE *
+                        (sub + 1 + gen_rand(num_subs - sub - 1))));
+        break;
+    case 10: // store and load through I
+        gen_put(0xA000 | (GEN_DATA + gen_rand(0xF0)));
+        gen_put(0xF033 | x << 8);
+        gen_put(0xF065 | gen_rand(4) << 8);
+        break;
+    case 11:
+        gen_put(0xA000 | (GEN_DATA + gen_rand(0xF0)));
+        gen_put(0xF055 | gen_rand(4) << 8);
+        break;
+    case 12: // add to I; the flag is consumed before I is used again
+        gen_put(0xA000 | (GEN_DATA + gen_rand(0x100)));
+        gen_put(0xF01E | x << 8);
+        gen_put(0x8F04 | y << 4);
+        break;
+    case 13: // patch the immediate of an add further down the same block
+        gen_put(0xA000 | (gen_addr(image_pos + 2) + 1));
+        gen_put(0xF055);
+        gen_put(0x7100);
+        break;
+    case 14: // computed jump through a table
+        n = gen_rand(3);
+        gen_put(0x6000 | n * 2);
+        gen_put(0xB000 | gen_addr(image_pos + 1));
+        for (i = 0; i < 3; ++i)
+            gen_put(0x1000 | gen_addr(image_pos + 3 - i));
+        break;
+    case 15: // wait for the delay timer, an idle loop
+        gen_put(0x6000 | x << 8 | (1 + gen_rand(4)));
+        gen_put(0xF015 | x << 8);
+        gen_put(0xF007 | x << 8);
+        gen_put(0x3000 | x << 8);
+        gen_put(0x1000 | gen_addr(image_pos - 2));
+        break;
+    case 16: // draw a font character
+        gen_put(0xF029 | x << 8);
+        gen_put(0xD005 | x << 8 | y << 4);
+        gen_put(0x3F00);
+        gen_put(0x7101);
+        break;
+    case 17:
+        gen_put(0xC000 | x << 8 | gen_rand(0x100));
+        break;
+    case 18: // keys are never pressed; only the low nibble selects one
+        gen_put(0x6000 | x << 8 | gen_rand(0x100));
+        gen_put((gen_rand(2) ? 0xE09E : 0xE0A1) | x << 8);
+        gen_put(0x7201);
+        break;
+    case 19: // store or load through I as it wraps around the top of memory
+        gen_put(0xAFF8 | gen_rand(8));
+        gen_put(0xF01E | x << 8);
+        gen_put((gen_rand(2) ? 0xF055 : 0xF065) | gen_rand(8) << 8);
+        break;
+    default:
+        gen_put(0x8004 | x << 8 | y << 4);
+        break;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Write a random well-behaved program for seed to path.
+int gen_program(const char *path, int seed)
+{
+    int num_subs, sub, k, end;
+    FILE *fp;
+
+    gen_state = (uint32_t)seed;
+    memset(image, 0, sizeof(image));
+    num_subs = gen_rand(GEN_MAX_SUBS + 1);
+
+    // main loop, which either repeats forever or exits
+    image_pos = 0;
+    for (k = 10 + gen_rand(40); k > 0; --k)
+        gen_statement(-1, num_subs);
+    gen_put((seed % 8 == 7) ? 0x00FD : 0x1000 | GEN_MAIN);
+
+    // each subroutine only calls those after it
+    for (sub = 0; sub < num_subs; ++sub) {
+        image_pos = (GEN_SUBS + sub * GEN_SUB_SIZE - GEN_MAIN) / 2;
+        end = image_pos + GEN_SUB_SIZE / 2 - 8;
+        for (k = 3 + gen_rand(8); k > 0 && image_pos < end; --k)
+            gen_statement(sub, num_subs);
+        gen_put(0x00EE);
+    }
+
+    if (NULL == (fp = fopen(path, "wb")))
+        return -1;
+    for (k = 0; k < (int)(sizeof(image) / sizeof(image[0])); ++k) {
+        fputc(image[k] >> 8, fp);
+        fputc(image[k] & 0xFF, fp);
+    }
+    fclose(fp);
+    return 0;
+}
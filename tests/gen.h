@@ -0,0 +1,29 @@
+// gchip - a simple recompiling chip-8 emulator
+// Copyright (C) 2011  Garrett Smith.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#ifndef GCHIP_TESTS_GEN__H
+#define GCHIP_TESTS_GEN__H
+
+// number of programs generated when no roms are given
+#define GEN_PROGRAMS    48
+
+// instructions each program runs unless told otherwise
+#define GEN_CYCLES      100000
+
+int gen_program(const char *path, int seed);
+
+#endif // GCHIP_TESTS_GEN__H
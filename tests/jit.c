@@ -0,0 +1,477 @@
+// gchip - a simple recompiling chip-8 emulator
+// Copyright (C) 2011  Garrett Smith.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "chip8.h"
+#include "gen.h"
+
+// instructions each run takes, enough for the programs to reach all of their
+// blocks
+#define JIT_CYCLES 20000
+
+// most symbols read back from a perf map
+#define JIT_MAX_SYMBOLS 4096
+
+// the list of symbol files read by gdb, whose layout is fixed by gdb
+struct jit_code_entry {
+    struct jit_code_entry *next_entry;
+    struct jit_code_entry *prev_entry;
+    const char *symfile_addr;
+    uint64_t symfile_size;
+};
+
+struct jit_descriptor {
+    uint32_t version;
+    uint32_t action_flag;
+    struct jit_code_entry *relevant_entry;
+    struct jit_code_entry *first_entry;
+};
+
+extern struct jit_descriptor __jit_debug_descriptor;
+
+// count a failed check on the program at path
+#define JIT_CHECK(cond) \
+    ((cond) ? 0 : (log_err("%s: check failed: %s\n", path, #cond), 1))
+
+// -----------------------------------------------------------------------------
+// Run the program at path translated, with the given jit flags and cache
+// directory, in lockstep with the case interpreter. Sets *loaded to the number
+// of blocks the program started with, and *stats to the statistics at the end
+// of the run. Returns nonzero if the two disagreed.
+static int jit_run(const char *path, int flags, const char *dir, int *loaded,
+                   c8_jit_stats_t *stats)
+{
+    c8_context_t *intp, *other;
+    c8_jit_stats_t start;
+    int result = 1;
+
+    c8_create_context(&intp, MODE_CASE);
+    c8_create_context(&other, MODE_DBT);
+    c8_set_jit_flags(other, flags);
+    c8_set_jit_cache(other, dir);
+
+    memset(&start, 0, sizeof(start));
+    memset(stats, 0, sizeof(*stats));
+    if ((0 > c8_load_file(intp, path)) || (0 > c8_load_file(other, path))) {
+        log_err("error: failed to load rom\n");
+    }
+    else {
+        c8_get_jit_stats(other, &start);
+        result = c8_debug_lockstep(intp, other, JIT_CYCLES);
+        c8_get_jit_stats(other, stats);
+    }
+    *loaded = start.live;
+
+    c8_destroy_context(intp);
+    c8_destroy_context(other);
+    return result;
+}
+
+// -----------------------------------------------------------------------------
+// Find the saved cache under dir, of which there must be one, and read it.
+// Returns the contents and sets *size and name, or NULL if there is none.
+static char *jit_read_cache(const char *dir, char *name, int name_size,
+                            long *size)
+{
+    struct dirent *de;
+    char *data = NULL;
+    FILE *fp = NULL;
+    DIR *d;
+
+    if (NULL == (d = opendir(dir)))
+        return NULL;
+    while (NULL != (de = readdir(d))) {
+        if (NULL != strstr(de->d_name, ".xlc")) {
+            snprintf(name, name_size, "%s/%s", dir, de->d_name);
+            fp = fopen(name, "rb");
+            break;
+        }
+    }
+    closedir(d);
+    if (NULL == fp)
+        return NULL;
+
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    data = (char *)malloc(*size + 1);
+    if (NULL != data && (size_t)*size != fread(data, 1, *size, fp)) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    return data;
+}
+
+// -----------------------------------------------------------------------------
+// Remove every saved cache under dir.
+static void jit_clear_cache(const char *dir)
+{
+    struct dirent *de;
+    char name[512];
+    DIR *d;
+
+    if (NULL == (d = opendir(dir)))
+        return;
+    while (NULL != (de = readdir(d))) {
+        if (NULL != strstr(de->d_name, ".xlc")) {
+            snprintf(name, sizeof(name), "%s/%s", dir, de->d_name);
+            remove(name);
+        }
+    }
+    closedir(d);
+}
+
+// -----------------------------------------------------------------------------
+static void jit_write_file(const char *name, const char *data, long size)
+{
+    FILE *fp = fopen(name, "wb");
+    if (NULL == fp)
+        return;
+    fwrite(data, 1, size, fp);
+    fclose(fp);
+}
+
+// -----------------------------------------------------------------------------
+// Run each generated program twice with a cache under dir, checking that the
+// second run starts from the blocks the first saved and that both still agree
+// with the interpreter. The saved file is then cut short, damaged and replaced
+// by the cache of another program, each of which must be ignored.
+static int jit_test_cache(const char *dir)
+{
+    char path[32], name[512], *data, *stale = NULL;
+    long size, stale_size = 0;
+    int seed, loaded, failed = 0;
+    c8_jit_stats_t stats;
+
+    for (seed = 0; seed < GEN_PROGRAMS; ++seed) {
+        long cuts[4];
+        int i;
+
+        snprintf(path, sizeof(path), "jit-%02d.ch8", seed);
+        if (0 > gen_program(path, seed)) {
+            log_err("error: failed to write %s\n", path);
+            return 1;
+        }
+
+        jit_clear_cache(dir);
+        failed += JIT_CHECK(0 == jit_run(path, 0, dir, &loaded, &stats));
+        failed += JIT_CHECK(0 == loaded);
+
+        data = jit_read_cache(dir, name, sizeof(name), &size);
+        if (JIT_CHECK(NULL != data)) {
+            ++failed;
+            continue;
+        }
+
+        failed += JIT_CHECK(0 == jit_run(path, 0, dir, &loaded, &stats));
+        failed += JIT_CHECK(loaded > 0);
+
+        // a file cut short anywhere, from the header on, is dropped whole
+        cuts[0] = 0;
+        cuts[1] = 16;
+        cuts[2] = size / 2;
+        cuts[3] = size - 1;
+        for (i = 0; i < 4; ++i) {
+            jit_write_file(name, data, cuts[i]);
+            failed += JIT_CHECK(0 == jit_run(path, 0, dir, &loaded, &stats));
+            failed += JIT_CHECK(0 == loaded);
+        }
+
+        data[0] ^= 0xFF;
+        jit_write_file(name, data, size);
+        failed += JIT_CHECK(0 == jit_run(path, 0, dir, &loaded, &stats));
+        failed += JIT_CHECK(0 == loaded);
+        data[0] ^= 0xFF;
+
+        // the previous program's translations, under this program's name
+        if (NULL != stale) {
+            jit_write_file(name, stale, stale_size);
+            failed += JIT_CHECK(0 == jit_run(path, 0, dir, &loaded, &stats));
+            failed += JIT_CHECK(0 == loaded);
+        }
+        free(stale);
+        stale = data;
+        stale_size = size;
+    }
+
+    free(stale);
+    jit_clear_cache(dir);
+    return failed;
+}
+
+// -----------------------------------------------------------------------------
+// Check that a ranking of live blocks is in order and that each entry adds up.
+static int jit_check_ranking(const char *path, const c8_jit_block_t *top,
+                             int by_cycles)
+{
+    int i, failed = 0;
+
+    for (i = 0; i < JIT_TOP; ++i) {
+        failed += JIT_CHECK(top[i].cycles == top[i].visits * top[i].length);
+        if (0 == top[i].visits)
+            continue;
+        failed += JIT_CHECK(top[i].length > 0);
+        if (i > 0 && by_cycles)
+            failed += JIT_CHECK(top[i].cycles <= top[i - 1].cycles);
+        else if (i > 0)
+            failed += JIT_CHECK(top[i].visits <= top[i - 1].visits);
+    }
+    return failed;
+}
+
+// -----------------------------------------------------------------------------
+// Run each generated program for JIT_CYCLES instructions and check that the
+// statistics agree with each other. Over all of the programs, which patch
+// their own code and wait on the delay timer, blocks must have been dropped
+// and idle loops skipped.
+static int jit_test_stats(void)
+{
+    long exits[JIT_EXITS] = { 0 }, invalidations = 0, sum;
+    c8_jit_stats_t stats;
+    c8_context_t *ctx;
+    int seed, loaded, i, failed = 0;
+    char path[32];
+
+    // only translated modes have statistics
+    c8_create_context(&ctx, MODE_CASE);
+    strcpy(path, "case");
+    failed += JIT_CHECK(0 > c8_get_jit_stats(ctx, &stats));
+    c8_destroy_context(ctx);
+
+    for (seed = 0; seed < GEN_PROGRAMS; ++seed) {
+        snprintf(path, sizeof(path), "jit-%02d.ch8", seed);
+        if (0 > gen_program(path, seed)) {
+            log_err("error: failed to write %s\n", path);
+            return 1;
+        }
+        failed += JIT_CHECK(0 == jit_run(path, JIT_STATS, NULL, &loaded,
+                                         &stats));
+
+        failed += JIT_CHECK(stats.blocks > 0);
+        failed += JIT_CHECK(stats.traces <= stats.blocks);
+        failed += JIT_CHECK(stats.translate_ms >= 0);
+        failed += JIT_CHECK(stats.guest_ops >= stats.blocks);
+        failed += JIT_CHECK(stats.host_bytes >= stats.guest_ops);
+        failed += JIT_CHECK(stats.live > 0 && stats.live <= stats.blocks);
+        failed += JIT_CHECK(stats.flushes >= 0);
+
+        for (i = sum = 0; i < JIT_LENGTHS; ++i)
+            sum += stats.lengths[i];
+        failed += JIT_CHECK(sum == stats.blocks);
+
+        // blocks are only run from the dispatcher, so every run ends in one
+        for (i = sum = 0; i < JIT_EXITS; ++i) {
+            exits[i] += stats.exits[i];
+            sum += stats.exits[i];
+        }
+        failed += JIT_CHECK(sum > 0);
+        failed += JIT_CHECK(stats.exits[JIT_EXIT_CHAIN] <= sum);
+        invalidations += stats.invalidations;
+
+        failed += JIT_CHECK(stats.top_visits[0].visits > 0);
+        failed += JIT_CHECK(stats.top_cycles[0].cycles > 0);
+        failed += jit_check_ranking(path, stats.top_visits, 0);
+        failed += jit_check_ranking(path, stats.top_cycles, 1);
+    }
+
+    strcpy(path, "all");
+    failed += JIT_CHECK(exits[JIT_EXIT_BUDGET] > 0);
+    failed += JIT_CHECK(exits[JIT_EXIT_IDLE] > 0);
+    failed += JIT_CHECK(invalidations > 0);
+    return failed;
+}
+
+// -----------------------------------------------------------------------------
+static int jit_compare_symbols(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+// -----------------------------------------------------------------------------
+// Run each generated program with a perf map and read the map back after the
+// run. It must name the stubs and then each live block exactly once, over
+// ranges of code that do not overlap, including every block ranked as hot.
+static int jit_test_perf(void)
+{
+    static unsigned long long ranges[JIT_MAX_SYMBOLS][2];
+    static unsigned int pcs[JIT_MAX_SYMBOLS];
+    char path[32], map[64], line[128], name[64];
+    unsigned long long addr;
+    unsigned long size;
+    int seed, loaded, count, i, j, failed = 0;
+    c8_jit_stats_t stats;
+    FILE *fp;
+
+    snprintf(map, sizeof(map), "/tmp/perf-%d.map", (int)getpid());
+    for (seed = 0; seed < GEN_PROGRAMS; ++seed) {
+        snprintf(path, sizeof(path), "jit-%02d.ch8", seed);
+        if (0 > gen_program(path, seed)) {
+            log_err("error: failed to write %s\n", path);
+            return 1;
+        }
+        remove(map);
+        failed += JIT_CHECK(0 == jit_run(path, JIT_PERF_MAP, NULL, &loaded,
+                                         &stats));
+
+        fp = fopen(map, "r");
+        if (JIT_CHECK(NULL != fp)) {
+            ++failed;
+            continue;
+        }
+
+        count = 0;
+        while (NULL != fgets(line, sizeof(line), fp) &&
+                count < JIT_MAX_SYMBOLS) {
+            if (JIT_CHECK(3 == sscanf(line, "%llx %lx %63s",
+                                      &addr, &size, name))) {
+                ++failed;
+                break;
+            }
+            failed += JIT_CHECK(0 != addr && size > 0);
+            if (0 == count)
+                failed += JIT_CHECK(!strcmp(name, "c8_stubs"));
+            else
+                failed += JIT_CHECK(
+                        1 == sscanf(name, "c8_block_0x%X_len", &pcs[count]) ||
+                        1 == sscanf(name, "c8_trace_0x%X_len", &pcs[count]));
+            ranges[count][0] = addr;
+            ranges[count][1] = addr + size;
+            ++count;
+        }
+        fclose(fp);
+        failed += JIT_CHECK(count == 1 + stats.live);
+
+        for (i = 0; i < JIT_TOP && stats.top_visits[i].visits > 0; ++i) {
+            for (j = 1; j < count; ++j) {
+                if (pcs[j] == (unsigned int)stats.top_visits[i].pc)
+                    break;
+            }
+            failed += JIT_CHECK(j < count);
+        }
+
+        qsort(ranges, count, sizeof(ranges[0]), jit_compare_symbols);
+        for (i = 1; i < count; ++i)
+            failed += JIT_CHECK(ranges[i - 1][1] <= ranges[i][0]);
+    }
+
+    remove(map);
+    return failed;
+}
+
+// -----------------------------------------------------------------------------
+// Return nonzero if the symbol file of entry names a translated block.
+static int jit_names_block(const struct jit_code_entry *entry)
+{
+    const char *p = entry->symfile_addr;
+    const char *end = p + entry->symfile_size;
+
+    for (; p + 11 <= end; ++p) {
+        if (!memcmp(p, "c8_block_0x", 11) || !memcmp(p, "c8_trace_0x", 11))
+            return 1;
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Run each generated program registered with gdb. While the program is loaded
+// gdb's list must hold a well formed ELF symbol file for each live block, and
+// once it is unloaded the list must be empty again.
+static int jit_test_gdb(void)
+{
+    struct jit_descriptor *jd = &__jit_debug_descriptor;
+    struct jit_code_entry *entry, *prev;
+    c8_context_t *intp, *other;
+    c8_jit_stats_t stats;
+    int seed, count, failed = 0;
+    char path[32];
+
+    for (seed = 0; seed < GEN_PROGRAMS; ++seed) {
+        snprintf(path, sizeof(path), "jit-%02d.ch8", seed);
+        if (0 > gen_program(path, seed)) {
+            log_err("error: failed to write %s\n", path);
+            return 1;
+        }
+
+        c8_create_context(&intp, MODE_CASE);
+        c8_create_context(&other, MODE_DBT);
+        c8_set_jit_flags(other, JIT_GDB);
+        if ((0 > c8_load_file(intp, path)) || (0 > c8_load_file(other, path))) {
+            log_err("error: failed to load rom\n");
+            ++failed;
+        }
+        else {
+            failed += JIT_CHECK(0 == c8_debug_lockstep(intp, other,
+                                                       JIT_CYCLES));
+            c8_get_jit_stats(other, &stats);
+
+            failed += JIT_CHECK(1 == jd->version);
+            failed += JIT_CHECK(NULL != jd->relevant_entry);
+            for (count = 0, prev = NULL, entry = jd->first_entry;
+                    NULL != entry; prev = entry, entry = entry->next_entry) {
+                failed += JIT_CHECK(prev == entry->prev_entry);
+                failed += JIT_CHECK(entry->symfile_size > 16 &&
+                        !memcmp(entry->symfile_addr, "\177ELF", 4));
+                failed += JIT_CHECK(jit_names_block(entry));
+                ++count;
+            }
+            failed += JIT_CHECK(count == stats.live);
+        }
+
+        c8_destroy_context(intp);
+        c8_destroy_context(other);
+        failed += JIT_CHECK(NULL == jd->first_entry);
+    }
+    return failed;
+}
+
+// -----------------------------------------------------------------------------
+// gchip-jit cache DIR | stats | perf | gdb
+//
+// Check the translation cache against generated programs, saving it under
+// DIR, or the statistics, perf map or gdb registrations produced for them.
+// Exits with the number of checks that failed.
+int main(int argc, char *argv[])
+{
+    int failed;
+
+    if (argc > 2 && !strcmp(argv[1], "cache")) {
+        failed = jit_test_cache(argv[2]);
+    }
+    else if (argc > 1 && !strcmp(argv[1], "stats")) {
+        failed = jit_test_stats();
+    }
+    else if (argc > 1 && !strcmp(argv[1], "perf")) {
+        failed = jit_test_perf();
+    }
+    else if (argc > 1 && !strcmp(argv[1], "gdb")) {
+        failed = jit_test_gdb();
+    }
+    else {
+        log_err("usage: %s cache DIR | stats | perf | gdb\n", argv[0]);
+        return 2;
+    }
+
+    log_info("%s: %d failed\n", argv[1], failed);
+    return failed;
+}
@@ -0,0 +1,76 @@
+// gchip - a simple recompiling chip-8 emulator
+// Copyright (C) 2011  Garrett Smith.
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+// or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+// for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chip8.h"
+#include "gen.h"
+
+// -----------------------------------------------------------------------------
+static int parse_mode(const char *name)
+{
+    if (!strcmp(name, "case"))   return MODE_CASE;
+    if (!strcmp(name, "ptr"))    return MODE_PTR;
+    if (!strcmp(name, "cache"))  return MODE_CACHE;
+    if (!strcmp(name, "dbt"))    return MODE_DBT;
+    if (!strcmp(name, "tiered")) return MODE_TIERED;
+    return -1;
+}
+
+// -----------------------------------------------------------------------------
+// gchip-lockstep MODE [CYCLES] [ROM...]
+//
+// Compare MODE against the case interpreter on each rom for CYCLES
+// instructions, or on generated programs if no roms are given. Exits with
+// the number of programs that failed.
+int main(int argc, char *argv[])
+{
+    long cycles = GEN_CYCLES;
+    int mode, seed, i, failed = 0;
+    char path[32];
+
+    if (argc < 2 || 0 > (mode = parse_mode(argv[1]))) {
+        log_err("usage: %s case|ptr|cache|dbt|tiered [CYCLES] [ROM...]\n",
+                argv[0]);
+        return 2;
+    }
+    if (argc > 2)
+        cycles = strtol(argv[2], NULL, 10);
+
+    for (i = 3; i < argc; ++i) {
+        if (!c8_debug_lockstep_test(argv[i], mode, cycles))
+            continue;
+        log_err("%s: FAILED\n", argv[i]);
+        ++failed;
+    }
+
+    for (seed = 0; argc <= 3 && seed < GEN_PROGRAMS; ++seed) {
+        snprintf(path, sizeof(path), "lockstep-%02d.ch8", seed);
+        if (0 > gen_program(path, seed)) {
+            log_err("error: failed to write %s\n", path);
+            return 2;
+        }
+        if (!c8_debug_lockstep_test(path, mode, cycles))
+            continue;
+        log_err("%s: FAILED (seed %d)\n", path, seed);
+        ++failed;
+    }
+
+    log_info("%s: %d failed\n", argv[1], failed);
+    return failed;
+}